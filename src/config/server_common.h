@@ -3,8 +3,53 @@
 
 #include "DList.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <deque>
 #include <vector>
 
+struct Blob;
+
+// a large value spliced into the byte stream without copying it
+struct BufRef {
+    uint64_t pos = 0;   // stream offset of the byte it precedes
+    Blob *blob = NULL;
+};
+
+// A byte buffer with a read cursor. Consuming from the front only advances
+// `data_begin`; the dead space is reclaimed by the next append that would
+// otherwise have to grow the allocation. See buffer_operations.h.
+struct Buffer {
+    uint8_t *buffer_begin = NULL;
+    uint8_t *buffer_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+    // blobs referenced by the responses, in stream order
+    std::deque<BufRef> refs;
+    uint64_t base = 0;      // stream offset of `data_begin`
+    size_t ref_off = 0;     // bytes of the first blob already consumed
+    size_t ref_bytes = 0;   // blob bytes not consumed yet
+
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer();
+
+    // the bytes only, not counting the referenced blobs
+    size_t size() const { return data_end - data_begin; }
+    // everything left to send
+    size_t total() const { return size() + ref_bytes; }
+    uint8_t *data() { return data_begin; }
+    const uint8_t *data() const { return data_begin; }
+    uint8_t &operator[](size_t i) { return data_begin[i]; }
+    const uint8_t &operator[](size_t i) const { return data_begin[i]; }
+};
+
+struct CmdArgs;
+struct AsyncCmd;
+
 struct Conn {
     int fd = -1;
 
@@ -12,12 +57,33 @@ struct Conn {
     bool want_write = false;
     bool want_close = false;
 
-    std::vector<uint8_t> incoming;
-    std::vector<uint8_t> outgoing;
+    Buffer incoming;
+    Buffer outgoing;
+    // with I/O threads: the requests at the front of `incoming`, parsed
+    // by the thread that read them; stale once `incoming` moves
+    std::vector<CmdArgs> parsed;
+    size_t parsed_used = 0;
 
     // timer
     uint64_t last_active_ms = 0;
     DList idle_node;
+
+    // event loop
+    uint32_t ev_mask = 0;   // interest registered with the backend
+    uint32_t io_ready = 0;  // cached readiness (edge-triggered mode)
+    // in-flight io_uring requests and forwarded commands referencing
+    // this conn; it is freed by the last of them
+    uint32_t refs = 0;
+    bool uring_recv = false;
+    bool uring_send = false;
+    // waiting for a response from another reactor
+    bool blocked = false;
+    uint32_t blocked_on = 0;    // the shard running the request
+    // the request parked there, like a blocking pop; only that shard
+    // touches this
+    AsyncCmd *parked = NULL;
+    // set when closed; `fd` is the owner's, other threads read this
+    std::atomic<bool> closed{false};
 };
 
 enum {
@@ -26,6 +92,4 @@ enum {
     RES_NX = 2, // Key not found (for GET operation)
 };
 
-typedef std::vector<uint8_t> Buffer;
-
 #endif
\ No newline at end of file
@@ -6,8 +6,29 @@
 
 const size_t k_max_msg = 32 << 20;
 const size_t k_max_args = 200 * 1000;
+// request args kept inline before spilling to the heap
+const size_t k_inline_args = 8;
+// longest accepted number argument
+const size_t k_max_num_len = 64;
 const uint64_t k_idle_timeout_ms =  300 * 1000;
-const size_t k_max_works = 2000;
+// the active expiry's time budget per loop iteration, doubled up to the
+// max while expired keys are left over
+const uint32_t k_expire_budget_us = 500;
+const uint32_t k_expire_budget_max_us = 8000;
 const size_t k_large_container_size = 1000;
+// longer blocking pop timeouts are cut to this, about ten years
+const uint64_t k_max_block_ms = 10ull * 365 * 24 * 3600 * 1000;
+// how often the loop checks on a BGSAVE child
+const uint64_t k_bgsave_poll_ms = 100;
+// minimum free space for a read() into Conn::incoming
+const size_t k_read_size = 64 * 1024;
+// values this large are kept in a Blob and sent without being copied
+const size_t k_blob_min = 16 * 1024;
+// segments per writev()
+const size_t k_max_iov = 64;
+// io_uring: ring size and the provided receive buffers
+const unsigned k_uring_entries = 256;
+const uint32_t k_uring_bufs = 512;
+const uint32_t k_uring_buf_size = 16 * 1024;
 
 #endif
\ No newline at end of file
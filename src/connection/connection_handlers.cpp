@@ -6,12 +6,14 @@
 #include "protocol_serialization.h"
 #include "data_store.h"
 #include "utils/timer.h"
+#include "event_loop.h"
+#include "reactor.h"
+#include "slab.h"
 
 #include <assert.h>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <sys/socket.h>
 #include <netinet/ip.h>
 #include <unistd.h>
 
@@ -21,13 +23,13 @@ static void response_begin(Buffer &out, size_t *header){
 };
 
 static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
+    return buf_total_from(out, header) - 4;
 }
 
 static void response_end(Buffer &out, size_t header){
     size_t msg_size = response_size(out, header);
     if (msg_size > k_max_msg){
-        out.resize(header + 4);
+        buf_truncate(out, header + 4);
         out_err(out, ERR_TOO_BIG, "response is too big.");
         msg_size = response_size(out, header);
     }
@@ -36,7 +38,19 @@ static void response_end(Buffer &out, size_t header){
     memcpy(&out[header], &len, 4);
 };
 
+// the request at the front of `incoming` is done with
+static void request_consume(Conn *conn, uint32_t len){
+    buf_consume(conn->incoming, 4 + len);
+    if(conn->parsed_used < conn->parsed.size()){
+        conn->parsed_used++;
+    }
+};
+
 bool try_one_request(Conn *conn){
+    // paused until another reactor responds
+    if(conn->blocked){
+        return false;
+    }
     // check incoming size
     if(conn->incoming.size() < 4){
         return false;
@@ -57,58 +71,164 @@ bool try_one_request(Conn *conn){
 
     const uint8_t *request = &conn->incoming[4];
 
-    std::vector<std::string> cmd;
-    if(parse_req(request,len,cmd) < 0){
+    // parsed already by an I/O thread, or here
+    CmdArgs local;
+    const CmdArgs *parsed = NULL;
+    if(conn->parsed_used < conn->parsed.size()){
+        parsed = &conn->parsed[conn->parsed_used];
+    } else if(parse_req(request, len, local) < 0){
         msg("bad request");
         conn->want_close = true;
         return false;
+    } else {
+        parsed = &local;
+    }
+    const CmdArgs &cmd = *parsed;
+
+    // the key is owned by another reactor
+    if(reactor_remote(cmd)){
+        if(conn->outgoing.total() > 0){
+            return false;   // keep the order, flush earlier responses first
+        }
+        reactor_forward(conn, cmd);
+        request_consume(conn, len);
+        return false;
     }
 
+    // may finish on the thread pool, keep the order the same way
+    if(conn->outgoing.total() > 0 && cmd_async(cmd)){
+        return false;
+    }
+
+    // nothing may be sent ahead of a deferred response
+    g_data.async_ok = conn->outgoing.total() == 0;
     size_t header_pos = 0;
     response_begin(conn->outgoing, &header_pos);
     do_request(cmd, conn->outgoing);
+    g_data.async_ok = false;
+    if(g_data.async){
+        // no response yet, the conn waits for it
+        buf_truncate(conn->outgoing, header_pos);
+        reactor_offload(conn, NULL);
+        request_consume(conn, len);
+        return false;
+    }
     response_end(conn->outgoing, header_pos);
 
-    buf_consume(conn->incoming, 4 +len);
+    request_consume(conn, len);
     return true;
 };
 
-void handle_write(Conn *conn){
+// parse requests and generate responses
+void handle_requests(Conn *conn){
+    while(try_one_request(conn)){}
+
+    //update readiness
+    if(conn->outgoing.total() > 0){
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+};
+
+// the response to a forwarded request, computed by another reactor
+void conn_resume(Conn *conn, Buffer &resp){
+    assert(conn->blocked && conn->outgoing.total() == 0);
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    buf_append_buf(conn->outgoing, resp);
+    response_end(conn->outgoing, header_pos);
+    conn->blocked = false;
+    // back on the idle timer, as of now
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    // requests pipelined behind the forwarded one
+    handle_requests(conn);
+};
+
+// A blocked conn sends nothing until its response is back, a blocking pop
+// for as long as its timeout, so it is off the idle timer meanwhile.
+void conn_block(Conn *conn){
+    conn->blocked = true;
+    dlist_detach(&conn->idle_node);
+    dlist_init(&conn->idle_node);
+};
+
+Conn *conn_idle_expired(uint64_t now_ms){
+    if(dlist_empty(&g_data.idle_list)){
+        return NULL;
+    }
+    Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
+    return conn->last_active_ms + k_idle_timeout_ms < now_ms ? conn : NULL;
+};
+
+// drop a reference, the last one frees a closed conn
+void conn_unref(Conn *conn){
+    assert(conn->refs > 0);
+    if(--conn->refs == 0 && conn->fd < 0){
+        conn_free(conn);
+    }
+};
+
+void conn_free(Conn *conn){
+    conn->~Conn();
+    slab_free(conn, sizeof(Conn));
+};
+
+// writev() once; true when everything was sent
+static bool write_some(Conn *conn){
     // check ooutgoin size > 0
-    assert(conn->outgoing.size() > 0);
-    // write to network
-    int rv = write(conn->fd, conn->outgoing.data(), conn->outgoing.size());
+    assert(conn->outgoing.total() > 0);
+    // write to network, large values straight from the keyspace
+    struct iovec iov[k_max_iov];
+    size_t cnt = buf_iov(conn->outgoing, iov, k_max_iov);
+    ssize_t rv = writev(conn->fd, iov, (int)cnt);
     // check if written 2
     if(rv < 0 && errno == EAGAIN){
-        return;
+        conn->io_ready &= ~EV_WRITE;
+        return false;
     }
 
     if(rv < 0){
-        msg("write() error");
-        return;
+        msg_errno("write() error");
+        conn->want_close = true;
+        return false;
     }
 
     //remove written from outgoing
     buf_consume(conn->outgoing, size_t(rv));
     // update readiness
-    if(conn->outgoing.size() == 0){
+    if(conn->outgoing.total() == 0){
         conn->want_read = true;
         conn->want_write = false;
+        return true;
     }
+    return false;
+};
 
+void handle_write(Conn *conn){
+    if(write_some(conn)){
+        // requests left behind while flushing
+        handle_requests(conn);
+    }
 };
 
-void handle_read(Conn *conn){
-    uint8_t buf[64*1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+// read() once; false on EAGAIN, EOF or an error
+static bool read_some(Conn *conn){
+    // the parsed requests view `incoming`, which may move
+    conn->parsed.clear();
+    conn->parsed_used = 0;
+    // read straight into the free space after the unparsed data
+    uint8_t *dst = buf_reserve(conn->incoming, k_read_size);
+    ssize_t rv = read(conn->fd, dst, buf_space(conn->incoming));
     if(rv < 0 && errno == EAGAIN){
-        return; // not read
+        conn->io_ready &= ~EV_READ;
+        return false; // not read
     }
 
     if (rv < 0){ // IO error
         msg_errno("read() error");
         conn->want_close = true;
-        return;
+        return false;
     }
 
     if(rv == 0){// EOF
@@ -118,24 +238,73 @@ void handle_read(Conn *conn){
             msg("Unexpected EOF");
         }
         conn->want_close = true;
-        return;
+        return false;
     }
 
-    // add data from buffer to Conn::incoming.
-    buf_append(conn->incoming, buf, (size_t)rv);
+    buf_commit(conn->incoming, (size_t)rv);
+    return true;
+};
+
+void handle_read(Conn *conn){
+    if(!read_some(conn)){
+        return;
+    }
 
     // parse requests and generate responses
-    while(try_one_request(conn)){}
+    handle_requests(conn);
 
     //update readiness
-    if(conn->outgoing.size() > 0){
-        conn->want_read = false;
-        conn->want_write = true;
+    if(conn->want_write){
         return handle_write(conn);
     }
 
 };
 
+// on an I/O thread: read, and parse the whole requests for the loop.
+// A bad one is left to try_one_request to report.
+void conn_read_io(Conn *conn){
+    if(!read_some(conn)){
+        return;
+    }
+    size_t pos = 0, size = conn->incoming.size();
+    while(size - pos >= 4){
+        uint32_t len = 0;
+        memcpy(&len, &conn->incoming[pos], 4);
+        if(len > k_max_msg || size - pos - 4 < len){
+            break;
+        }
+        conn->parsed.emplace_back();
+        if(parse_req(&conn->incoming[pos + 4], len, conn->parsed.back()) < 0){
+            conn->parsed.pop_back();
+            break;
+        }
+        pos += 4 + len;
+    }
+};
+
+// on an I/O thread: the loop runs the requests left behind afterwards
+void conn_write_io(Conn *conn){
+    write_some(conn);
+};
+
+static Conn *conn_new(int connfd){
+    // create a "struct Conn"
+    Conn *conn = new (slab_alloc(sizeof(Conn))) Conn();
+    conn->fd = connfd;
+    conn->want_read = true;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+
+    // put it into the map
+    if(g_data.fd2conn.size() <= (size_t)conn->fd){
+        g_data.fd2conn.resize(conn->fd + 1);
+    }
+
+    assert(!g_data.fd2conn[conn->fd]);
+    g_data.fd2conn[conn->fd] = conn;
+    return conn;
+};
+
 // application callback when thelistenin socket is ready
 Conn* handle_accept(int fd){
     // accept
@@ -143,7 +312,9 @@ Conn* handle_accept(int fd){
     socklen_t addrlen = sizeof(client_addr);
     int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
     if (connfd <  0){
-        msg_errno("accept() error");
+        if(errno != EAGAIN){
+            msg_errno("accept() error");
+        }
         return NULL;
     }
     uint32_t ip  = client_addr.sin_addr.s_addr;
@@ -155,19 +326,33 @@ Conn* handle_accept(int fd){
     // set the new conenction fd to nonblocking mode
     fd_set_nb(connfd);
 
-    // create a "struct Conn"
-    Conn *conn = new Conn();
-    conn->fd = connfd;
-    conn->want_read = true;
-    conn->last_active_ms = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    return conn_new(connfd);
+};
 
-    // put it into the map
-    if(g_data.fd2conn.size() <= (size_t)conn->fd){
-        g_data.fd2conn.resize(conn->fd + 1);
+#ifdef USE_IO_URING
+// io_uring: a connection accepted by the multishot accept
+Conn *uring_handle_accept(int connfd){
+    fprintf(stderr, "new client: %d\n", connfd);
+    return conn_new(connfd);
+};
+
+// io_uring: data received into a provided buffer
+void uring_handle_recv(Conn *conn, const uint8_t *data, size_t len){
+    buf_append(conn->incoming, data, len);
+    // while a response is in flight the requests are parsed later
+    if(conn->want_read){
+        handle_requests(conn);
     }
+};
 
-    assert(!g_data.fd2conn[conn->fd]);
-    g_data.fd2conn[conn->fd] = conn;
-    return conn;
-};
\ No newline at end of file
+// io_uring: `n` bytes of `outgoing` were sent
+void uring_handle_send(Conn *conn, size_t n){
+    buf_consume(conn->outgoing, n);
+    if(conn->outgoing.total() == 0){
+        conn->want_read = true;
+        conn->want_write = false;
+        // requests pipelined while the response was in flight
+        handle_requests(conn);
+    }
+};
+#endif
@@ -6,5 +6,22 @@
 void handle_write(Conn *conn);
 bool try_one_request(Conn *conn);
 void handle_read(Conn *conn);
+void handle_requests(Conn *conn);
+// the socket halves of handle_read and handle_write, for I/O threads
+void conn_read_io(Conn *conn);
+void conn_write_io(Conn *conn);
 Conn* handle_accept(int fd);
+void conn_resume(Conn *conn, Buffer &resp);
+// paused until conn_resume(), off the idle timer
+void conn_block(Conn *conn);
+// the least recently active conn if it timed out by `now_ms`, else NULL
+Conn *conn_idle_expired(uint64_t now_ms);
+void conn_unref(Conn *conn);
+void conn_free(Conn *conn);
+
+#ifdef USE_IO_URING
+Conn *uring_handle_accept(int connfd);
+void uring_handle_recv(Conn *conn, const uint8_t *data, size_t len);
+void uring_handle_send(Conn *conn, size_t n);
+#endif
 #endif
\ No newline at end of file
@@ -4,35 +4,109 @@
 #include "assert.h"
 #include "zset.h"
 #include "utils/timer.h"
+#include "slab.h"
+#include "eviction.h"
+#include "reactor.h"
+#include "zstore.h"
+#include "rdb.h"
 
+#include <algorithm>
+#include <math.h>
+#include <new>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-GlobalData g_data;
 
+thread_local GlobalData g_data;
+
+// `lhs` is in the table, `rhs` is the key being looked up
 bool entry_eq(HNode *lhs, HNode *rhs){
     struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return le->key == re->key;
+    struct LookupKey *re = container_of(rhs, struct LookupKey, node);
+    return entry_key(le) == re->key;
 };
 
-uint64_t str_hash(const uint8_t *data, size_t len){
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i< len; i++){
-        h = (h + data[i]) * 0x01000193;
-    }
-    return h;
+// compares the nodes, for unlinking an entry that is already at hand
+bool hnode_same(HNode *node, HNode *key){
+    return node == key;
 };
 
 void entry_set_ttl(Entry *ent, int64_t ttl_ms){
-    if(ttl_ms < 0 && ent->heap_idx != (size_t)-1){
+    EntryTTL *ttl = ent->ttl;
+    if(ttl_ms < 0){
         // setting a negative TTL means removing TTL
-        heap_delete(g_data.heap, ent->heap_idx);
-        ent->heap_idx = -1;
-    } else if (ttl_ms >= 0){
+        if(!ttl){
+            return;
+        }
+        if(g_data.timers == TIMERS_WHEEL){
+            if(tw_active(&ttl->timer)){     // not when it has just fired
+                tw_del(&g_data.wheel, &ttl->timer);
+            }
+        } else {
+            heap_delete(g_data.heap, ttl->heap_idx);
+        }
+        delete ttl;
+        ent->ttl = NULL;
+        g_data.used_memory -= sizeof(EntryTTL);
+        return;
+    }
+    if(!ttl){
+        ttl = ent->ttl = new EntryTTL();
+        ttl->ent = ent;
+        g_data.used_memory += sizeof(EntryTTL);
+    }
+    uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
+    if(g_data.timers == TIMERS_WHEEL){
+        tw_add(&g_data.wheel, &ttl->timer, expire_at);
+    } else {
         // add or update the heap data structure
-        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-        HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
+        HeapItem item = {expire_at, &ttl->heap_idx};
+        heap_upsert(g_data.heap, ttl->heap_idx, item);
+    }
+};
+
+// the expiration time, -1 if none
+uint64_t entry_expire_at(Entry *ent){
+    if(!ent->ttl){
+        return (uint64_t)-1;
+    }
+    if(g_data.timers == TIMERS_WHEEL){
+        return ent->ttl->timer.expire;
+    }
+    return g_data.heap[ent->ttl->heap_idx].val;
+};
+
+// when the TTLs need processing next, -1 if none; with the wheel this may
+// be a cascade before any key is due
+uint64_t ttl_next_ms(){
+    if(g_data.timers == TIMERS_WHEEL){
+        return tw_next(&g_data.wheel);
     }
+    return g_data.heap.empty() ? (uint64_t)-1 : g_data.heap[0].val;
+};
+
+// the earliest expiry of any key, -1 if none
+static uint64_t ttl_next_expire(){
+    if(g_data.timers == TIMERS_WHEEL){
+        return tw_next_expire(&g_data.wheel);
+    }
+    return ttl_next_ms();
+};
+
+// an entry whose TTL is up (at `now_ms` or before, like entry_expired()),
+// still in the keyspace; NULL if none
+static Entry *ttl_expired(uint64_t now_ms){
+    if(g_data.timers == TIMERS_WHEEL){
+        TWTimer *timer = tw_pop_expired(&g_data.wheel, now_ms);
+        return timer ? container_of(timer, EntryTTL, timer)->ent : NULL;
+    }
+    if(!g_data.heap.empty() && g_data.heap[0].val <= now_ms){
+        return container_of(g_data.heap[0].ref, EntryTTL, heap_idx)->ent;
+    }
+    return NULL;
 };
 
 // append serialzied data types to the back
@@ -46,6 +120,13 @@ static void out_str(Buffer &out, const char *s, size_t size){
     buf_append(out, (const uint8_t *)s, size);
 };
 
+// the blob is referenced, not copied
+static void out_blob(Buffer &out, Blob *blob){
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, blob->len);
+    buf_append_ref(out, blob);
+};
+
 static void out_int(Buffer &out, int64_t val){
     buf_append_u8(out, TAG_INT);
     buf_append_i64(out, val);
@@ -61,207 +142,534 @@ static void out_dbl(Buffer &out, double val){
     buf_append_dbl(out, val);
 };
 
-static Entry *entry_new(uint32_t type){
-    Entry *ent = new Entry(type);
+static size_t out_begin_arr(Buffer &out) {
+    buf_append_u8(out, TAG_ARR);
+    buf_append_u32(out, 0);     // filled by out_end_arr()
+    return out.size() - 4;      // the `ctx` arg
+}
+static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
+    assert(out[ctx - 1] == TAG_ARR);
+    memcpy(&out[ctx], &n, 4);
+}
+
+static char *entry_val(Entry *ent){
+    return ent->data + ent->klen;
+};
+
+// the block is rounded up to its slab class, the slack is room for the
+// value to grow in place
+static Entry *entry_alloc(uint32_t type, std::string_view key, uint64_t hcode, size_t vlen){
+    size_t hdr = offsetof(Entry, data) + key.size();
+    size_t size = slab_good_size(hdr + vlen);
+    void *mem = slab_alloc(size);
+    Entry *ent = new (mem) Entry();
+    ent->node.hcode = hcode;
+    ent->type = (uint8_t)type;
+    ent->klen = (uint32_t)key.size();
+    ent->vcap = (uint16_t)std::min(size - hdr, k_blob_min - 1);
+    memcpy(ent->data, key.data(), key.size());
+    entry_touch_init(ent);
+    g_data.used_memory += size;
     return ent;
 };
 
-static void entry_del_sync(Entry *ent){
-    if(ent->type == T_ZSET){
-        zset_clear(&ent->zset);
+// Inserts and deletes resize the keyspace's table, and any access may move
+// a step of a resize and free the old table, so this runs after every
+// request and every change from outside one.
+void db_account(){
+    size_t bytes = hm_bytes(&g_data.db);
+    g_data.used_memory = g_data.used_memory - g_data.db_bytes + bytes;
+    g_data.db_bytes = bytes;
+};
+
+// the size given to slab_alloc()
+static size_t entry_size(Entry *ent){
+    return slab_good_size(offsetof(Entry, data) + ent->klen + ent->vcap);
+};
+
+static void entry_free(Entry *ent){
+    size_t size = entry_size(ent);
+    g_data.used_memory -= size;
+    ent->~Entry();
+    slab_free(ent, size);
+};
+
+static Entry *entry_new(uint32_t type, const LookupKey &key, size_t vlen){
+    Entry *ent = entry_alloc(type, key.key, key.node.hcode, vlen);
+    if(type == T_ZSET){
+        ent->zset = new ZSet();
+        g_data.used_memory += sizeof(ZSet);
     }
-    delete ent;
+    return ent;
 };
-static void entry_del_func(void *arg){
-    entry_del_sync((Entry *)arg);
+
+static void zset_del_func(void *arg){
+    ZSet *zset = (ZSet *)arg;
+    zset_clear(zset);
+    delete zset;
+};
+
+static void zset_free(ZSet *zset){
+    // run the destructor in a thread pool for large data structures
+    if(zset_size(zset) > k_large_container_size){
+        thread_pool_queue(g_data.thread_pool, &zset_del_func, zset);
+    } else {
+        zset_del_func(zset);   // small;  avoid context swtiches
+    }
 };
 
 void entry_del(Entry *ent){
     // unlink it from any data structures
     entry_set_ttl(ent, -1);
-    // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    if(set_size > k_large_container_size){
-        thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
-    } else {
-        entry_del_sync(ent); // small;  avoid context swtiches
+    if(ent->type == T_STR && ent->blob){
+        g_data.used_memory -= sizeof(Blob) + ent->blob->len;
+        blob_unref(ent->blob);
+    } else if(ent->type == T_ZSET){
+        g_data.used_memory -= sizeof(ZSet) + ent->zset->bytes;
+        auto pin = g_data.zpins.find(ent->zset);
+        if(pin != g_data.zpins.end()){
+            pin->second.detached = true;    // still being read
+        } else {
+            zset_free(ent->zset);
+        }
+    }
+    entry_free(ent);
+};
+
+// Long range replies are written on the thread pool, which reads the set
+// while the loop goes on. A pinned set is never changed: a write copies
+// it first, and a delete leaves it to the last reader.
+static void zset_pin(ZSet *zset){
+    g_data.zpins[zset].readers++;
+};
+
+static void zset_unpin(ZSet *zset){
+    auto pin = g_data.zpins.find(zset);
+    assert(pin != g_data.zpins.end() && pin->second.readers > 0);
+    if(--pin->second.readers > 0){
+        return;
+    }
+    bool detached = pin->second.detached;
+    g_data.zpins.erase(pin);
+    if(detached){
+        zset_free(zset);
+    }
+};
+
+// the key's set, to be changed
+static ZSet *zset_mut(Entry *ent){
+    auto pin = g_data.zpins.find(ent->zset);
+    if(pin == g_data.zpins.end()){
+        return ent->zset;
+    }
+    // the members are in order, the copy is built in O(n)
+    ZSet *old = ent->zset;
+    std::vector<ZMember> members;
+    members.reserve(zset_size(old));
+    for(ZIter it = zset_at(old, 0); zset_iter_ok(&it); zset_iter_offset(&it, +1)){
+        members.push_back(zset_iter_get(&it));
     }
+    ZSet *copy = new ZSet();
+    zset_insert_bulk(copy, members.data(), members.size(), g_data.thread_pool);
+    g_data.used_memory += copy->bytes - old->bytes;
+    pin->second.detached = true;
+    ent->zset = copy;
+    return copy;
 };
 
-void out_err(Buffer &out, uint32_t code, const std::string &msg){
+void out_err(Buffer &out, uint32_t code, std::string_view msg){
     buf_append_u8(out, TAG_ERR);
     buf_append_u32(out, code);
     buf_append_u32(out, (uint32_t)msg.size());
     buf_append(out, (const uint8_t*)msg.data(), msg.size());
 };
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out){
-    // a dummy `Entry` just for the lookup
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
+// due at `now_ms` or before, the same for both timer engines
+static bool entry_expired(Entry *ent, uint64_t now_ms){
+    return ent->ttl && entry_expire_at(ent) <= now_ms;
+};
+
+// unlinks and deletes a key whose TTL is up
+static void entry_expire(Entry *ent){
+    HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    entry_del(ent);
+    db_account();
+    g_data.expire.keys++;
+};
+
+// Deletes the expired keys for up to `budget_us`. The budget doubles
+// while the backlog outlasts it and halves back once it's cleared.
+void expire_cycle(){
+    ExpireStats &st = g_data.expire;
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t now_ms = get_monotonic_msec();
+    bool done = false;
+    while(!done){
+        // check the clock every few keys
+        for(size_t i = 0; i < 16; ++i){
+            Entry *ent = ttl_expired(now_ms);
+            if(!ent){
+                done = true;
+                break;
+            }
+            entry_expire(ent);
+        }
+        if(get_monotonic_usec() - start_us >= st.budget_us){
+            break;
+        }
+    }
+    if(done){
+        st.budget_us = std::max(k_expire_budget_us, st.budget_us / 2);
+    } else {
+        st.budget_us = std::min(k_expire_budget_max_us, st.budget_us * 2);
+    }
+
+    // the backlog's oldest key; none left when done
+    uint64_t next_ms = done ? (uint64_t)-1 : ttl_next_expire();
+    st.lag_ms = next_ms < now_ms ? now_ms - next_ms : 0;
+    if(now_ms - st.rate_start_ms >= 1000){
+        if(st.rate_start_ms){
+            st.rate = (st.keys - st.rate_keys) * 1000 / (now_ms - st.rate_start_ms);
+        }
+        st.rate_start_ms = now_ms;
+        st.rate_keys = st.keys;
+    }
+};
+
+// a key in the keyspace, fills `key` for an insert when not found; a key
+// past its TTL is deleted here rather than served
+static Entry *entry_lookup(std::string_view name, LookupKey &key){
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)name.data(), name.size());
     HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_nil(out);
+    if(!node){
+        return NULL;
     }
-   
     Entry *ent = container_of(node, Entry, node);
-    return out_str(out, ent->str.data(), ent->str.size());
+    if(entry_expired(ent, get_monotonic_msec())){
+        entry_expire(ent);
+        g_data.expire.lazy++;
+        return NULL;
+    }
+    return ent;
 };
 
-static void do_set(std::vector<std::string>& cmd, Buffer &out){
+static void do_get(const CmdArgs &cmd, Buffer &out){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *ent = entry_lookup(cmd[1], key);
+    if(!ent){
+        return out_nil(out);
+    }
+    if(ent->type != T_STR){
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    }
+    entry_touch(ent);
+    if(ent->blob){
+        return out_blob(out, ent->blob);
+    }
+    return out_str(out, entry_val(ent), ent->vlen);
+};
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// moves the entry to a block with room for a `vlen` value, the old block
+// is unlinked from the keyspace and freed
+static Entry *entry_grow(Entry *ent, size_t vlen){
+    Entry *bigger = entry_alloc(ent->type, entry_key(ent), ent->node.hcode, vlen);
+    bigger->lru = ent->lru;
+    if((bigger->ttl = ent->ttl)){
+        bigger->ttl->ent = bigger;
+    }
+    HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    hm_insert(&g_data.db, &bigger->node);
+    entry_free(ent);
+    return bigger;
+};
 
-    if(node){
+// the value is copied out of the request here, once; returns the entry,
+// which may have moved
+static Entry *entry_set_str(Entry *ent, std::string_view val){
+    if(ent->blob){
+        g_data.used_memory -= sizeof(Blob) + ent->blob->len;
+        blob_unref(ent->blob);
+        ent->blob = NULL;
+    }
+    ent->vlen = 0;
+    if(val.size() >= k_blob_min){
+        ent->blob = blob_new((const uint8_t *)val.data(), val.size());
+        g_data.used_memory += sizeof(Blob) + val.size();
+        return ent;
+    }
+    if(val.size() > ent->vcap){
+        ent = entry_grow(ent, val.size());
+    }
+    memcpy(entry_val(ent), val.data(), val.size());
+    ent->vlen = (uint16_t)val.size();
+    return ent;
+};
+
+static void do_set(const CmdArgs & cmd, Buffer &out){
+    LookupKey key;
+    Entry *ent = entry_lookup(cmd[1], key);
+
+    if(ent){
         // found, update the value
-        Entry *ent = container_of(node, Entry, node);
         if(ent->type != T_STR){
             return out_err(out, ERR_BAD_TYP, "a non-string value exists");
         }
-        ent->str.swap(cmd[2]);
+        entry_touch(ent);
+        entry_set_str(ent, cmd[2]);
     } else {
-        // not found, allocate & insert a new pair
-        Entry *ent = new Entry(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode= key.node.hcode;
-        ent->str.swap(cmd[2]);
+        // not found, allocate & insert a new pair, sized for the value
+        std::string_view val = cmd[2];
+        size_t vlen = val.size() < k_blob_min ? val.size() : 0;
+        ent = entry_new(T_STR, key, vlen);
+        entry_set_str(ent, val);
         hm_insert(&g_data.db, &ent->node);
     }
     return out_nil(out);
 };
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out){
+static void do_del(const CmdArgs &cmd, Buffer &out){
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
 
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
     HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
+    bool live = false;
     if(node){
-        entry_del(container_of(node, Entry, node));
+        // an expired key is deleted all the same, but doesn't count
+        Entry *ent = container_of(node, Entry, node);
+        live = !entry_expired(ent, get_monotonic_msec());
+        entry_del(ent);
     }
-    return out_int(out, node ? 1 : 0);
+    return out_int(out, live ? 1 : 0);
+};
+
+struct KeysArg {
+    Buffer *out;
+    uint64_t now_ms;
+    uint32_t n;
 };
 
 static bool cb_keys(HNode *node, void *arg){
-    Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
+    KeysArg *ka = (KeysArg *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if(!entry_expired(ent, ka->now_ms)){
+        std::string_view key = entry_key(ent);
+        out_str(*ka->out, key.data(), key.size());
+        ka->n++;
+    }
     return true;
 };
 
-static void do_keys(std::vector<std::string> &, Buffer &out){
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+// expired keys are skipped, they can't be deleted while iterating
+static void do_keys(const CmdArgs &, Buffer &out){
+    KeysArg ka = {&out, get_monotonic_msec(), 0};
+    size_t ctx = out_begin_arr(out);
+    hm_foreach(&g_data.db, &cb_keys, (void *)&ka);
+    out_end_arr(out, ctx, ka.n);
 };
 
 
-static size_t out_begin_arr(Buffer &out) {
-    out.push_back(TAG_ARR);
-    buf_append_u32(out, 0);     // filled by out_end_arr()
-    return out.size() - 4;      // the `ctx` arg
-}
-static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
-    assert(out[ctx - 1] == TAG_ARR);
-    memcpy(&out[ctx], &n, 4);
-}
+// the args are not NUL-terminated, numbers are copied to the stack first
+static bool arg2cstr(std::string_view s, char *buf, size_t cap){
+    if(s.size() >= cap){
+        return false;
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    return true;
+};
 
-static bool str2dbl(const std::string &s, double &out){
+static bool str2dbl(std::string_view s, double &out){
+    char buf[k_max_num_len];
+    if(!arg2cstr(s, buf, sizeof(buf))){
+        return false;
+    }
     char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    out = strtod(buf, &endp);
+    return endp == buf + s.size() && !isnan(out);
 };
 
-static bool str2int(const std::string &s, int64_t &out){
+static bool str2int(std::string_view s, int64_t &out){
+    char buf[k_max_num_len];
+    if(!arg2cstr(s, buf, sizeof(buf))){
+        return false;
+    }
     char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
 };
 
 static const ZSet k_empty_zset;
-static ZSet *expect_zset(std::string &s){
+static ZSet *expect_zset(std::string_view s){
     LookupKey key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = entry_lookup(s, key);
 
-    if(!hnode){ // a non-existent key is treaded as an empty zset
+    if(!ent){ // a non-existent key is treaded as an empty zset
         return (ZSet *)&k_empty_zset;
     }
 
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    if(ent->type != T_ZSET){
+        return NULL;
+    }
+    entry_touch(ent);
+    return ent->zset;
 };
 
-static void do_zadd(std::vector<std::string> &cmd, Buffer &out){
-    double score = 0;
-    if(!str2dbl(cmd[2], score)){
-        return out_err(out, ERR_BAD_ARG, "epect float");
+// the same for a write
+static ZSet *expect_zset_mut(std::string_view s){
+    LookupKey key;
+    Entry *ent = entry_lookup(s, key);
+    if(!ent){
+        return (ZSet *)&k_empty_zset;
     }
+    if(ent->type != T_ZSET){
+        return NULL;
+    }
+    entry_touch(ent);
+    return zset_mut(ent);
+};
 
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static void zwait_signal(std::string_view key);
 
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// zadd zset score name [score name ...]
+static void do_zadd(const CmdArgs &cmd, Buffer &out){
+    if(cmd.size() % 2 != 0){
+        return out_err(out, ERR_BAD_ARG, "expect score name pairs");
+    }
+    // parse them all first, a bad score adds nothing
+    std::vector<ZMember> members((cmd.size() - 2) / 2);
+    for(size_t i = 0; i < members.size(); ++i){
+        std::string_view name = cmd[3 + 2 * i];
+        if(!str2dbl(cmd[2 + 2 * i], members[i].score)){
+            return out_err(out, ERR_BAD_ARG, "epect float");
+        }
+        members[i].name = name.data();
+        members[i].len = name.size();
+    }
+
+    LookupKey key;
+    Entry *ent = entry_lookup(cmd[1], key);
 
-    Entry *ent = NULL;
-    if(!hnode){
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+    if(!ent){
+        ent = entry_new(T_ZSET, key, 0);
         hm_insert(&g_data.db, &ent->node);
     } else {
-        ent = container_of(hnode, Entry, node);
         if(ent->type != T_ZSET){
             return out_err(out, ERR_BAD_TYP, "expect zset");
         }
+        entry_touch(ent);
     }
 
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
+    ZSet *zset = zset_mut(ent);
+    size_t bytes = zset->bytes;
+    size_t added = zset_insert_bulk(zset, members.data(), members.size(), g_data.thread_pool);
+    g_data.used_memory += zset->bytes - bytes;
+    zwait_signal(cmd[1]);
 
     return out_int(out, (int64_t)added);
 };
 
-static void do_zrem(std::vector<std::string> &cmd, Buffer &out){
-    ZSet *zset = expect_zset(cmd[1]);
+static void do_zrem(const CmdArgs &cmd, Buffer &out){
+    ZSet *zset = expect_zset_mut(cmd[1]);
     if(!zset){
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
 
-    const std::string &name  = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    if(znode){
-        zset_delete(zset, znode);
-    }
-    return out_int(out, znode ? 1 : 0);
+    std::string_view name = cmd[2];
+    size_t bytes = zset->bytes;
+    bool removed = zset_remove(zset, name.data(), name.size());
+    g_data.used_memory -= bytes - zset->bytes;
+    return out_int(out, removed ? 1 : 0);
 };
 
-static void do_zscore(std::vector<std::string> &cmd, Buffer &out){
+static void do_zscore(const CmdArgs &cmd, Buffer &out){
     ZSet *zset = expect_zset(cmd[1]);
     if(!zset){
         return out_err(out, ERR_BAD_TYP, "ecpext zset");
     }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    std::string_view name = cmd[2];
+    double score = 0;
+    bool found = zset_score(zset, name.data(), name.size(), &score);
+    return found ? out_dbl(out, score) : out_nil(out);
+};
+
+// up to `limit` (name, score) pairs within [min, max], backwards for rev.
+// a step back in a packed set rescans it, those are small.
+static void out_zrange(
+    Buffer &out, ZIter &it, int64_t limit, bool rev, double min, double max)
+{
+    size_t ctx = out_begin_arr(out);
+    int64_t n = 0;
+    for(; zset_iter_ok(&it) && n < limit; zset_iter_offset(&it, rev ? -1 : +1)){
+        ZMember m = zset_iter_get(&it);
+        if(m.score < min || m.score > max){
+            break;
+        }
+        out_str(out, m.name, m.len);
+        out_dbl(out, m.score);
+        n++;
+    }
+    out_end_arr(out, ctx, (uint32_t)(n * 2));
+};
+
+// a long range reply, written on the pool
+struct ZRangeCmd {
+    AsyncCmd async;
+    ZSet *zset = NULL;
+    ZIter it;
+    int64_t limit = 0;
+    bool rev = false;
+    double min = 0;
+    double max = 0;
+    Buffer out;
+};
+
+static void zrange_work(AsyncCmd *cmd){
+    ZRangeCmd *zr = container_of(cmd, ZRangeCmd, async);
+    out_zrange(zr->out, zr->it, zr->limit, zr->rev, zr->min, zr->max);
+    cmd->finished(cmd);
+};
+
+static void zrange_done(AsyncCmd *cmd, Buffer &out){
+    ZRangeCmd *zr = container_of(cmd, ZRangeCmd, async);
+    buf_append_buf(out, zr->out);
+    zset_unpin(zr->zset);
+    delete zr;
+};
+
+// `n` is the most members the reply may hold
+static void zrange_reply(
+    Buffer &out, ZSet *zset, ZIter &it, int64_t n, bool rev, double min, double max)
+{
+    if(n <= (int64_t)k_large_container_size || !g_data.async_ok || !g_data.thread_pool){
+        return out_zrange(out, it, n, rev, min, max);
+    }
+    ZRangeCmd *zr = new ZRangeCmd();
+    zr->zset = zset;
+    zr->it = it;
+    zr->limit = n;
+    zr->rev = rev;
+    zr->min = min;
+    zr->max = max;
+    zset_pin(zset);
+    zr->async.work = &zrange_work;
+    zr->async.done = &zrange_done;
+    g_data.async = &zr->async;
 };
 
 // zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, Buffer &out){
+static void do_zquery(const CmdArgs &cmd, Buffer &out){
     // parse args
     double score = 0;
     if(!str2dbl(cmd[2], score)){
         return out_err(out, ERR_BAD_ARG, "expect fp number");
     }
 
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     int64_t offset = 0, limit = 0;
     if(!str2int(cmd[4], offset) || !str2int(cmd[5], limit)){
         return out_err(out, ERR_BAD_ARG, "expext int");
@@ -278,82 +686,959 @@ static void do_zquery(std::vector<std::string> &cmd, Buffer &out){
         return out_arr(out, 0);
     }
 
-    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+    ZIter it = zset_seekge(zset, score, name.data(), name.size());
+    zset_iter_offset(&it, offset);
+
+    // `limit` counts the names and the scores
+    int64_t n = 0;
+    if(zset_iter_ok(&it)){
+        n = std::min(limit / 2 + limit % 2, (int64_t)zset_size(zset) - zset_iter_rank(&it));
+    }
+    return zrange_reply(out, zset, it, n, false, -INFINITY, INFINITY);
+};
+
+static void zrank(const CmdArgs &cmd, Buffer &out, bool rev){
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    std::string_view name = cmd[2];
+    int64_t rank = zset_rank(zset, name.data(), name.size());
+    if(rank < 0){
+        return out_nil(out);
+    }
+    return out_int(out, rev ? (int64_t)zset_size(zset) - 1 - rank : rank);
+};
+
+// zrank zset name
+static void do_zrank(const CmdArgs &cmd, Buffer &out){
+    return zrank(cmd, out, false);
+};
+
+// zrevrank zset name
+static void do_zrevrank(const CmdArgs &cmd, Buffer &out){
+    return zrank(cmd, out, true);
+};
+
+// the rank of the first member scored above `score`
+static int64_t zset_rank_above(ZSet *zset, double score){
+    if(score == INFINITY){
+        return (int64_t)zset_size(zset);
+    }
+    ZIter it = zset_seekge(zset, nextafter(score, INFINITY), "", 0);
+    return zset_iter_rank(&it);
+};
+
+// the ranks [lo, hi) of the members scored within [min, max]
+static void zset_score_ranks(ZSet *zset, double min, double max, int64_t *lo, int64_t *hi){
+    if(min > max){
+        *lo = *hi = 0;
+        return;
+    }
+    ZIter it = zset_seekge(zset, min, "", 0);
+    *lo = zset_iter_rank(&it);
+    *hi = zset_rank_above(zset, max);
+};
+
+// zcount zset min max
+// zsumrange zset min max
+// zavgrange zset min max
+enum { ZAGG_COUNT, ZAGG_SUM, ZAGG_AVG };
+
+static void zaggregate(const CmdArgs &cmd, Buffer &out, uint32_t agg){
+    double min = 0, max = 0;
+    if(!str2dbl(cmd[2], min) || !str2dbl(cmd[3], max)){
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t lo = 0, hi = 0;
+    zset_score_ranks(zset, min, max, &lo, &hi);
+    if(agg == ZAGG_COUNT){
+        return out_int(out, hi - lo);
+    }
+    double sum = zset_range_sum(zset, lo, hi);
+    if(agg == ZAGG_SUM){
+        return out_dbl(out, sum);
+    }
+    return hi > lo ? out_dbl(out, sum / (hi - lo)) : out_nil(out);
+};
+
+static void do_zcount(const CmdArgs &cmd, Buffer &out){
+    return zaggregate(cmd, out, ZAGG_COUNT);
+};
+
+static void do_zsumrange(const CmdArgs &cmd, Buffer &out){
+    return zaggregate(cmd, out, ZAGG_SUM);
+};
+
+static void do_zavgrange(const CmdArgs &cmd, Buffer &out){
+    return zaggregate(cmd, out, ZAGG_AVG);
+};
+
+// zrange zset start stop: by rank, negative ranks count from the end
+static void zrange(const CmdArgs &cmd, Buffer &out, bool rev){
+    int64_t start = 0, stop = 0;
+    if(!str2int(cmd[2], start) || !str2int(cmd[3], stop)){
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t size = (int64_t)zset_size(zset);
+    start = start < 0 ? std::max<int64_t>(start + size, 0) : start;
+    stop = stop < 0 ? stop + size : std::min(stop, size - 1);
+    if(start > stop){
+        return out_arr(out, 0);
+    }
+    ZIter it = zset_at(zset, rev ? size - 1 - start : start);
+    return zrange_reply(out, zset, it, stop - start + 1, rev, -INFINITY, INFINITY);
+};
+
+static void do_zrange(const CmdArgs &cmd, Buffer &out){
+    return zrange(cmd, out, false);
+};
+
+static void do_zrevrange(const CmdArgs &cmd, Buffer &out){
+    return zrange(cmd, out, true);
+};
+
+// zrangebyscore zset min max [offset count]
+// zrevrangebyscore zset max min [offset count]
+static void zrange_score(const CmdArgs &cmd, Buffer &out, bool rev){
+    double min = 0, max = 0;
+    if(!str2dbl(cmd[rev ? 3 : 2], min) || !str2dbl(cmd[rev ? 2 : 3], max)){
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    int64_t offset = 0, limit = INT64_MAX;
+    if(cmd.size() == 6){
+        if(!str2int(cmd[4], offset) || !str2int(cmd[5], limit)){
+            return out_err(out, ERR_BAD_ARG, "expect int");
+        }
+    } else if(cmd.size() != 4){
+        return out_err(out, ERR_BAD_ARG, "expect offset and count");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    if(offset < 0 || limit == 0 || min > max){
+        return out_arr(out, 0);
+    }
+    if(limit < 0){
+        limit = INT64_MAX;
+    }
+    ZIter it = rev ? zset_at(zset, zset_rank_above(zset, max) - 1)
+                   : zset_seekge(zset, min, "", 0);
+    zset_iter_offset(&it, rev ? -offset : offset);
+
+    // how many are left in the range, from the ranks
+    int64_t n = 0;
+    if(zset_iter_ok(&it)){
+        int64_t lo = 0, hi = 0, rank = zset_iter_rank(&it);
+        zset_score_ranks(zset, min, max, &lo, &hi);
+        n = std::min(std::max<int64_t>(rev ? rank + 1 - lo : hi - rank, 0), limit);
+    }
+    return zrange_reply(out, zset, it, n, rev, min, max);
+};
+
+static void do_zrangebyscore(const CmdArgs &cmd, Buffer &out){
+    return zrange_score(cmd, out, false);
+};
+
+static void do_zrevrangebyscore(const CmdArgs &cmd, Buffer &out){
+    return zrange_score(cmd, out, true);
+};
+
+// the command runs on the shard of its first key, the others must be there too
+static bool keys_local(const CmdArgs &cmd, size_t first, size_t n){
+    for(size_t i = first; i < first + n; ++i){
+        if(shard_of((const uint8_t *)cmd[i].data(), cmd[i].size()) != g_data.shard_id){
+            return false;
+        }
+    }
+    return true;
+};
+
+// zunionstore and zinterstore, finished on the thread pool when large
+struct ZStoreCmd {
+    AsyncCmd async;
+    ZStore job;
+    std::string dest;
+};
+
+// the result replaces the destination, whatever it was
+static void zstore_finish(ZStoreCmd *zc, Buffer &out){
+    LookupKey key;
+    if(Entry *old = entry_lookup(zc->dest, key)){
+        HNode *node = hm_delete(&g_data.db, &old->node, &hnode_same);
+        assert(node == &old->node);
+        entry_del(old);
+    }
+    std::vector<ZMember> &members = zc->job.out;
+    if(!members.empty()){
+        Entry *ent = entry_new(T_ZSET, key, 0);
+        hm_insert(&g_data.db, &ent->node);
+        zset_insert_bulk(ent->zset, members.data(), members.size(), g_data.thread_pool);
+        g_data.used_memory += ent->zset->bytes;
+        zwait_signal(zc->dest);
+    }
+    return out_int(out, (int64_t)members.size());
+};
+
+static void zstore_done(AsyncCmd *cmd, Buffer &out){
+    ZStoreCmd *zc = container_of(cmd, ZStoreCmd, async);
+    zstore_finish(zc, out);
+    db_account();
+    delete zc;
+};
+
+static void zstore_finished(ZStore *job){
+    ZStoreCmd *zc = container_of(job, ZStoreCmd, job);
+    zc->async.finished(&zc->async);
+};
+
+// on the pool, where g_data isn't the shard's
+static void zstore_work(AsyncCmd *cmd){
+    ZStoreCmd *zc = container_of(cmd, ZStoreCmd, async);
+    zstore_start(&zc->job, zc->job.pool, &zstore_finished);
+};
+
+// zunionstore dest numkeys key [key ...] [weights w ...] [aggregate sum|min|max]
+static void do_zstore(const CmdArgs &cmd, Buffer &out, uint32_t op){
+    int64_t nkeys = 0;
+    if(!str2int(cmd[2], nkeys) || nkeys < 1 || (size_t)nkeys > cmd.size() - 3){
+        return out_err(out, ERR_BAD_ARG, "expect numkeys and that many keys");
+    }
+    std::vector<double> weights(nkeys, 1);
+    uint32_t agg = ZSTORE_SUM;
+    for(size_t i = 3 + nkeys; i < cmd.size();){
+        if(cmd[i] == "weights" && i + nkeys < cmd.size()){
+            for(int64_t k = 0; k < nkeys; ++k){
+                if(!str2dbl(cmd[i + 1 + k], weights[k])){
+                    return out_err(out, ERR_BAD_ARG, "expect float");
+                }
+            }
+            i += 1 + nkeys;
+        } else if(cmd[i] == "aggregate" && i + 1 < cmd.size()){
+            std::string_view name = cmd[i + 1];
+            if(name == "sum"){
+                agg = ZSTORE_SUM;
+            } else if(name == "min"){
+                agg = ZSTORE_MIN;
+            } else if(name == "max"){
+                agg = ZSTORE_MAX;
+            } else {
+                return out_err(out, ERR_BAD_ARG, "expect sum, min or max");
+            }
+            i += 2;
+        } else {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+    if(!keys_local(cmd, 3, nkeys)){
+        return out_err(out, ERR_BAD_ARG, "keys on different shards, use a {tag}");
+    }
+    std::vector<ZSet *> inputs(nkeys);
+    for(int64_t k = 0; k < nkeys; ++k){
+        inputs[k] = expect_zset(cmd[3 + k]);
+        if(!inputs[k]){
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+    }
+
+    ZStoreCmd *zc = new ZStoreCmd();
+    zc->dest = cmd[1];
+    zc->job.op = op;
+    zc->job.aggregate = agg;
+    zc->job.inputs.resize(nkeys);
+    for(int64_t k = 0; k < nkeys; ++k){
+        zc->job.inputs[k].weight = weights[k];
+        zstore_snapshot(&zc->job.inputs[k], inputs[k]);
+    }
+
+    // small inputs are merged inline, avoid context switches
+    if(zstore_size(&zc->job) <= k_large_container_size || !g_data.thread_pool){
+        zstore_run(&zc->job);
+        return zstore_done(&zc->async, out);
+    }
+    zc->job.pool = g_data.thread_pool;
+    zc->async.work = &zstore_work;
+    zc->async.done = &zstore_done;
+    g_data.async = &zc->async;
+};
+
+static void do_zunionstore(const CmdArgs &cmd, Buffer &out){
+    return do_zstore(cmd, out, ZSTORE_UNION);
+};
+
+static void do_zinterstore(const CmdArgs &cmd, Buffer &out){
+    return do_zstore(cmd, out, ZSTORE_INTER);
+};
+
+// pops the lowest or highest member, the key is deleted once the set is empty
+static void zpop_one(Entry *ent, bool max, std::string &name, double &score){
+    ZSet *zset = zset_mut(ent);
+    ZIter it = zset_at(zset, max ? (int64_t)zset_size(zset) - 1 : 0);
+    ZMember m = zset_iter_get(&it);
+    name.assign(m.name, m.len);
+    score = m.score;
+    size_t bytes = zset->bytes;
+    zset_remove(zset, m.name, m.len);
+    g_data.used_memory -= bytes - zset->bytes;
+    if(zset_size(zset) == 0){
+        HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+        assert(node == &ent->node);
+        entry_del(ent);
+    }
+};
 
-    //output
+// zpopmin zset [count]
+static void do_zpop(const CmdArgs &cmd, Buffer &out, bool max){
+    int64_t count = 1;
+    if(cmd.size() > 3 || (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0))){
+        return out_err(out, ERR_BAD_ARG, "expect a count");
+    }
+    LookupKey key;
+    Entry *ent = entry_lookup(cmd[1], key);
+    if(ent && ent->type != T_ZSET){
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
     size_t ctx = out_begin_arr(out);
     int64_t n = 0;
-    while (znode && n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
+    std::string name;
+    double score = 0;
+    // zrem may leave an empty set
+    for(; ent && n < count && zset_size(ent->zset) > 0; ++n){
+        bool last = zset_size(ent->zset) == 1;
+        zpop_one(ent, max, name, score);
+        out_str(out, name.data(), name.size());
+        out_dbl(out, score);
+        if(last){
+            ent = NULL;     // deleted
+        }
     }
-    out_end_arr(out, ctx, (uint32_t)n);
+    out_end_arr(out, ctx, (uint32_t)(n * 2));
+};
+
+static void do_zpopmin(const CmdArgs &cmd, Buffer &out){
+    return do_zpop(cmd, out, false);
+};
+
+static void do_zpopmax(const CmdArgs &cmd, Buffer &out){
+    return do_zpop(cmd, out, true);
+};
+
+// bzpopmin and bzpopmax, parked on the wait list of every key until one
+// of them gets a member or the timeout
+struct ZWaiter;
+
+struct ZWaitLink {
+    DList node;
+    ZWaiter *waiter = NULL;
+};
+
+struct ZWaiter {
+    AsyncCmd async;
+    bool max = false;
+    std::vector<std::string> keys;
+    std::vector<ZWaitLink> links;   // one per key, in the key's wait list
+    TWTimer timer;                  // not armed without a timeout
+    // the popped member, none on timeout
+    bool popped = false;
+    std::string key;
+    std::string name;
+    double score = 0;
+};
+
+static void zwait_done(AsyncCmd *cmd, Buffer &out){
+    ZWaiter *w = container_of(cmd, ZWaiter, async);
+    if(w->popped){
+        out_arr(out, 3);
+        out_str(out, w->key.data(), w->key.size());
+        out_str(out, w->name.data(), w->name.size());
+        out_dbl(out, w->score);
+    } else {
+        out_nil(out);
+    }
+    delete w;
+};
+
+// off every wait list and the timer, the response is sent from zwait_done
+static void zwait_finish(ZWaiter *w){
+    for(size_t i = 0; i < w->keys.size(); ++i){
+        dlist_detach(&w->links[i].node);
+        auto it = g_data.zwaits.find(w->keys[i]);
+        if(it != g_data.zwaits.end() && dlist_empty(&it->second)){
+            g_data.zwaits.erase(it);
+        }
+    }
+    if(tw_active(&w->timer)){
+        tw_del(&g_data.zwait_timers, &w->timer);
+    }
+    w->async.finished(&w->async);
+};
+
+// the client is gone, the response from zwait_done goes nowhere
+static void zwait_cancel(AsyncCmd *cmd){
+    zwait_finish(container_of(cmd, ZWaiter, async));
+};
+
+// the key may have members now: they go to its waiters, the oldest first
+static void zwait_signal(std::string_view key){
+    while(true){
+        auto it = g_data.zwaits.find(key);
+        if(it == g_data.zwaits.end()){
+            return;
+        }
+        ZWaiter *w = container_of(it->second.next, ZWaitLink, node)->waiter;
+        if(w->async.conn && w->async.conn->closed){
+            zwait_finish(w);    // gone, nothing is popped for it
+            continue;
+        }
+        LookupKey lk;
+        Entry *ent = entry_lookup(key, lk);
+        if(!ent || ent->type != T_ZSET || zset_size(ent->zset) == 0){
+            return;
+        }
+        w->popped = true;
+        w->key.assign(key);
+        zpop_one(ent, w->max, w->name, w->score);
+        zwait_finish(w);
+    }
+};
+
+void zwait_expire(uint64_t now_ms){
+    while(TWTimer *timer = tw_pop_expired(&g_data.zwait_timers, now_ms)){
+        zwait_finish(container_of(timer, ZWaiter, timer));
+    }
+};
+
+// bzpopmin key [key ...] timeout: in seconds, 0 waits forever
+static void do_bzpop(const CmdArgs &cmd, Buffer &out, bool max){
+    double timeout = 0;
+    if(!str2dbl(cmd[cmd.size() - 1], timeout) || !(timeout >= 0) || !isfinite(timeout)){
+        return out_err(out, ERR_BAD_ARG, "expect a timeout");
+    }
+    size_t nkeys = cmd.size() - 2;
+    if(!keys_local(cmd, 1, nkeys)){
+        return out_err(out, ERR_BAD_ARG, "keys on different shards, use a {tag}");
+    }
+    for(size_t i = 1; i <= nkeys; ++i){
+        if(!expect_zset(cmd[i])){
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+    }
+    // the first key with a member
+    for(size_t i = 1; i <= nkeys; ++i){
+        LookupKey key;
+        Entry *ent = entry_lookup(cmd[i], key);
+        if(ent && zset_size(ent->zset) > 0){
+            std::string name;
+            double score = 0;
+            zpop_one(ent, max, name, score);
+            out_arr(out, 3);
+            out_str(out, cmd[i].data(), cmd[i].size());
+            out_str(out, name.data(), name.size());
+            return out_dbl(out, score);
+        }
+    }
+
+    ZWaiter *w = new ZWaiter();
+    w->max = max;
+    w->keys.resize(nkeys);
+    w->links.resize(nkeys);
+    for(size_t i = 0; i < nkeys; ++i){
+        w->keys[i].assign(cmd[1 + i]);
+        auto it = g_data.zwaits.try_emplace(w->keys[i]).first;
+        if(!it->second.next){
+            dlist_init(&it->second);
+        }
+        w->links[i].waiter = w;
+        dlist_insert_before(&it->second, &w->links[i].node);
+    }
+    if(timeout > 0){
+        // clamped while a double, the cast of a larger one is undefined
+        double ms_max = (double)k_max_block_ms;
+        uint64_t ms = (uint64_t)std::min(ceil(timeout * 1000), ms_max);
+        tw_add(&g_data.zwait_timers, &w->timer, get_monotonic_msec() + ms);
+    }
+    w->async.done = &zwait_done;
+    w->async.cancel = &zwait_cancel;
+    g_data.async = &w->async;
+};
+
+static void do_bzpopmin(const CmdArgs &cmd, Buffer &out){
+    return do_bzpop(cmd, out, false);
+};
+
+static void do_bzpopmax(const CmdArgs &cmd, Buffer &out){
+    return do_bzpop(cmd, out, true);
 };
 
-static void do_expire(std::vector<std::string> &cmd, Buffer &out){
+static void do_expire(const CmdArgs &cmd, Buffer &out){
     int64_t ttl_ms = 0;
     if(!str2int(cmd[2], ttl_ms)){
         return out_err(out, ERR_BAD_ARG, "expect int64");
     }
 
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = entry_lookup(cmd[1], key);
 
-    if(node){
-        Entry *ent = container_of(node, Entry, node);
+    if(ent){
+        entry_touch(ent);
         entry_set_ttl(ent, ttl_ms);
-    } 
-    return out_int(out, node ? 1 : 0);
+    }
+    return out_int(out, ent ? 1 : 0);
 };
 
-static void do_ttl(std::vector<std::string> &cmd, Buffer &out){
+static void do_ttl(const CmdArgs &cmd, Buffer &out){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if(!node){
-        out_int(out, -2); // not found
+    Entry *ent = entry_lookup(cmd[1], key);
+    if(!ent){
+        return out_int(out, -2); // not found
     }
 
-    Entry *ent = container_of(node, Entry, node);
-    if(ent->heap_idx == (size_t)-1){
+    uint64_t expire_at = entry_expire_at(ent);
+    if(expire_at == (uint64_t)-1){
         return out_int(out, -1); // not TTL
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
     uint64_t now_ms = get_monotonic_msec();
     return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
 };
 
-void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
-    } else {
+struct SaveArg {
+    RdbWriter *w;
+    uint64_t now_ms;
+};
+
+static bool cb_save(HNode *node, void *arg){
+    SaveArg *sa = (SaveArg *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if(entry_expired(ent, sa->now_ms)){
+        return true;
+    }
+    int64_t ttl_ms = ent->ttl ? (int64_t)(entry_expire_at(ent) - sa->now_ms) : -1;
+    if(ent->type == T_STR){
+        std::string_view val = ent->blob
+            ? std::string_view((const char *)blob_data(ent->blob), ent->blob->len)
+            : std::string_view(entry_val(ent), ent->vlen);
+        rdb_write_str(sa->w, entry_key(ent), val, ttl_ms);
+    } else if(ent->type == T_ZSET){
+        // in (score, name) order
+        size_t n = zset_size(ent->zset);
+        rdb_write_zset(sa->w, entry_key(ent), n, ttl_ms);
+        ZIter it = zset_at(ent->zset, 0);
+        for(size_t i = 0; i < n; ++i){
+            ZMember m = zset_iter_get(&it);
+            rdb_write_member(sa->w, m.score, std::string_view(m.name, m.len));
+            zset_iter_offset(&it, 1);
+        }
+    }
+    return sa->w->ok;   // stop at a write error
+};
+
+// this shard's part, as of `unix_ms`; also runs in the BGSAVE child
+static bool db_save(uint64_t unix_ms){
+    uint32_t parts = (uint32_t)g_reactors.size();
+    std::string path = rdb_part_path(g_data.dbfilename, unix_ms, g_data.shard_id, parts);
+    RdbWriter w;
+    if(!rdb_create(&w, path.c_str(), g_data.shard_id, parts, unix_ms)){
+        return false;
+    }
+    SaveArg sa = {&w, get_monotonic_msec()};
+    hm_foreach(&g_data.db, &cb_save, (void *)&sa);
+    if(!rdb_finish(&w, path.c_str())){
+        return false;
+    }
+    // the last part in place, on whichever shard, replaces the older saves
+    if(rdb_complete(g_data.dbfilename, unix_ms, parts)){
+        rdb_prune(g_data.dbfilename, unix_ms);
+    }
+    return true;
+};
+
+static void save_done(bool ok, uint64_t unix_ms, uint64_t started_us){
+    SaveStats &st = g_data.save;
+    st.last_ok = ok;
+    st.last_us = get_monotonic_usec() - started_us;
+    if(ok){
+        st.saves++;
+        st.last_unix_ms = unix_ms;
+    }
+};
+
+// the reply of each shard is one string, or an error
+static bool save_allowed(Buffer &out){
+    if(g_data.dbfilename.empty()){
+        out_err(out, ERR_IO, "no dbfilename");
+        return false;
+    }
+    if(g_data.save.child > 0){
+        out_err(out, ERR_BUSY, "a background save is in progress");
+        return false;
+    }
+    return true;
+};
+
+// the same for the parts of every shard, which tells them from the parts
+// of another save
+static uint64_t save_unix_ms(){
+    return g_data.scatter_unix_ms ? g_data.scatter_unix_ms : get_realtime_msec();
+};
+
+// blocks the shard while it writes
+static void do_save(const CmdArgs &, Buffer &out){
+    size_t ctx = out_begin_arr(out);
+    if(save_allowed(out)){
+        uint64_t unix_ms = save_unix_ms();
+        uint64_t start_us = get_monotonic_usec();
+        bool ok = db_save(unix_ms);
+        save_done(ok, unix_ms, start_us);
+        if(ok){
+            out_str(out, "OK", 2);
+        } else {
+            out_err(out, ERR_IO, "can't write the snapshot");
+        }
+    }
+    out_end_arr(out, ctx, 1);
+};
+
+// The child writes the keyspace as it was at the fork, from its copy of
+// the memory, while the shard keeps serving; the kernel copies the pages
+// the shard writes to meanwhile. Only the forking thread exists in the
+// child, which touches nothing but this shard's keys and its own buffer.
+static void do_bgsave(const CmdArgs &, Buffer &out){
+    size_t ctx = out_begin_arr(out);
+    if(save_allowed(out)){
+        uint64_t unix_ms = save_unix_ms();
+        uint64_t start_us = get_monotonic_usec();
+        pid_t pid = fork();
+        if(pid == 0){
+            _exit(db_save(unix_ms) ? 0 : 1);
+        }
+        if(pid < 0){
+            out_err(out, ERR_IO, "fork() failed");
+        } else {
+            SaveStats &st = g_data.save;
+            st.child = pid;
+            st.child_unix_ms = unix_ms;
+            st.started_us = start_us;
+            st.fork_us = get_monotonic_usec() - start_us;
+            const char msg[] = "Background saving started";
+            out_str(out, msg, sizeof(msg) - 1);
+        }
+    }
+    out_end_arr(out, ctx, 1);
+};
+
+void bgsave_check(){
+    SaveStats &st = g_data.save;
+    if(st.child <= 0){
+        return;
+    }
+    int status = 0;
+    pid_t pid = waitpid(st.child, &status, WNOHANG);
+    if(pid == 0){
+        return;     // still running
+    }
+    bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    save_done(ok, st.child_unix_ms, st.started_us);
+    st.child = -1;
+    fprintf(stderr, "shard %u: background save %s in %llu ms\n", g_data.shard_id,
+        ok ? "done" : "failed", (unsigned long long)(st.last_us / 1000));
+};
+
+// on the main thread, before the reactors and the pools start
+static void load_fail(const std::string &path, const std::string &err){
+    fprintf(stderr, "can't load %s: %s\n", path.c_str(), err.c_str());
+    exit(1);
+};
+
+// the records for each shard, split by db_load_read()
+static std::vector<std::string> g_load_records;
+static uint64_t g_load_saved_ms = 0;
+
+// copies every record of a part, members included, to its shard's records
+static void load_split(RdbReader &r){
+    bool route = g_reactors.size() > 1;
+    RdbRecord rec;
+    while(true){
+        size_t start = r.pos;
+        if(!rdb_next(&r, &rec)){
+            return;
+        }
+        for(size_t i = 0; rec.type == RDB_ZSET && i < rec.n; ++i){
+            double score = 0;
+            std::string_view name;
+            if(!rdb_next_member(&r, &score, &name)){
+                return;
+            }
+        }
+        const uint8_t *kdata = (const uint8_t *)rec.key.data();
+        uint32_t shard = route ? shard_of(kdata, rec.key.size()) : 0;
+        g_load_records[shard].append(&r.data[start], r.pos - start);
+    }
+};
+
+// The hash seed is new in every process and the number of reactors may
+// have changed, so each part is read once and its keys go to the shard
+// that now owns them. The newest save with all of its parts is loaded,
+// none is an empty keyspace; a damaged part, or one that isn't what its
+// name says, stops the server.
+void db_load_read(const std::string &dbfilename){
+    uint32_t parts = 0;
+    if(dbfilename.empty() || !rdb_latest(dbfilename, &g_load_saved_ms, &parts)){
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    g_load_records.assign(g_reactors.size(), std::string());
+    for(uint32_t part = 0; part < parts; ++part){
+        std::string path = rdb_part_path(dbfilename, g_load_saved_ms, part, parts);
+        std::string err;
+        RdbReader r;
+        if(!rdb_open(&r, path.c_str(), err)){
+            load_fail(path, err);
+        }
+        if(parts == 1){
+            g_load_saved_ms = r.saved_ms;   // the header read in full
+        }
+        if(r.part != part || r.parts != parts || r.saved_ms != g_load_saved_ms){
+            load_fail(path, "not a part of the same snapshot");
+        }
+        load_split(r);
+        if(r.err){
+            load_fail(path, r.err);
+        }
+    }
+    for(std::string &records : g_load_records){
+        records.push_back((char)RDB_EOF);
+    }
+    fprintf(stderr, "read %u snapshot part(s) in %llu ms\n", parts,
+        (unsigned long long)((get_monotonic_usec() - start_us) / 1000));
+};
+
+// the keys split for this shard, with their TTLs shortened by the time
+// since the save
+void db_load(){
+    if(g_data.shard_id >= g_load_records.size()){
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    RdbReader r;
+    rdb_open_records(&r, std::move(g_load_records[g_data.shard_id]));
+    uint64_t now_ms = get_realtime_msec();
+    int64_t age_ms = now_ms > g_load_saved_ms ? (int64_t)(now_ms - g_load_saved_ms) : 0;
+    std::vector<ZMember> members;
+    size_t loaded = 0;
+    RdbRecord rec;
+    while(rdb_next(&r, &rec)){
+        members.clear();
+        for(size_t i = 0; rec.type == RDB_ZSET && i < rec.n; ++i){
+            double score = 0;
+            std::string_view name;
+            bool ok = rdb_next_member(&r, &score, &name);
+            assert(ok);     // checked by db_load_read()
+            members.push_back(ZMember{score, name.data(), name.size()});
+        }
+        LookupKey key;
+        if((rec.ttl_ms >= 0 && rec.ttl_ms <= age_ms) || entry_lookup(rec.key, key)){
+            continue;   // expired meanwhile, or the first copy wins
+        }
+        Entry *ent = NULL;
+        if(rec.type == RDB_STR){
+            size_t vlen = rec.val.size() < k_blob_min ? rec.val.size() : 0;
+            ent = entry_set_str(entry_new(T_STR, key, vlen), rec.val);
+            hm_insert(&g_data.db, &ent->node);
+        } else if(!members.empty()){
+            // sorted, so the tree is built without sorting
+            ent = entry_new(T_ZSET, key, 0);
+            hm_insert(&g_data.db, &ent->node);
+            zset_insert_bulk(ent->zset, members.data(), members.size(), g_data.thread_pool);
+            g_data.used_memory += ent->zset->bytes;
+        } else {
+            continue;
+        }
+        if(rec.ttl_ms >= 0){
+            entry_set_ttl(ent, rec.ttl_ms - age_ms);
+        }
+        loaded++;
+    }
+    assert(!r.err);
+    db_account();
+    fprintf(stderr, "shard %u: loaded %zu keys in %llu ms\n", g_data.shard_id, loaded,
+        (unsigned long long)((get_monotonic_usec() - start_us) / 1000));
+};
+
+static uint32_t out_stat(Buffer &out, const char *name, const char *fmt, ...){
+    char line[128];
+    int n = snprintf(line, sizeof(line), "%s:", name);
+    va_list ap;
+    va_start(ap, fmt);
+    n += vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+    out_str(out, line, (size_t)n);
+    return 1;
+};
+
+// "name:value" strings; with reactors, every shard appends its own
+static void do_info(const CmdArgs &, Buffer &out){
+    SlabStats slab;
+    slab_stats(&slab);
+    size_t page_bytes = slab.pages * k_slab_page;
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    n += out_stat(out, "shard", "%u", g_data.shard_id);
+    n += out_stat(out, "keys", "%zu", hm_size(&g_data.db));
+    n += out_stat(out, "used_memory", "%zu", g_data.used_memory);
+    n += out_stat(out, "maxmemory", "%zu", g_data.maxmemory);
+    n += out_stat(out, "maxmemory_policy", "%s", evict_policy_name(g_data.evict_policy));
+    n += out_stat(out, "evicted_keys", "%llu", (unsigned long long)g_data.evicted_keys);
+    n += out_stat(out, "expired_keys", "%llu", (unsigned long long)g_data.expire.keys);
+    n += out_stat(out, "expired_on_access", "%llu", (unsigned long long)g_data.expire.lazy);
+    n += out_stat(out, "expired_keys_per_sec", "%llu", (unsigned long long)g_data.expire.rate);
+    n += out_stat(out, "expire_lag_ms", "%llu", (unsigned long long)g_data.expire.lag_ms);
+    n += out_stat(out, "expire_budget_us", "%u", g_data.expire.budget_us);
+    n += out_stat(out, "slab_pages", "%zu", slab.pages);
+    n += out_stat(out, "slab_page_bytes", "%zu", page_bytes);
+    n += out_stat(out, "slab_objects", "%zu", slab.objects);
+    n += out_stat(out, "slab_used_bytes", "%zu", slab.used_bytes);
+    n += out_stat(out, "slab_requested_bytes", "%zu", slab.req_bytes);
+    // pages held per byte asked for, 1.0 is no waste
+    n += out_stat(out, "slab_frag_ratio", "%.2f",
+        slab.req_bytes ? (double)page_bytes / slab.req_bytes : 0.0);
+    n += out_stat(out, "slab_allocs", "%llu", (unsigned long long)slab.allocs);
+    n += out_stat(out, "slab_frees", "%llu", (unsigned long long)slab.frees);
+    n += out_stat(out, "slab_remote_frees", "%llu", (unsigned long long)slab.remote_frees);
+    n += out_stat(out, "large_objects", "%zu", slab.large_objects);
+    n += out_stat(out, "large_bytes", "%zu", slab.large_bytes);
+    // the pool is shared, the first shard reports it
+    if(g_data.shard_id == 0 && g_data.thread_pool){
+        PoolStats pool;
+        thread_pool_stats(g_data.thread_pool, &pool);
+        n += out_stat(out, "pool_threads", "%zu", pool.threads);
+        n += out_stat(out, "pool_queued", "%zu", pool.queued);
+        n += out_stat(out, "pool_submitted", "%llu", (unsigned long long)pool.submitted);
+        n += out_stat(out, "pool_tasks", "%llu", (unsigned long long)pool.tasks);
+        n += out_stat(out, "pool_steals", "%llu", (unsigned long long)pool.steals);
+        n += out_stat(out, "pool_parks", "%llu", (unsigned long long)pool.parks);
+    }
+    const SaveStats &save = g_data.save;
+    n += out_stat(out, "rdb_bgsave_in_progress", "%d", save.child > 0 ? 1 : 0);
+    n += out_stat(out, "rdb_saves", "%llu", (unsigned long long)save.saves);
+    n += out_stat(out, "rdb_last_save_status", "%s", save.last_ok ? "ok" : "err");
+    n += out_stat(out, "rdb_last_save_time", "%llu", (unsigned long long)(save.last_unix_ms / 1000));
+    n += out_stat(out, "rdb_last_save_ms", "%llu", (unsigned long long)(save.last_us / 1000));
+    n += out_stat(out, "rdb_last_fork_us", "%llu", (unsigned long long)save.fork_us);
+    out_end_arr(out, ctx, n);
+};
+
+// the command table; `arity` counts the name, -N means at least N args
+static constexpr Command k_commands[] = {
+    // name          arity  flags                            keys      handler
+    {"get",          2,   CMD_READONLY,                    1, 1, 1,  &do_get},
+    {"set",          3,   CMD_WRITE | CMD_DENYOOM,         1, 1, 1,  &do_set},
+    {"del",          2,   CMD_WRITE,                       1, 1, 1,  &do_del},
+    {"pexpire",      3,   CMD_WRITE,                       1, 1, 1,  &do_expire},
+    {"pttl",         2,   CMD_READONLY,                    1, 1, 1,  &do_ttl},
+    {"keys",         1,   CMD_READONLY | CMD_ALL_SHARDS,   0, 0, 0,  &do_keys},
+    {"zadd",         -4,  CMD_WRITE | CMD_DENYOOM,         1, 1, 1,  &do_zadd},
+    {"zrem",         3,   CMD_WRITE,                       1, 1, 1,  &do_zrem},
+    {"zscore",       3,   CMD_READONLY,                    1, 1, 1,  &do_zscore},
+    {"zquery",       6,   CMD_READONLY,                    1, 1, 1,  &do_zquery},
+    {"zrank",        3,   CMD_READONLY,                    1, 1, 1,  &do_zrank},
+    {"zrevrank",     3,   CMD_READONLY,                    1, 1, 1,  &do_zrevrank},
+    {"zcount",       4,   CMD_READONLY,                    1, 1, 1,  &do_zcount},
+    {"zsumrange",    4,   CMD_READONLY,                    1, 1, 1,  &do_zsumrange},
+    {"zavgrange",    4,   CMD_READONLY,                    1, 1, 1,  &do_zavgrange},
+    {"zrange",       4,   CMD_READONLY,                    1, 1, 1,  &do_zrange},
+    {"zrevrange",    4,   CMD_READONLY,                    1, 1, 1,  &do_zrevrange},
+    {"zrangebyscore", -4, CMD_READONLY,                    1, 1, 1,  &do_zrangebyscore},
+    {"zrevrangebyscore", -4, CMD_READONLY,                 1, 1, 1,  &do_zrevrangebyscore},
+    {"zunionstore",  -4,  CMD_WRITE | CMD_DENYOOM | CMD_ASYNC, 1, 1, 1, &do_zunionstore},
+    {"zinterstore",  -4,  CMD_WRITE | CMD_DENYOOM | CMD_ASYNC, 1, 1, 1, &do_zinterstore},
+    {"zpopmin",      -2,  CMD_WRITE,                       1, 1, 1,  &do_zpopmin},
+    {"zpopmax",      -2,  CMD_WRITE,                       1, 1, 1,  &do_zpopmax},
+    {"bzpopmin",     -3,  CMD_WRITE | CMD_ASYNC,           1, -2, 1, &do_bzpopmin},
+    {"bzpopmax",     -3,  CMD_WRITE | CMD_ASYNC,           1, -2, 1, &do_bzpopmax},
+    {"info",         1,   CMD_READONLY | CMD_ALL_SHARDS,   0, 0, 0,  &do_info},
+    {"save",         1,   CMD_READONLY | CMD_ALL_SHARDS,   0, 0, 0,  &do_save},
+    {"bgsave",       1,   CMD_READONLY | CMD_ALL_SHARDS,   0, 0, 0,  &do_bgsave},
+};
+const size_t k_ncommands = sizeof(k_commands) / sizeof(k_commands[0]);
+
+// perfect hashing: a seed is searched at compile time so that every
+// command lands in its own slot, a lookup is one hash and one compare
+const size_t k_cmd_slots = 64;      // power of 2
+const uint8_t k_cmd_empty = 0xff;
+
+static constexpr uint32_t cmd_hash(std::string_view name, uint32_t seed){
+    uint32_t h = 0x811C9DC5 ^ seed;
+    for(char c : name){
+        h = (h ^ (uint8_t)c) * 0x01000193;
+    }
+    return h ^ (h >> 15);
+};
+
+struct CmdIndex {
+    uint32_t seed = 0;
+    uint8_t slots[k_cmd_slots] = {};
+};
+
+static constexpr CmdIndex cmd_index_build(){
+    static_assert(k_ncommands < k_cmd_slots, "enlarge k_cmd_slots");
+    for(uint32_t seed = 1; seed < 1000000; ++seed){
+        CmdIndex idx;
+        idx.seed = seed;
+        for(size_t i = 0; i < k_cmd_slots; ++i){
+            idx.slots[i] = k_cmd_empty;
+        }
+        bool ok = true;
+        for(size_t i = 0; ok && i < k_ncommands; ++i){
+            uint32_t pos = cmd_hash(k_commands[i].name, seed) & (k_cmd_slots - 1);
+            ok = idx.slots[pos] == k_cmd_empty;
+            idx.slots[pos] = (uint8_t)i;
+        }
+        if(ok){
+            return idx;
+        }
+    }
+    return CmdIndex();
+};
+
+static constexpr CmdIndex k_cmd_index = cmd_index_build();
+static_assert(k_cmd_index.seed != 0, "no perfect hash seed for the command table");
+
+const Command *cmd_lookup(std::string_view name){
+    uint32_t pos = cmd_hash(name, k_cmd_index.seed) & (k_cmd_slots - 1);
+    uint8_t i = k_cmd_index.slots[pos];
+    if(i == k_cmd_empty || k_commands[i].name != name){
+        return NULL;
+    }
+    return &k_commands[i];
+};
+
+bool cmd_arity_ok(const Command *c, size_t nargs){
+    return c->arity >= 0 ? nargs == (size_t)c->arity : nargs >= (size_t)-c->arity;
+};
+
+bool cmd_async(const CmdArgs &cmd){
+    const Command *c = cmd.size() ? cmd_lookup(cmd[0]) : NULL;
+    return c && (c->flags & CMD_ASYNC);
+};
+
+void do_request(const CmdArgs &cmd, Buffer &out) {
+    const Command *c = cmd.size() ? cmd_lookup(cmd[0]) : NULL;
+    if(!c || !cmd_arity_ok(c, cmd.size())){
         return out_err(out, ERR_UNKNOWN, "unknown command.");
     }
-};
\ No newline at end of file
+    if((c->flags & CMD_DENYOOM) && !evict_for_write()){
+        return out_err(out, ERR_OOM, "command not allowed when used memory > 'maxmemory'.");
+    }
+    c->handler(cmd, out);
+    db_account();
+};
@@ -5,22 +5,111 @@
 #include "hashmap.h"
 #include "zset.h"
 #include "heap.h"
+#include "timer_wheel.h"
 #include "thread_pool.h"
+#include "event_loop.h"
+#include "blob.h"
+#include "hash.h"
+#include "protocol_serialization.h"
+#include "server_config.h"
 
 #include <map>
 #include <string>
 
+// TTL timer engines
+enum {
+    TIMERS_HEAP = 0,    // binary heap, O(log n)
+    TIMERS_WHEEL = 1,   // hierarchical timing wheel, O(1)
+};
+
+struct ExpireStats {
+    uint64_t keys = 0;          // expired on access or by the active cycle
+    uint64_t lazy = 0;          // of which on access
+    uint32_t budget_us = k_expire_budget_us;   // of the next active cycle
+    uint64_t lag_ms = 0;        // how overdue the oldest expired key is
+    uint64_t rate = 0;          // keys/sec, over the last second or so
+    uint64_t rate_start_ms = 0;
+    uint64_t rate_keys = 0;
+};
+
+// A command finished off the event loop. Its handler sets g_data.async
+// instead of writing a response, and the connection waits as if the
+// request was forwarded: `work` runs on the thread pool and calls
+// `finished` at the end, from any thread, then `done` writes the response
+// back on the shard's loop, where the keyspace can be touched again.
+// Without `work` the command is parked on the shard until it is finished
+// there, like a blocking pop. Commands flagged CMD_ASYNC always may be;
+// others check g_data.async_ok, false when earlier responses are pending.
+struct AsyncCmd {
+    void (*work)(AsyncCmd *cmd) = NULL;
+    void (*done)(AsyncCmd *cmd, Buffer &out) = NULL;   // and frees it
+    // set by the reactor that takes the command
+    void (*finished)(AsyncCmd *cmd) = NULL;
+    void *token = NULL;
+    Conn *conn = NULL;      // the client, only `closed` may be read here
+    // parked commands: the client is gone, call `finished` now
+    void (*cancel)(AsyncCmd *cmd) = NULL;
+};
+
+// a sorted set read on the thread pool; writes to it go to a copy
+struct ZPin {
+    uint32_t readers = 0;
+    bool detached = false;  // no longer the key's, the last reader frees it
+};
+
+// SAVE and BGSAVE of this shard, see rdb.h
+struct SaveStats {
+    int child = -1;             // the pid of the BGSAVE in progress
+    uint64_t child_unix_ms = 0; // the point in time it is saving
+    uint64_t started_us = 0;
+    uint64_t saves = 0;         // successful ones
+    bool last_ok = true;
+    uint64_t last_unix_ms = 0;  // of the last successful one
+    uint64_t last_us = 0;       // how long it took, fork to exit for a BGSAVE
+    uint64_t fork_us = 0;       // the loop's pause in the last fork()
+};
+
 struct GlobalData {
     HMap db;
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
     // timers for idle connections
     DList idle_list;
-    // timers for TTLs
+    // timers for TTLs, on one of the engines
+    uint32_t timers = TIMERS_HEAP;
     std::vector<HeapItem> heap;
-    // the thread pool
-    ThreadPool thread_pool;
-    
+    TimerWheel wheel;
+    ExpireStats expire;
+    // the thread pool, shared by all reactors
+    ThreadPool *thread_pool = NULL;
+    // the reactor running this thread, which is also its keyspace shard
+    uint32_t shard_id = 0;
+    // readiness notification backend
+    EventLoop loop;
+    // memory of the keys, values and TTLs of this shard, and the hash slots
+    // of `db`, which are `db_bytes` of it
+    size_t used_memory = 0;
+    size_t db_bytes = 0;
+    // this shard's share of maxmemory, 0 for no limit
+    size_t maxmemory = 0;
+    uint32_t evict_policy = 0;
+    bool evict_stalled = false;     // nothing left to evict
+    uint64_t evicted_keys = 0;
+    // left by the handler of a command that finishes on the thread pool
+    AsyncCmd *async = NULL;
+    // whether the command being run may leave one
+    bool async_ok = false;
+    // a command run on all shards: when the origin received it, the same
+    // on every shard; 0 otherwise
+    uint64_t scatter_unix_ms = 0;
+    // sorted sets pinned by the reads in flight
+    std::map<ZSet *, ZPin> zpins;
+    // blocked pops: the wait list of each key, and their timeouts
+    std::map<std::string, DList, std::less<>> zwaits;
+    TimerWheel zwait_timers;
+    // the snapshot file, this shard's part of it; empty for none
+    std::string dbfilename;
+    SaveStats save;
 };
 
 enum {
@@ -29,41 +118,45 @@ enum {
     T_ZSET = 2,
 };
 
+struct Entry;
+
+// TTL metadata, only allocated for keys with an expiry
+struct EntryTTL {
+    Entry *ent = NULL;      // the owner, updated when the entry moves
+    // depending on the engine
+    size_t heap_idx = -1;
+    TWTimer timer;
+};
+
+// One variable-sized allocation per key: the header, the key bytes, then
+// an inline T_STR value. A value that outgrows the block moves the entry
+// to a bigger one; a large value is kept in a Blob instead, so responses
+// can point to it until they are sent.
 struct Entry {
     struct HNode node;
-    std::string key;
-    // value
-    uint32_t type = 0;
-    // one of the following
+    EntryTTL *ttl = NULL;
     union {
-        std::string str;
-        ZSet zset;
+        Blob *blob = NULL;  // T_STR, NULL when the value is inline
+        ZSet *zset;         // T_ZSET
     };
+    uint32_t klen = 0;
+    uint32_t lru = 0;       // LRU clock or LFU counter, see eviction.h
+    uint16_t vlen = 0;      // the inline value
+    uint16_t vcap = 0;      // room for it after the key
+    uint8_t type = T_INIT;
+    char data[0];           // key, then value
+};
 
-    // for TTL
-    size_t heap_idx = -1;
-    //
-
-    explicit Entry(uint32_t type): type(type){
-        if(type == T_STR){
-            new (&str) std::string;
-        } else if (type == T_ZSET){
-            new (&zset) ZSet;
-        }
-    }
-
-    ~Entry(){
-        if(type == T_STR){
-            str.~basic_string();
-        } else if(type == T_ZSET){
-            zset_clear(&zset);
-        }
-    }
+static_assert(k_blob_min <= UINT16_MAX + 1, "inline values are sized by uint16_t");
+
+inline std::string_view entry_key(const Entry *ent){
+    return std::string_view(ent->data, ent->klen);
 };
 
+// a key to look up, viewing the request buffer
 struct LookupKey {
     struct HNode node; // hashtable node
-    std::string key;
+    std::string_view key;
 };
 
 // error code for TAG_ERR
@@ -72,6 +165,9 @@ enum {
     ERR_TOO_BIG = 2,    // response too big
     ERR_BAD_TYP = 3,    // unexpected value type
     ERR_BAD_ARG = 4,    // bad arguments
+    ERR_OOM = 5,        // over maxmemory, nothing to evict
+    ERR_BUSY = 6,       // a background save is in progress
+    ERR_IO = 7,         // the snapshot couldn't be written
 };
 
 enum {
@@ -83,16 +179,54 @@ enum {
     TAG_ARR = 5,    // Represents an array (can contain elements of any other type, including nested arrays)
 };
 
-void out_err(Buffer &out, uint32_t code, const std::string &msg);
-uint64_t str_hash(const uint8_t *data, size_t len);
+void out_err(Buffer &out, uint32_t code, std::string_view msg);
 // Utility functions required for data store operations
 bool entry_eq(HNode *lhs, HNode *rhs);
+bool hnode_same(HNode *node, HNode *key);
 
 void entry_del(Entry *ent);
 void entry_set_ttl(Entry *ent, int64_t ttl_ms);
+// counts the hash slots of the keyspace after it changed
+void db_account();
+uint64_t entry_expire_at(Entry *ent);
+uint64_t ttl_next_ms();
+void expire_cycle();
+// times out the blocked pops
+void zwait_expire(uint64_t now_ms);
+// snapshots: every part is read once on the main thread, before the
+// reactors start, then each shard loads its keys before its loop starts;
+// a finished BGSAVE child is reaped from the loop
+void db_load_read(const std::string &dbfilename);
+void db_load();
+void bgsave_check();
+
+// command flags
+enum {
+    CMD_READONLY = 1 << 0,
+    CMD_WRITE = 1 << 1,
+    CMD_ALL_SHARDS = 1 << 2,    // runs on every shard, the arrays are concatenated
+    CMD_DENYOOM = 1 << 3,       // may use more memory, refused over maxmemory
+    CMD_ASYNC = 1 << 4,         // may finish on the thread pool, see AsyncCmd
+};
+
+struct Command {
+    std::string_view name;
+    int32_t arity;      // args including the name, -N means at least N
+    uint32_t flags;
+    // key positions: first, last (-1 is the last arg) and step; 0 if none
+    int32_t first_key;
+    int32_t last_key;
+    int32_t key_step;
+    void (*handler)(const CmdArgs &cmd, Buffer &out);
+};
+
+const Command *cmd_lookup(std::string_view name);
+bool cmd_arity_ok(const Command *c, size_t nargs);
+bool cmd_async(const CmdArgs &cmd);
 
 // The main request dispatcher
-void do_request(std::vector<std::string> &cmd, Buffer &out);
+void do_request(const CmdArgs &cmd, Buffer &out);
 
-extern GlobalData g_data;
+// one instance per reactor thread
+extern thread_local GlobalData g_data;
 #endif
\ No newline at end of file
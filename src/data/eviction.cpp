@@ -0,0 +1,191 @@
+#include "eviction.h"
+#include "utils/timer.h"
+
+#include <assert.h>
+#include <string.h>
+
+// keys sampled per eviction, the best candidate is evicted
+const size_t k_evict_samples = 5;
+// evicted inline by a write over the limit, the event loop does the rest
+const size_t k_evict_write_keys = 16;
+// time budget of one evict_cycle()
+const uint64_t k_evict_cycle_us = 500;
+// LFU: the counter of a new key, its growth and decay
+const uint32_t k_lfu_init = 5;
+const uint32_t k_lfu_log_factor = 10;
+const uint32_t k_lfu_decay_min = 1;
+
+struct PolicyName {
+    uint32_t policy;
+    const char *name;
+};
+
+static const PolicyName k_policies[] = {
+    {EVICT_NOEVICTION,   "noeviction"},
+    {EVICT_ALLKEYS_LRU,  "allkeys-lru"},
+    {EVICT_ALLKEYS_LFU,  "allkeys-lfu"},
+    {EVICT_VOLATILE_TTL, "volatile-ttl"},
+};
+
+bool evict_policy_parse(const char *name, uint32_t *policy){
+    for(const PolicyName &p : k_policies){
+        if(strcmp(p.name, name) == 0){
+            *policy = p.policy;
+            return true;
+        }
+    }
+    return false;
+};
+
+const char *evict_policy_name(uint32_t policy){
+    for(const PolicyName &p : k_policies){
+        if(p.policy == policy){
+            return p.name;
+        }
+    }
+    return "unknown";
+};
+
+// xorshift64*, per thread
+static uint64_t evict_rand(){
+    static thread_local uint64_t state = 0;
+    if(state == 0){
+        state = get_monotonic_usec() * 0x9E3779B97F4A7C15ull | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+};
+
+static uint32_t lfu_minutes(){
+    return (uint32_t)(get_monotonic_msec() / 60000) & 0xffff;
+};
+
+// the counter, less one for every k_lfu_decay_min idle minutes
+static uint32_t lfu_counter(uint32_t lru){
+    uint32_t counter = lru & 0xff;
+    uint32_t idle = (lfu_minutes() - (lru >> 8)) & 0xffff;
+    uint32_t decay = idle / k_lfu_decay_min;
+    return decay > counter ? 0 : counter - decay;
+};
+
+void entry_touch_init(Entry *ent){
+    if(g_data.evict_policy == EVICT_ALLKEYS_LFU){
+        ent->lru = lfu_minutes() << 8 | k_lfu_init;
+    } else {
+        ent->lru = (uint32_t)get_monotonic_msec();
+    }
+};
+
+void entry_touch(Entry *ent){
+    if(g_data.evict_policy == EVICT_ALLKEYS_LRU){
+        ent->lru = (uint32_t)get_monotonic_msec();
+    } else if(g_data.evict_policy == EVICT_ALLKEYS_LFU){
+        // the more accesses, the less likely an increment
+        uint32_t counter = lfu_counter(ent->lru);
+        if(counter < 255){
+            double base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+            double p = 1.0 / (base * k_lfu_log_factor + 1);
+            if((double)(evict_rand() >> 11) * 0x1.0p-53 < p){
+                counter++;
+            }
+        }
+        ent->lru = lfu_minutes() << 8 | counter;
+    }
+};
+
+// the higher, the better to evict
+static uint64_t evict_score(Entry *ent, uint64_t now_ms){
+    switch(g_data.evict_policy){
+    case EVICT_ALLKEYS_LRU:
+        return (uint32_t)((uint32_t)now_ms - ent->lru);
+    case EVICT_ALLKEYS_LFU:
+        return 255 - lfu_counter(ent->lru);
+    default:
+        return ~entry_expire_at(ent);
+    }
+};
+
+// evicts the best of a few sampled keys, false if there is none
+static bool evict_one(){
+    bool volatile_only = g_data.evict_policy == EVICT_VOLATILE_TTL;
+    // keys without a TTL don't count, look a bit further for those
+    size_t tries = volatile_only ? k_evict_samples * 4 : k_evict_samples;
+    uint64_t now_ms = get_monotonic_msec();
+    Entry *victim = NULL;
+    uint64_t best = 0;
+    size_t found = 0;
+    for(size_t i = 0; i < tries && found < k_evict_samples; ++i){
+        HNode *node = hm_sample(&g_data.db, evict_rand());
+        if(!node){
+            break;
+        }
+        Entry *ent = container_of(node, Entry, node);
+        if(volatile_only && !ent->ttl){
+            continue;
+        }
+        found++;
+        uint64_t score = evict_score(ent, now_ms);
+        if(!victim || score > best){
+            victim = ent;
+            best = score;
+        }
+    }
+    if(!victim){
+        return false;
+    }
+    HNode *node = hm_delete(&g_data.db, &victim->node, &hnode_same);
+    assert(node == &victim->node);
+    entry_del(victim);
+    db_account();
+    g_data.evicted_keys++;
+    return true;
+};
+
+static bool over_limit(){
+    return g_data.maxmemory && g_data.used_memory > g_data.maxmemory;
+};
+
+bool evict_for_write(){
+    if(!over_limit()){
+        return true;
+    }
+    g_data.evict_stalled = false;   // the keyspace may have changed
+    if(g_data.evict_policy == EVICT_NOEVICTION){
+        return false;
+    }
+    size_t n = 0;
+    while(over_limit() && n < k_evict_write_keys){
+        if(!evict_one()){
+            g_data.evict_stalled = true;
+            break;
+        }
+        n++;
+    }
+    return !over_limit() || n > 0;
+};
+
+bool evict_pending(){
+    return over_limit() && g_data.evict_policy != EVICT_NOEVICTION
+        && !g_data.evict_stalled;
+};
+
+void evict_cycle(){
+    if(!evict_pending()){
+        return;
+    }
+    uint64_t start = get_monotonic_usec();
+    while(over_limit()){
+        // check the clock every few keys
+        for(size_t i = 0; i < 16 && over_limit(); ++i){
+            if(!evict_one()){
+                g_data.evict_stalled = true;
+                return;
+            }
+        }
+        if(get_monotonic_usec() - start >= k_evict_cycle_us){
+            break;
+        }
+    }
+};
@@ -0,0 +1,31 @@
+#ifndef EVICTION_H
+#define EVICTION_H
+
+#include "data_store.h"
+
+// maxmemory policies
+enum {
+    EVICT_NOEVICTION = 0,   // refuse writes over the limit
+    EVICT_ALLKEYS_LRU = 1,  // the least recently used keys
+    EVICT_ALLKEYS_LFU = 2,  // the least frequently used keys
+    EVICT_VOLATILE_TTL = 3, // the keys with a TTL, the closest expiry first
+};
+
+bool evict_policy_parse(const char *name, uint32_t *policy);
+const char *evict_policy_name(uint32_t policy);
+
+// Entry::lru, by the policy. LRU: the last access in ms, wrapping at 32
+// bits. LFU: the last access in minutes (16 bits) and a logarithmic
+// access counter (8 bits) that drops by 1 every idle minute.
+void entry_touch_init(Entry *ent);
+void entry_touch(Entry *ent);
+
+// Before a write that may use more memory: evicts a few keys if over the
+// limit, false if nothing could be freed.
+bool evict_for_write();
+// whether the event loop should keep evicting
+bool evict_pending();
+// evicts for a bounded time, from the event loop
+void evict_cycle();
+
+#endif
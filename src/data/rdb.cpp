@@ -0,0 +1,447 @@
+#include "rdb.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+
+// flushed to the file this often
+const size_t k_rdb_buf_size = 64 * 1024;
+const size_t k_rdb_header_size = 4 + 1 + 4 + 4 + 8;
+const char k_rdb_magic[4] = {'Z', 'R', 'D', 'B'};
+
+// slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes
+struct Crc64Table {
+    uint64_t t[8][256];
+};
+
+static Crc64Table crc64_table(){
+    const uint64_t poly = 0x95ac9329ac4bc9b5ULL;
+    Crc64Table tab;
+    for(uint32_t i = 0; i < 256; ++i){
+        uint64_t crc = i;
+        for(int j = 0; j < 8; ++j){
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        }
+        tab.t[0][i] = crc;
+    }
+    for(uint32_t i = 0; i < 256; ++i){
+        for(int k = 1; k < 8; ++k){
+            uint64_t prev = tab.t[k - 1][i];
+            tab.t[k][i] = (prev >> 8) ^ tab.t[0][prev & 0xff];
+        }
+    }
+    return tab;
+};
+
+// built before main(), not on first use: a forked child may be the first
+static const Crc64Table k_crc64 = crc64_table();
+
+uint64_t crc64(uint64_t crc, const uint8_t *data, size_t len){
+    const uint64_t (*t)[256] = k_crc64.t;
+    for(; len >= 8; data += 8, len -= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);     // little-endian
+        crc ^= word;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff]
+            ^ t[5][(crc >> 16) & 0xff] ^ t[4][(crc >> 24) & 0xff]
+            ^ t[3][(crc >> 32) & 0xff] ^ t[2][(crc >> 40) & 0xff]
+            ^ t[1][(crc >> 48) & 0xff] ^ t[0][crc >> 56];
+    }
+    for(; len > 0; ++data, --len){
+        crc = t[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+};
+
+static bool write_all(int fd, const uint8_t *data, size_t len){
+    while(len > 0){
+        ssize_t rv = write(fd, data, len);
+        if(rv < 0 && errno == EINTR){
+            continue;
+        }
+        if(rv <= 0){
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+};
+
+static void rdb_flush(RdbWriter *w){
+    if(w->ok && !w->buf.empty()){
+        w->crc = crc64(w->crc, w->buf.data(), w->buf.size());
+        w->bytes += w->buf.size();
+        w->ok = write_all(w->fd, w->buf.data(), w->buf.size());
+    }
+    w->buf.clear();
+};
+
+static void put(RdbWriter *w, const void *data, size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    w->buf.insert(w->buf.end(), p, p + len);
+    if(w->buf.size() >= k_rdb_buf_size){
+        rdb_flush(w);
+    }
+};
+
+static void put_u8(RdbWriter *w, uint8_t val){
+    put(w, &val, 1);
+};
+
+static void put_varint(RdbWriter *w, uint64_t val){
+    uint8_t tmp[10];
+    size_t n = 0;
+    for(; val >= 0x80; val >>= 7){
+        tmp[n++] = (uint8_t)(val | 0x80);
+    }
+    tmp[n++] = (uint8_t)val;
+    put(w, tmp, n);
+};
+
+static void put_str(RdbWriter *w, std::string_view s){
+    put_varint(w, s.size());
+    put(w, s.data(), s.size());
+};
+
+bool rdb_create(RdbWriter *w, const char *path, uint32_t part, uint32_t parts, uint64_t saved_ms){
+    w->tmp = std::string(path) + ".tmp-" + std::to_string(getpid());
+    w->fd = open(w->tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(w->fd < 0){
+        return false;
+    }
+    w->buf.reserve(k_rdb_buf_size + 4096);
+    put(w, k_rdb_magic, sizeof(k_rdb_magic));
+    put_u8(w, k_rdb_version);
+    put(w, &part, 4);
+    put(w, &parts, 4);
+    put(w, &saved_ms, 8);
+    return true;
+};
+
+static void put_ttl(RdbWriter *w, int64_t ttl_ms){
+    if(ttl_ms >= 0){
+        put_u8(w, RDB_EXPIRE);
+        put(w, &ttl_ms, 8);
+    }
+};
+
+void rdb_write_str(RdbWriter *w, std::string_view key, std::string_view val, int64_t ttl_ms){
+    put_ttl(w, ttl_ms);
+    put_u8(w, RDB_STR);
+    put_str(w, key);
+    put_str(w, val);
+};
+
+void rdb_write_zset(RdbWriter *w, std::string_view key, size_t n, int64_t ttl_ms){
+    put_ttl(w, ttl_ms);
+    put_u8(w, RDB_ZSET);
+    put_str(w, key);
+    put_varint(w, n);
+};
+
+void rdb_write_member(RdbWriter *w, double score, std::string_view name){
+    put(w, &score, 8);
+    put_str(w, name);
+};
+
+// the directory of `path`, and the name in it
+static std::string dir_of(const std::string &path, std::string *name = NULL){
+    size_t slash = path.rfind('/');
+    if(name){
+        *name = slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+};
+
+// the rename is only durable once the directory is synced
+static bool sync_dir(const char *path){
+    std::string dir = dir_of(path);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0){
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    (void)close(fd);
+    return ok;
+};
+
+bool rdb_finish(RdbWriter *w, const char *path){
+    put_u8(w, RDB_EOF);
+    rdb_flush(w);
+    uint64_t crc = w->crc;
+    bool ok = w->ok && write_all(w->fd, (const uint8_t *)&crc, 8);
+    ok = ok && fsync(w->fd) == 0;
+    ok = close(w->fd) == 0 && ok;
+    w->fd = -1;
+    ok = ok && rename(w->tmp.c_str(), path) == 0;
+    if(!ok){
+        (void)unlink(w->tmp.c_str());
+        return false;
+    }
+    return sync_dir(path);
+};
+
+std::string rdb_part_path(const std::string &dbfilename, uint64_t saved_ms, uint32_t part, uint32_t parts){
+    if(parts == 1){
+        return dbfilename;
+    }
+    return dbfilename + "." + std::to_string(saved_ms) + "." + std::to_string(part)
+        + "of" + std::to_string(parts);
+};
+
+bool rdb_complete(const std::string &dbfilename, uint64_t saved_ms, uint32_t parts){
+    for(uint32_t part = 0; part < parts; ++part){
+        if(access(rdb_part_path(dbfilename, saved_ms, part, parts).c_str(), F_OK) != 0){
+            return false;
+        }
+    }
+    return true;
+};
+
+// a name of rdb_part_path() with several parts, in the directory of `base`
+static bool parse_part(const char *name, const std::string &base,
+    uint64_t *saved_ms, uint32_t *part, uint32_t *parts)
+{
+    if(strncmp(name, base.c_str(), base.size()) != 0 || name[base.size()] != '.'){
+        return false;
+    }
+    unsigned long long ms = 0;
+    unsigned p = 0, n = 0;
+    int end = 0;
+    const char *rest = name + base.size() + 1;
+    if(sscanf(rest, "%llu.%uof%u%n", &ms, &p, &n, &end) != 3 || rest[end] != '\0'){
+        return false;   // e.g. a temporary file
+    }
+    if(n < 2 || p >= n){
+        return false;
+    }
+    *saved_ms = ms;
+    *part = p;
+    *parts = n;
+    return true;
+};
+
+// the save time in the header of `path`, without reading the rest
+static bool read_saved_ms(const char *path, uint64_t *saved_ms){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+    uint8_t header[k_rdb_header_size];
+    bool ok = read(fd, header, sizeof(header)) == (ssize_t)sizeof(header)
+        && memcmp(header, k_rdb_magic, 4) == 0;
+    (void)close(fd);
+    if(ok){
+        memcpy(saved_ms, header + 13, 8);
+    }
+    return ok;
+};
+
+void rdb_prune(const std::string &dbfilename, uint64_t saved_ms){
+    std::string base;
+    std::string dir = dir_of(dbfilename, &base);
+    uint64_t single_ms = 0;
+    if(read_saved_ms(dbfilename.c_str(), &single_ms) && single_ms < saved_ms){
+        (void)unlink(dbfilename.c_str());
+    }
+    DIR *d = opendir(dir.c_str());
+    if(!d){
+        return;
+    }
+    while(struct dirent *ent = readdir(d)){
+        uint64_t ms = 0;
+        uint32_t part = 0, parts = 0;
+        if(parse_part(ent->d_name, base, &ms, &part, &parts) && ms < saved_ms){
+            (void)unlink((dir + "/" + ent->d_name).c_str());
+        }
+    }
+    (void)closedir(d);
+};
+
+// `<file>` if it is the newest, whatever its state, so a damaged one is
+// reported; a set of parts only once all of them are there
+bool rdb_latest(const std::string &dbfilename, uint64_t *saved_ms, uint32_t *parts){
+    bool found = false;
+    if(access(dbfilename.c_str(), F_OK) == 0){
+        *saved_ms = 0;
+        (void)read_saved_ms(dbfilename.c_str(), saved_ms);
+        *parts = 1;
+        found = true;
+    }
+    std::string base;
+    std::string dir = dir_of(dbfilename, &base);
+    DIR *d = opendir(dir.c_str());
+    if(!d){
+        return found;
+    }
+    // the parts present of each save
+    std::map<std::pair<uint64_t, uint32_t>, uint32_t> present;
+    while(struct dirent *ent = readdir(d)){
+        uint64_t ms = 0;
+        uint32_t part = 0, n = 0;
+        if(parse_part(ent->d_name, base, &ms, &part, &n)){
+            present[{ms, n}]++;
+        }
+    }
+    (void)closedir(d);
+    for(const auto &it : present){
+        uint64_t ms = it.first.first;
+        uint32_t n = it.first.second;
+        if(it.second == n && (!found || ms > *saved_ms)){
+            *saved_ms = ms;
+            *parts = n;
+            found = true;
+        }
+    }
+    return found;
+};
+
+// NULL, or what went wrong
+static const char *read_file(const char *path, std::string &data){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return strerror(errno);
+    }
+    const char *err = NULL;
+    struct stat st;
+    if(fstat(fd, &st) == 0){
+        data.resize((size_t)st.st_size);
+    } else {
+        err = strerror(errno);
+    }
+    size_t got = 0;
+    while(!err && got < data.size()){
+        ssize_t rv = read(fd, &data[got], data.size() - got);
+        if(rv < 0 && errno == EINTR){
+            continue;
+        }
+        if(rv < 0){
+            err = strerror(errno);
+        } else if(rv == 0){
+            err = "truncated file";     // shrunk since the fstat()
+        } else {
+            got += (size_t)rv;
+        }
+    }
+    (void)close(fd);
+    return err;
+};
+
+bool rdb_open(RdbReader *r, const char *path, std::string &err){
+    if(const char *msg = read_file(path, r->data)){
+        err = msg;
+        return false;
+    }
+    const uint8_t *p = (const uint8_t *)r->data.data();
+    size_t size = r->data.size();
+    if(size < k_rdb_header_size + 1 + 8 || memcmp(p, k_rdb_magic, 4) != 0){
+        err = "not a snapshot file";
+        return false;
+    }
+    if(p[4] != k_rdb_version){
+        err = "unknown snapshot version";
+        return false;
+    }
+    uint64_t crc = 0;
+    memcpy(&crc, p + size - 8, 8);
+    if(crc64(0, p, size - 8) != crc){
+        err = "checksum mismatch";
+        return false;
+    }
+    memcpy(&r->part, p + 5, 4);
+    memcpy(&r->parts, p + 9, 4);
+    memcpy(&r->saved_ms, p + 13, 8);
+    r->pos = k_rdb_header_size;
+    r->end = size - 8;
+    return true;
+};
+
+void rdb_open_records(RdbReader *r, std::string data){
+    r->data = std::move(data);
+    r->pos = 0;
+    r->end = r->data.size();
+};
+
+static bool get(RdbReader *r, void *out, size_t len){
+    if(r->end - r->pos < len){
+        r->err = "truncated record";
+        return false;
+    }
+    memcpy(out, &r->data[r->pos], len);
+    r->pos += len;
+    return true;
+};
+
+static bool get_varint(RdbReader *r, uint64_t *val){
+    *val = 0;
+    for(uint32_t shift = 0; shift < 64 && r->pos < r->end; shift += 7){
+        uint8_t byte = (uint8_t)r->data[r->pos++];
+        *val |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)){
+            return true;
+        }
+    }
+    r->err = "bad length";
+    return false;
+};
+
+static bool get_str(RdbReader *r, std::string_view *s){
+    uint64_t len = 0;
+    if(!get_varint(r, &len)){
+        return false;
+    }
+    if(r->end - r->pos < len){
+        r->err = "truncated string";
+        return false;
+    }
+    *s = std::string_view(&r->data[r->pos], len);
+    r->pos += len;
+    return true;
+};
+
+bool rdb_next(RdbReader *r, RdbRecord *rec){
+    uint8_t type = 0;
+    if(!get(r, &type, 1)){
+        return false;
+    }
+    rec->ttl_ms = -1;
+    if(type == RDB_EXPIRE){
+        if(!get(r, &rec->ttl_ms, 8) || !get(r, &type, 1)){
+            return false;
+        }
+    }
+    rec->type = type;
+    if(type == RDB_EOF){
+        if(r->pos != r->end){
+            r->err = "data after the end";
+        }
+        return false;
+    }
+    if(type != RDB_STR && type != RDB_ZSET){
+        r->err = "unknown record type";
+        return false;
+    }
+    if(!get_str(r, &rec->key)){
+        return false;
+    }
+    if(type == RDB_STR){
+        return get_str(r, &rec->val);
+    }
+    uint64_t n = 0;
+    if(!get_varint(r, &n)){
+        return false;
+    }
+    rec->n = (size_t)n;
+    return true;
+};
+
+bool rdb_next_member(RdbReader *r, double *score, std::string_view *name){
+    return get(r, score, 8) && get_str(r, name);
+};
@@ -0,0 +1,95 @@
+#ifndef RDB_H
+#define RDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The snapshot file of one shard, written by SAVE and BGSAVE and loaded at
+// startup. Every integer is little-endian, lengths and counts are varints.
+//
+//   header:  "ZRDB" version:u8 part:u32 parts:u32 saved_at:u64 (unix ms,
+//            the same in every part of one snapshot)
+//   record:  [RDB_EXPIRE ttl:u64 (ms left at saved_at)]
+//            RDB_STR key val | RDB_ZSET key n (score:f64 name) * n
+//   end:     RDB_EOF crc:u64 (CRC-64 of everything before it)
+//
+// The members of a sorted set are written in (score, name) order, so the
+// loader hands them to zset_insert_bulk() which builds the tree in O(n).
+
+enum {
+    RDB_STR = 1,
+    RDB_ZSET = 2,
+    RDB_EXPIRE = 0xfc,
+    RDB_EOF = 0xff,
+};
+
+const uint8_t k_rdb_version = 1;
+
+// the CRC-64 of Redis (Jones polynomial, reflected), continued from `crc`
+uint64_t crc64(uint64_t crc, const uint8_t *data, size_t len);
+
+struct RdbWriter {
+    int fd = -1;
+    std::string tmp;            // renamed over the target at the end
+    std::vector<uint8_t> buf;
+    uint64_t crc = 0;
+    uint64_t bytes = 0;
+    bool ok = true;             // false after any write error
+};
+
+// starts a temporary file next to `path`
+bool rdb_create(RdbWriter *w, const char *path, uint32_t part, uint32_t parts, uint64_t saved_ms);
+// ttl_ms < 0 for none
+void rdb_write_str(RdbWriter *w, std::string_view key, std::string_view val, int64_t ttl_ms);
+// followed by the n members, in order
+void rdb_write_zset(RdbWriter *w, std::string_view key, size_t n, int64_t ttl_ms);
+void rdb_write_member(RdbWriter *w, double score, std::string_view name);
+// flushed, synced and renamed over `path`, then the directory is synced;
+// false on any error, and the temporary file is removed
+bool rdb_finish(RdbWriter *w, const char *path);
+
+struct RdbReader {
+    std::string data;           // the whole file, or the records
+    size_t pos = 0;
+    size_t end = 0;             // where the checksummed records stop
+    uint32_t part = 0;
+    uint32_t parts = 0;
+    uint64_t saved_ms = 0;
+    const char *err = NULL;     // set when a record is malformed
+};
+
+struct RdbRecord {
+    uint8_t type = 0;
+    int64_t ttl_ms = -1;
+    std::string_view key;
+    std::string_view val;       // RDB_STR
+    size_t n = 0;               // RDB_ZSET, the members to read next
+};
+
+// A snapshot of one shard is `<file>` itself. With several shards every
+// part is `<file>.<saved_ms>.<part>of<parts>`, so a save that fails or is
+// refused on one shard leaves the last one with all of its parts; the
+// shard whose part completes a save removes the older ones.
+std::string rdb_part_path(const std::string &dbfilename, uint64_t saved_ms, uint32_t part, uint32_t parts);
+// whether every part of the save at `saved_ms` is in place
+bool rdb_complete(const std::string &dbfilename, uint64_t saved_ms, uint32_t parts);
+// removes the snapshots saved before `saved_ms`, which is complete
+void rdb_prune(const std::string &dbfilename, uint64_t saved_ms);
+// the newest snapshot with all of its parts; false if there is none
+bool rdb_latest(const std::string &dbfilename, uint64_t *saved_ms, uint32_t *parts);
+
+// reads the file and checks its header and checksum; false with `err`
+bool rdb_open(RdbReader *r, const char *path, std::string &err);
+// records copied out of files, without a header or a checksum, up to a
+// RDB_EOF
+void rdb_open_records(RdbReader *r, std::string data);
+// the next key; false at the end, or with r->err on a bad record
+bool rdb_next(RdbReader *r, RdbRecord *rec);
+// one of the `n` members after a RDB_ZSET record, viewing r->data
+bool rdb_next_member(RdbReader *r, double *score, std::string_view *name);
+
+#endif
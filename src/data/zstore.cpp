@@ -0,0 +1,184 @@
+#include "zstore.h"
+#include "hash.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+
+void zstore_snapshot(ZSnap *snap, ZSet *zset){
+    size_t n = zset_size(zset);
+    snap->items.reserve(n);
+    ZIter it = zset_at(zset, 0);
+    for(size_t i = 0; i < n; ++i, zset_iter_offset(&it, +1)){
+        ZMember m = zset_iter_get(&it);
+        ZSnapItem item;
+        item.score = m.score;
+        item.off = snap->names.size();
+        item.len = m.len;
+        snap->names.append(m.name, m.len);
+        snap->items.push_back(item);
+    }
+};
+
+size_t zstore_size(const ZStore *job){
+    size_t n = 0;
+    for(const ZSnap &snap : job->inputs){
+        n += snap.items.size();
+    }
+    return n;
+};
+
+// the partitions take the high bits, the hash maps the low ones
+static uint32_t part_of(uint64_t hcode, uint32_t nparts){
+    return (uint32_t)((hcode >> 32) % nparts);
+};
+
+// like Redis: inf - inf and 0 * inf count as 0
+static double no_nan(double score){
+    return isnan(score) ? 0 : score;
+};
+
+static double aggregate(uint32_t agg, double acc, double score){
+    switch(agg){
+    case ZSTORE_MIN:
+        return std::min(acc, score);
+    case ZSTORE_MAX:
+        return std::max(acc, score);
+    default:
+        return no_nan(acc + score);
+    }
+};
+
+static bool member_less(const ZMember &lhs, const ZMember &rhs){
+    if(lhs.score != rhs.score){
+        return lhs.score < rhs.score;
+    }
+    int rv = memcmp(lhs.name, rhs.name, std::min(lhs.len, rhs.len));
+    return rv != 0 ? rv < 0 : lhs.len < rhs.len;
+};
+
+// the hashes of this task's slice of every input
+static void hash_slice(ZStore *job, uint32_t part, uint32_t nparts){
+    for(ZSnap &snap : job->inputs){
+        size_t n = snap.items.size();
+        for(size_t i = n * part / nparts; i < n * (part + 1) / nparts; ++i){
+            ZSnapItem &item = snap.items[i];
+            item.hcode = str_hash((const uint8_t *)&snap.names[item.off], item.len);
+        }
+    }
+};
+
+struct ZName {
+    std::string_view name;
+    uint64_t hcode = 0;
+    bool operator==(const ZName &rhs) const { return name == rhs.name; }
+};
+
+struct ZNameHash {
+    size_t operator()(const ZName &key) const { return (size_t)key.hcode; }
+};
+
+struct ZAcc {
+    double score = 0;
+    uint32_t hits = 0;      // inputs holding the member
+};
+
+// merges the members of one partition from every input, sorted
+static void merge_part(ZStore *job, uint32_t part, uint32_t nparts){
+    std::unordered_map<ZName, ZAcc, ZNameHash> acc;
+    for(ZSnap &snap : job->inputs){
+        for(const ZSnapItem &item : snap.items){
+            if(part_of(item.hcode, nparts) != part){
+                continue;
+            }
+            ZName key{std::string_view(&snap.names[item.off], item.len), item.hcode};
+            double score = no_nan(item.score * snap.weight);
+            auto it = acc.find(key);
+            if(it == acc.end()){
+                acc.emplace(key, ZAcc{score, 1});
+            } else {
+                it->second.score = aggregate(job->aggregate, it->second.score, score);
+                it->second.hits++;
+            }
+        }
+    }
+    std::vector<ZMember> &out = job->parts[part];
+    for(auto &kv : acc){
+        if(job->op == ZSTORE_INTER && kv.second.hits < job->inputs.size()){
+            continue;
+        }
+        out.push_back(ZMember{kv.second.score, kv.first.name.data(), kv.first.name.size()});
+    }
+    std::sort(out.begin(), out.end(), &member_less);
+};
+
+// the sorted partitions, merged pairwise into one run
+static void merge_runs(ZStore *job){
+    std::vector<size_t> ends;
+    for(std::vector<ZMember> &part : job->parts){
+        job->out.insert(job->out.end(), part.begin(), part.end());
+        ends.push_back(job->out.size());
+        std::vector<ZMember>().swap(part);
+    }
+    for(size_t step = 1; step < ends.size(); step *= 2){
+        for(size_t i = 0; i + step < ends.size(); i += 2 * step){
+            size_t lo = i ? ends[i - 1] : 0;
+            size_t mid = ends[i + step - 1];
+            size_t hi = ends[std::min(i + 2 * step, ends.size()) - 1];
+            std::inplace_merge(
+                job->out.begin() + lo, job->out.begin() + mid, job->out.begin() + hi, &member_less);
+        }
+    }
+};
+
+void zstore_run(ZStore *job){
+    job->parts.assign(1, {});
+    hash_slice(job, 0, 1);
+    merge_part(job, 0, 1);
+    merge_runs(job);
+};
+
+// the last task of a phase starts the next one
+static bool task_last(ZStore *job){
+    return job->left.fetch_sub(1) == 1;
+};
+
+static void task_merge(void *arg){
+    ZStoreTask *task = (ZStoreTask *)arg;
+    ZStore *job = task->job;
+    merge_part(job, task->part, (uint32_t)job->tasks.size());
+    if(task_last(job)){
+        merge_runs(job);
+        job->finished(job);
+    }
+};
+
+static void task_hash(void *arg){
+    ZStoreTask *task = (ZStoreTask *)arg;
+    ZStore *job = task->job;
+    hash_slice(job, task->part, (uint32_t)job->tasks.size());
+    if(task_last(job)){
+        job->left = (uint32_t)job->tasks.size();
+        for(ZStoreTask &t : job->tasks){
+            thread_pool_queue(job->pool, &task_merge, &t);
+        }
+    }
+};
+
+void zstore_start(ZStore *job, ThreadPool *pool, void (*finished)(ZStore *job)){
+    uint32_t nparts = (uint32_t)std::max<size_t>(1, pool->workers.size());
+    job->pool = pool;
+    job->finished = finished;
+    job->parts.assign(nparts, {});
+    job->tasks.resize(nparts);
+    job->left = nparts;
+    for(uint32_t i = 0; i < nparts; ++i){
+        job->tasks[i] = ZStoreTask{job, i};
+    }
+    for(ZStoreTask &t : job->tasks){
+        thread_pool_queue(pool, &task_hash, &t);
+    }
+};
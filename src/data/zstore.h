@@ -0,0 +1,73 @@
+#ifndef ZSTORE_H
+#define ZSTORE_H
+
+#include "thread_pool.h"
+#include "zset.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// The merge behind ZUNIONSTORE and ZINTERSTORE. The inputs are copied into
+// snapshots on the event loop, so the merge can run on the thread pool
+// while the sources keep changing. It is partitioned by the member hash:
+// each partition merges its share of every input and sorts it, then the
+// sorted partitions are merged into one run for zset_insert_bulk().
+
+enum {
+    ZSTORE_UNION = 0,
+    ZSTORE_INTER = 1,
+};
+
+// how the weighted scores of a member are combined
+enum {
+    ZSTORE_SUM = 0,
+    ZSTORE_MIN = 1,
+    ZSTORE_MAX = 2,
+};
+
+struct ZSnapItem {
+    double score = 0;
+    uint64_t hcode = 0;     // filled by the merge
+    size_t off = 0;         // of the name in ZSnap::names
+    size_t len = 0;
+};
+
+// one input, a missing key is an empty one
+struct ZSnap {
+    double weight = 1;
+    std::string names;      // back to back
+    std::vector<ZSnapItem> items;
+};
+
+struct ZStore;
+
+struct ZStoreTask {
+    ZStore *job = NULL;
+    uint32_t part = 0;
+};
+
+struct ZStore {
+    uint32_t op = ZSTORE_UNION;
+    uint32_t aggregate = ZSTORE_SUM;
+    std::vector<ZSnap> inputs;
+    // the result in (score, name) order, the names point into the inputs
+    std::vector<ZMember> out;
+
+    // on the thread pool: one task per partition and phase
+    ThreadPool *pool = NULL;
+    std::vector<ZStoreTask> tasks;
+    std::vector<std::vector<ZMember>> parts;
+    std::atomic<uint32_t> left{0};      // tasks of the current phase
+    void (*finished)(ZStore *job) = NULL;
+};
+
+void zstore_snapshot(ZSnap *snap, ZSet *zset);
+// members over all the inputs
+size_t zstore_size(const ZStore *job);
+// merges on the calling thread
+void zstore_run(ZStore *job);
+// merges on the pool and calls `finished` at the end, on a pool thread
+void zstore_start(ZStore *job, ThreadPool *pool, void (*finished)(ZStore *job));
+
+#endif
@@ -9,6 +9,7 @@ static uint32_t max(uint32_t lhs, uint32_t rhs){
 void avl_update(AVLNode *node){
     node->height = 1 + max(avl_height(node->left), avl_height(node->right));
     node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+    node->sum = node->val + avl_sum(node->left) + avl_sum(node->right);
 };
 
 static AVLNode *rot_left(AVLNode *node) {
@@ -127,7 +128,9 @@ AVLNode *avl_del(AVLNode *node) {
     // detach the successor
     AVLNode *root = avl_del_easy(victim);
     // swap with the successor
+    double val = victim->val;
     *victim = *node;    // left, right, parent
+    victim->val = val;
     if (victim->left) {
         victim->left->parent = victim;
     }
@@ -141,6 +144,10 @@ AVLNode *avl_del(AVLNode *node) {
         from = parent->left == node ? &parent->left : &parent->right;
     }
     *from = victim;
+    // the sums up to the root still hold the deleted value
+    for (AVLNode *cur = victim; cur; cur = cur->parent) {
+        avl_update(cur);
+    }
     return root;
 }
 
@@ -205,4 +212,58 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset){
     }
 
     return node;
-};
\ No newline at end of file
+};
+// the number of nodes before this one, counted on the way to the root
+int64_t avl_rank(AVLNode *node){
+    int64_t rank = avl_cnt(node->left);
+    for(AVLNode *parent = node->parent; parent; node = parent, parent = parent->parent){
+        if(parent->right == node){
+            rank += avl_cnt(parent->left) + 1;
+        }
+    }
+    return rank;
+};
+
+// whole subtrees are taken from their sums, so only the two boundary
+// paths are walked
+double avl_range_sum(AVLNode *node, int64_t lo, int64_t hi){
+    if(!node || lo >= hi){
+        return 0;
+    }
+    if(lo <= 0 && hi >= (int64_t)node->cnt){
+        return node->sum;
+    }
+    int64_t left = avl_cnt(node->left);
+    double sum = 0;
+    if(lo < left){
+        sum += avl_range_sum(node->left, lo, hi < left ? hi : left);
+    }
+    if(lo <= left && left < hi){
+        sum += node->val;
+    }
+    if(hi > left + 1){
+        sum += avl_range_sum(node->right, lo - left - 1, hi - left - 1);
+    }
+    return sum;
+};
+
+// the middle node is the root of each subtree, so the heights of any two
+// siblings differ by at most 1 and nothing needs rotating
+AVLNode *avl_build(AVLNode **nodes, size_t n){
+    if(n == 0){
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *node = nodes[mid];
+    node->parent = NULL;
+    node->left = avl_build(nodes, mid);
+    node->right = avl_build(nodes + mid + 1, n - mid - 1);
+    if(node->left){
+        node->left->parent = node;
+    }
+    if(node->right){
+        node->right->parent = node;
+    }
+    avl_update(node);
+    return node;
+};
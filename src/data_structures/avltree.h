@@ -13,22 +13,30 @@ struct AVLNode {
     AVLNode *right = NULL;
     uint32_t height = 0;    // subtree height
     uint32_t cnt = 0;       // subtree size
+    double val = 0;         // a value to aggregate, set before inserting
+    double sum = 0;         // subtree sum of val
 };
 
 inline void avl_init(AVLNode *node) {
     node->left = node->right = node->parent = NULL;
     node->height = 1;
     node->cnt = 1;
+    node->sum = node->val;
 }
 
 // helpers
 inline uint32_t avl_height(AVLNode *node) { return node ? node->height : 0; }
 inline uint32_t avl_cnt(AVLNode *node) { return node ? node->cnt : 0; }
+inline double avl_sum(AVLNode *node) { return node ? node->sum : 0; }
 AVLNode *avl_offset(AVLNode *node, int64_t offset);
 int64_t avl_rank(AVLNode *node);
+// the sum of val over the ranks [lo, hi) of a subtree
+double avl_range_sum(AVLNode *node, int64_t lo, int64_t hi);
 
 // API
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
+// a balanced tree of nodes already in order, with val set; returns the root
+AVLNode *avl_build(AVLNode **nodes, size_t n);
 
 #endif
\ No newline at end of file
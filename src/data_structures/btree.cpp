@@ -0,0 +1,433 @@
+#include "btree.h"
+#include "slab.h"
+
+#include <assert.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+static BInner *inner_of(BNode *node){
+    return (BInner *)node;
+};
+
+static BNode *node_new(BTree *tree, bool leaf){
+    size_t size = leaf ? sizeof(BNode) : sizeof(BInner);
+    tree->bytes += slab_good_size(size);
+    if(leaf){
+        return new (slab_alloc(size)) BNode();
+    }
+    BInner *inner = new (slab_alloc(size)) BInner();
+    inner->node.leaf = 0;
+    return &inner->node;
+};
+
+static void node_free(BTree *tree, BNode *node){
+    size_t size = node->leaf ? sizeof(BNode) : sizeof(BInner);
+    tree->bytes -= slab_good_size(size);
+    slab_free(node, size);
+};
+
+static uint64_t node_cnt(BNode *node){
+    if(node->leaf){
+        return node->n;
+    }
+    uint64_t cnt = 0;
+    for(uint32_t i = 0; i < node->n; ++i){
+        cnt += inner_of(node)->cnt[i];
+    }
+    return cnt;
+};
+
+// recomputed rather than adjusted, so no rounding error builds up
+static double node_sum(BNode *node){
+    double sum = 0;
+    for(uint32_t i = 0; i < node->n; ++i){
+        sum += node->leaf ? node->keys[i].score : inner_of(node)->sum[i];
+    }
+    return sum;
+};
+
+// moves `n` entries from src[from] to dst[to], the arrays may overlap
+static void node_copy(BNode *dst, uint32_t to, BNode *src, uint32_t from, uint32_t n){
+    memmove(&dst->keys[to], &src->keys[from], n * sizeof(BKey));
+    if(!dst->leaf){
+        memmove(&inner_of(dst)->kids[to], &inner_of(src)->kids[from], n * sizeof(BNode *));
+        memmove(&inner_of(dst)->cnt[to], &inner_of(src)->cnt[from], n * sizeof(uint64_t));
+        memmove(&inner_of(dst)->sum[to], &inner_of(src)->sum[from], n * sizeof(double));
+    }
+};
+
+static int bkey_cmp(const BKey &item, double score, const void *key, BCmp cmp){
+    if(item.score != score){
+        return item.score < score ? -1 : 1;
+    }
+    return cmp(item.ptr, key);
+};
+
+// the first key not less than the target (upper: greater than)
+static uint32_t node_search(
+    BNode *node, double score, const void *key, BCmp cmp, bool upper)
+{
+    uint32_t lo = 0, hi = node->n;
+    while(lo < hi){
+        uint32_t mid = (lo + hi) / 2;
+        int rv = bkey_cmp(node->keys[mid], score, key, cmp);
+        if(rv < 0 || (upper && rv == 0)){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+};
+
+// the child that holds the target, or would
+static uint32_t child_of(BNode *node, double score, const void *key, BCmp cmp){
+    uint32_t i = node_search(node, score, key, cmp, true);
+    return i ? i - 1 : 0;
+};
+
+// splits a full node in half, returns the new right half
+static BNode *node_split(BTree *tree, BNode *node){
+    BNode *right = node_new(tree, node->leaf);
+    uint32_t m = node->n / 2;
+    node_copy(right, 0, node, m, node->n - m);
+    right->n = node->n - m;
+    node->n = m;
+    if(node->leaf){
+        right->prev = node;
+        right->next = node->next;
+        if(node->next){
+            node->next->prev = right;
+        }
+        node->next = right;
+    }
+    return right;
+};
+
+static BNode *node_insert(
+    BTree *tree, BNode *node, const BKey &item, const void *key, BCmp cmp)
+{
+    if(node->leaf){
+        uint32_t i = node_search(node, item.score, key, cmp, false);
+        node_copy(node, i + 1, node, i, node->n - i);
+        node->keys[i] = item;
+        node->n++;
+    } else {
+        BInner *inner = inner_of(node);
+        uint32_t i = child_of(node, item.score, key, cmp);
+        BNode *kid = inner->kids[i];
+        BNode *sib = node_insert(tree, kid, item, key, cmp);
+        inner->cnt[i]++;
+        node->keys[i] = kid->keys[0];   // the smallest may have changed
+        if(sib){
+            node_copy(node, i + 2, node, i + 1, node->n - i - 1);
+            node->keys[i + 1] = sib->keys[0];
+            inner->kids[i + 1] = sib;
+            inner->cnt[i + 1] = node_cnt(sib);
+            inner->cnt[i] -= inner->cnt[i + 1];
+            inner->sum[i + 1] = node_sum(sib);
+            node->n++;
+        }
+        inner->sum[i] = node_sum(kid);
+    }
+    return node->n > k_bt_max ? node_split(tree, node) : NULL;
+};
+
+void bt_insert(BTree *tree, double score, void *ptr, const void *key, BCmp cmp){
+    if(!tree->root){
+        tree->root = node_new(tree, true);
+    }
+    BNode *sib = node_insert(tree, tree->root, BKey{score, ptr}, key, cmp);
+    if(sib){
+        // a new root above both halves
+        BNode *root = node_new(tree, false);
+        BInner *inner = inner_of(root);
+        BNode *kids[2] = {tree->root, sib};
+        for(uint32_t i = 0; i < 2; ++i){
+            root->keys[i] = kids[i]->keys[0];
+            inner->kids[i] = kids[i];
+            inner->cnt[i] = node_cnt(kids[i]);
+            inner->sum[i] = node_sum(kids[i]);
+        }
+        root->n = 2;
+        tree->root = root;
+    }
+    tree->size++;
+};
+
+// refills the child `i` of an inner node from a sibling, or merges them
+static void node_rebalance(BTree *tree, BNode *node, uint32_t i){
+    BInner *inner = inner_of(node);
+    uint32_t l = i > 0 ? i - 1 : i;
+    uint32_t r = l + 1;
+    assert(r < node->n);
+    BNode *left = inner->kids[l];
+    BNode *right = inner->kids[r];
+
+    if(left->n + right->n <= k_bt_max){
+        node_copy(left, left->n, right, 0, right->n);
+        left->n += right->n;
+        if(left->leaf){
+            left->next = right->next;
+            if(right->next){
+                right->next->prev = left;
+            }
+        }
+        inner->cnt[l] += inner->cnt[r];
+        inner->sum[l] = node_sum(left);
+        node_copy(node, r, node, r + 1, node->n - r - 1);
+        node->n--;
+        node_free(tree, right);
+    } else {
+        // split the items evenly
+        uint32_t half = (left->n + right->n) / 2;
+        if(left->n < half){
+            uint32_t c = half - left->n;
+            node_copy(left, left->n, right, 0, c);
+            node_copy(right, 0, right, c, right->n - c);
+            left->n += c;
+            right->n -= c;
+        } else {
+            uint32_t c = left->n - half;
+            node_copy(right, c, right, 0, right->n);
+            node_copy(right, 0, left, half, c);
+            left->n -= c;
+            right->n += c;
+        }
+        uint64_t total = inner->cnt[l] + inner->cnt[r];
+        inner->cnt[l] = node_cnt(left);
+        inner->cnt[r] = total - inner->cnt[l];
+        inner->sum[l] = node_sum(left);
+        inner->sum[r] = node_sum(right);
+        node->keys[r] = right->keys[0];
+    }
+    node->keys[l] = left->keys[0];
+};
+
+static bool node_delete(
+    BTree *tree, BNode *node, double score, const void *key, BCmp cmp, void **out)
+{
+    if(node->leaf){
+        uint32_t i = node_search(node, score, key, cmp, false);
+        if(i == node->n || bkey_cmp(node->keys[i], score, key, cmp) != 0){
+            return false;
+        }
+        *out = node->keys[i].ptr;
+        node_copy(node, i, node, i + 1, node->n - i - 1);
+        node->n--;
+        return true;
+    }
+    BInner *inner = inner_of(node);
+    uint32_t i = child_of(node, score, key, cmp);
+    BNode *kid = inner->kids[i];
+    if(!node_delete(tree, kid, score, key, cmp, out)){
+        return false;
+    }
+    inner->cnt[i]--;
+    inner->sum[i] = node_sum(kid);
+    if(kid->n < k_bt_min){
+        node_rebalance(tree, node, i);
+    } else {
+        node->keys[i] = kid->keys[0];
+    }
+    return true;
+};
+
+void *bt_delete(BTree *tree, double score, const void *key, BCmp cmp){
+    void *ptr = NULL;
+    if(!tree->root || !node_delete(tree, tree->root, score, key, cmp, &ptr)){
+        return NULL;
+    }
+    tree->size--;
+    BNode *root = tree->root;
+    if(!root->leaf && root->n == 1){
+        tree->root = inner_of(root)->kids[0];
+        node_free(tree, root);
+    } else if(root->leaf && root->n == 0){
+        tree->root = NULL;
+        node_free(tree, root);
+    }
+    return ptr;
+};
+
+// the entries of a level spread evenly over as few nodes as hold them,
+// so every node but a lone root is at least half full
+static size_t level_nodes(size_t n){
+    return (n + k_bt_max - 1) / k_bt_max;
+};
+
+void bt_build(BTree *tree, const BKey *items, size_t n){
+    assert(!tree->root);
+    if(n == 0){
+        return;
+    }
+    // the leaves, linked in order
+    std::vector<BNode *> level(level_nodes(n));
+    BNode *prev = NULL;
+    for(size_t i = 0, at = 0; i < level.size(); ++i){
+        BNode *leaf = node_new(tree, true);
+        leaf->n = (uint32_t)(n / level.size() + (i < n % level.size()));
+        memcpy(leaf->keys, items + at, leaf->n * sizeof(BKey));
+        at += leaf->n;
+        leaf->prev = prev;
+        if(prev){
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level[i] = leaf;
+    }
+    // each inner level replaces the one below it, front to back
+    while(level.size() > 1){
+        size_t kids = level.size(), m = level_nodes(kids);
+        for(size_t i = 0, at = 0; i < m; ++i){
+            BNode *node = node_new(tree, false);
+            node->n = (uint32_t)(kids / m + (i < kids % m));
+            for(uint32_t j = 0; j < node->n; ++j){
+                BNode *kid = level[at + j];
+                node->keys[j] = kid->keys[0];
+                inner_of(node)->kids[j] = kid;
+                inner_of(node)->cnt[j] = node_cnt(kid);
+                inner_of(node)->sum[j] = node_sum(kid);
+            }
+            at += node->n;
+            level[i] = node;
+        }
+        level.resize(m);
+    }
+    tree->root = level[0];
+    tree->size = n;
+};
+
+static void node_dispose(BTree *tree, BNode *node, void (*del)(void *ptr)){
+    for(uint32_t i = 0; i < node->n; ++i){
+        if(node->leaf){
+            del(node->keys[i].ptr);
+        } else {
+            node_dispose(tree, inner_of(node)->kids[i], del);
+        }
+    }
+    node_free(tree, node);
+};
+
+void bt_clear(BTree *tree, void (*del)(void *ptr)){
+    if(tree->root){
+        node_dispose(tree, tree->root, del);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+};
+
+// a position in a leaf, moved to the next leaf when past its end
+static BPos pos_make(BNode *leaf, uint32_t idx, uint64_t rank){
+    BPos pos;
+    if(idx == leaf->n){
+        leaf = leaf->next;
+        idx = 0;
+    }
+    if(leaf){
+        pos.leaf = leaf;
+        pos.idx = idx;
+        pos.rank = rank;
+    }
+    return pos;
+};
+
+BPos bt_seekge(BTree *tree, double score, const void *key, BCmp cmp){
+    BNode *node = tree->root;
+    if(!node){
+        return BPos();
+    }
+    uint64_t rank = 0;
+    while(!node->leaf){
+        BInner *inner = inner_of(node);
+        uint32_t i = child_of(node, score, key, cmp);
+        for(uint32_t j = 0; j < i; ++j){
+            rank += inner->cnt[j];
+        }
+        node = inner->kids[i];
+    }
+    uint32_t i = node_search(node, score, key, cmp, false);
+    return pos_make(node, i, rank + i);
+};
+
+BPos bt_at(BTree *tree, uint64_t rank){
+    if(rank >= tree->size){
+        return BPos();
+    }
+    BNode *node = tree->root;
+    uint64_t left = rank;
+    while(!node->leaf){
+        BInner *inner = inner_of(node);
+        uint32_t i = 0;
+        while(left >= inner->cnt[i]){
+            left -= inner->cnt[i];
+            i++;
+        }
+        node = inner->kids[i];
+    }
+    return pos_make(node, (uint32_t)left, rank);
+};
+
+void bt_offset(BTree *tree, BPos *pos, int64_t offset){
+    if(!pos->leaf){
+        return;
+    }
+    int64_t rank = (int64_t)pos->rank + offset;
+    if(rank < 0 || rank >= (int64_t)tree->size){
+        *pos = BPos();
+        return;
+    }
+    // within the leaf or a neighbor, otherwise from the root
+    BNode *leaf = pos->leaf;
+    int64_t idx = (int64_t)pos->idx + offset;
+    if(idx >= 0 && idx < leaf->n){
+        pos->idx = (uint32_t)idx;
+    } else if(idx >= leaf->n && leaf->next && idx - leaf->n < leaf->next->n){
+        pos->idx = (uint32_t)(idx - leaf->n);
+        pos->leaf = leaf->next;
+    } else if(idx < 0 && leaf->prev && idx + leaf->prev->n >= 0){
+        pos->idx = (uint32_t)(idx + leaf->prev->n);
+        pos->leaf = leaf->prev;
+    } else {
+        *pos = bt_at(tree, (uint64_t)rank);
+    }
+    pos->rank = (uint64_t)rank;
+};
+
+// the ranks [lo, hi) relative to the node, whole children from their sums
+static double node_range_sum(BNode *node, uint64_t lo, uint64_t hi){
+    double sum = 0;
+    if(node->leaf){
+        for(uint64_t i = lo; i < hi; ++i){
+            sum += node->keys[i].score;
+        }
+        return sum;
+    }
+    BInner *inner = inner_of(node);
+    uint64_t base = 0;
+    for(uint32_t i = 0; i < node->n && base < hi; base += inner->cnt[i++]){
+        uint64_t end = base + inner->cnt[i];
+        if(end <= lo){
+            continue;
+        }
+        if(lo <= base && end <= hi){
+            sum += inner->sum[i];
+        } else {
+            uint64_t from = lo > base ? lo - base : 0;
+            uint64_t to = (hi < end ? hi : end) - base;
+            sum += node_range_sum(inner->kids[i], from, to);
+        }
+    }
+    return sum;
+};
+
+double bt_range_sum(BTree *tree, uint64_t lo, uint64_t hi){
+    if(hi > tree->size){
+        hi = tree->size;
+    }
+    if(!tree->root || lo >= hi){
+        return 0;
+    }
+    return node_range_sum(tree->root, lo, hi);
+};
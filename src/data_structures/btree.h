@@ -0,0 +1,70 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An order statistic B+tree. The items are (score, pointer) pairs kept
+// sorted in leaves of up to k_bt_max, which are linked for range scans.
+// Inner nodes keep the smallest item, the item count and the score sum of
+// every child, so a rank or a range sum is found in one descent. Items
+// with equal scores are ordered by a callback; scores are compared inline,
+// without touching the item.
+const uint32_t k_bt_max = 32;
+const uint32_t k_bt_min = k_bt_max / 4;
+
+struct BKey {
+    double score;
+    void *ptr;
+};
+
+// the order of an item and a key with the same score: <0, 0 or >0
+typedef int (*BCmp)(void *item, const void *key);
+
+struct BNode {
+    uint32_t leaf = 1;
+    uint32_t n = 0;
+    BNode *prev = NULL;     // leaves only
+    BNode *next = NULL;
+    BKey keys[k_bt_max + 1];    // inner: the smallest item of each child
+};
+
+struct BInner {
+    BNode node;
+    BNode *kids[k_bt_max + 1];
+    uint64_t cnt[k_bt_max + 1];     // items under each child
+    double sum[k_bt_max + 1];       // and the sum of their scores
+};
+
+struct BTree {
+    BNode *root = NULL;
+    size_t size = 0;
+    size_t bytes = 0;   // allocated for the nodes
+};
+
+// a position in the tree, leaf is NULL past either end
+struct BPos {
+    BNode *leaf = NULL;
+    uint32_t idx = 0;
+    uint64_t rank = 0;
+};
+
+void bt_insert(BTree *tree, double score, void *ptr, const void *key, BCmp cmp);
+// the pointer of the removed item, NULL if not found
+void *bt_delete(BTree *tree, double score, const void *key, BCmp cmp);
+// fills an empty tree from items already in order, in O(n)
+void bt_build(BTree *tree, const BKey *items, size_t n);
+// frees the nodes, and the items with `del`
+void bt_clear(BTree *tree, void (*del)(void *ptr));
+
+// the first item not less than (score, key)
+BPos bt_seekge(BTree *tree, double score, const void *key, BCmp cmp);
+// the item with this rank
+BPos bt_at(BTree *tree, uint64_t rank);
+void bt_offset(BTree *tree, BPos *pos, int64_t offset);
+// the sum of the scores of the ranks [lo, hi)
+double bt_range_sum(BTree *tree, uint64_t lo, uint64_t hi);
+
+inline BKey *bt_item(const BPos *pos) { return &pos->leaf->keys[pos->idx]; }
+
+#endif
@@ -5,6 +5,123 @@
 #include <assert.h>
 
 
+#ifdef USE_SWISS_HMAP
+
+static void hm_trigger_rehashing(HMap *hmap){
+    STab &cur = hmap->newer;
+    size_t ngroups = cur.mask + 1;
+    // grow, or just drop the tombstones if they are what fills the table
+    if(cur.size >= st_capacity(&cur) / 2){
+        ngroups *= 2;
+    }
+    hmap->older = cur;
+    st_init(&hmap->newer, ngroups);
+    hmap->migrate_pos = 0;
+};
+
+static void hm_help_rehashing(HMap *hmap, size_t max_work){
+    size_t nwork = 0;
+    STab &older = hmap->older;
+    while(nwork < max_work && older.size > 0){
+        size_t pos = hmap->migrate_pos;
+        if(older.ctrl[pos] & 0x80){ // empty or deleted
+            hmap->migrate_pos++;
+            continue;
+        }
+        st_insert(&hmap->newer, st_detach(&older, &older.slots[pos]));
+        hmap->migrate_pos++;
+        nwork++;
+    }
+    // discard the old table if done
+    if(older.ctrl && older.size == 0){
+        st_free(&older);
+    }
+};
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)){
+    hm_help_rehashing(hmap, k_rehashing_work);
+    HNode **from = st_lookup(&hmap->newer, key, eq);
+    if(!from){
+        from = st_lookup(&hmap->older, key, eq);
+    }
+    return from ? *from : NULL;
+};
+
+void hm_insert(HMap *hmap, HNode *node){
+    if(!hmap->newer.ctrl){
+        st_init(&hmap->newer, 1);
+    }
+    if(st_full(&hmap->newer)){
+        // still moving the previous table, rare: finish it first
+        hm_help_rehashing(hmap, (size_t)-1);
+        hm_trigger_rehashing(hmap);
+    }
+    st_insert(&hmap->newer, node);
+    hm_help_rehashing(hmap, k_rehashing_work);
+};
+
+void hm_reserve(HMap *hmap, size_t n){
+    size_t need = hm_size(hmap) + n;
+    if(hmap->newer.ctrl && need + hmap->newer.used - hmap->newer.size < st_capacity(&hmap->newer) / 8 * 7){
+        return;
+    }
+    size_t ngroups = 1;
+    while(ngroups * k_st_group / 8 * 7 <= need){
+        ngroups *= 2;
+    }
+    // one table at a time: finish the previous move, start a new one
+    hm_help_rehashing(hmap, (size_t)-1);
+    if(hmap->newer.size == 0){
+        st_free(&hmap->newer);
+    } else {
+        hmap->older = hmap->newer;
+        hmap->migrate_pos = 0;
+    }
+    st_init(&hmap->newer, ngroups);
+};
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)){
+    hm_help_rehashing(hmap, k_rehashing_work);
+    if(HNode **from = st_lookup(&hmap->newer, key, eq)){
+        return st_detach(&hmap->newer, from);
+    }
+    if(HNode **from = st_lookup(&hmap->older, key, eq)){
+        return st_detach(&hmap->older, from);
+    }
+    return NULL;
+};
+
+void hm_clear(HMap *hmap){
+    st_free(&hmap->older);
+    st_free(&hmap->newer);
+    *hmap = HMap();
+};
+
+size_t hm_size(HMap *hmap){
+    return hmap->newer.size + hmap->older.size;
+};
+
+size_t hm_bytes(HMap *hmap){
+    size_t slots = st_capacity(&hmap->newer) + st_capacity(&hmap->older);
+    return slots * (1 + sizeof(HNode *));
+};
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg){
+    st_foreach(&hmap->newer, f, arg) && st_foreach(&hmap->older, f, arg);
+};
+
+HNode *hm_sample(HMap *hmap, uint64_t rnd){
+    size_t total = hm_size(hmap);
+    if(total == 0){
+        return NULL;
+    }
+    // pick a table by its share of the nodes
+    bool newer = ((rnd * 0x9E3779B97F4A7C15ull) >> 32) % total < hmap->newer.size;
+    return st_sample(newer ? &hmap->newer : &hmap->older, rnd);
+};
+
+#else
+
 static void hm_trigger_rehashing(HMap *hmap){
     hmap->older = hmap->newer;
     h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
@@ -56,6 +173,30 @@ void hm_insert(HMap *hmap, HNode *node){
     hm_help_rehashing(hmap);
 };
 
+void hm_reserve(HMap *hmap, size_t n){
+    size_t need = hm_size(hmap) + n;
+    if(hmap->newer.tab && need < (hmap->newer.mask + 1) * k_max_load_factor){
+        return;
+    }
+    size_t nslots = 4;
+    while(nslots * k_max_load_factor <= need){
+        nslots *= 2;
+    }
+    // one table at a time: finish the previous move, start a new one
+    while(hmap->older.size > 0){
+        hm_help_rehashing(hmap);
+    }
+    free(hmap->older.tab);
+    hmap->older = HTab{};
+    if(hmap->newer.size == 0){
+        free(hmap->newer.tab);
+    } else {
+        hmap->older = hmap->newer;
+        hmap->migrate_pos = 0;
+    }
+    h_init(&hmap->newer, nslots);
+};
+
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)){
     hm_help_rehashing(hmap);
     if(HNode **from = h_lookup(&hmap->newer, key, eq)){
@@ -79,6 +220,29 @@ size_t hm_size(HMap *hmap){
     return hmap->newer.size + hmap->older.size;
 };
 
+size_t hm_bytes(HMap *hmap){
+    size_t slots = 0;
+    if(hmap->newer.tab){
+        slots += hmap->newer.mask + 1;
+    }
+    if(hmap->older.tab){
+        slots += hmap->older.mask + 1;
+    }
+    return slots * sizeof(HNode *);
+};
+
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg){
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
-};
\ No newline at end of file
+};
+
+HNode *hm_sample(HMap *hmap, uint64_t rnd){
+    size_t total = hm_size(hmap);
+    if(total == 0){
+        return NULL;
+    }
+    // pick a table by its share of the nodes
+    bool newer = ((rnd * 0x9E3779B97F4A7C15ull) >> 32) % total < hmap->newer.size;
+    return h_sample(newer ? &hmap->newer : &hmap->older, rnd);
+};
+
+#endif // USE_SWISS_HMAP
@@ -3,20 +3,40 @@
 
 #include "hashtable.h"
 
+// Built with USE_SWISS_HMAP (`make HMAP=swiss`) the map uses open
+// addressing tables, otherwise chaining. Both resize incrementally: the
+// nodes are moved from `older` to `newer` a few at a time.
+#ifdef USE_SWISS_HMAP
+#include "swisstable.h"
+
+struct HMap
+{
+    STab newer;
+    STab older;
+    size_t migrate_pos = 0;
+};
+#else
 struct HMap
 {
     HTab newer;
     HTab older;
     size_t migrate_pos = 0;
 };
+#endif
 
 const size_t k_max_load_factor = 8;
 const size_t k_rehashing_work = 128;
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
+// room for n more nodes without growing, for bulk inserts
+void hm_reserve(HMap *hmap, size_t n);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_clear(HMap *hmap);
 size_t hm_size(HMap *hmap);
+// the slot arrays of both tables, for memory accounting
+size_t hm_bytes(HMap *hmap);
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// a random node for eviction sampling, NULL if empty
+HNode *hm_sample(HMap *hmap, uint64_t rnd);
 #endif
\ No newline at end of file
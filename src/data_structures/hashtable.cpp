@@ -38,6 +38,27 @@ HNode *h_detach(HTab *htab, HNode **from){
     return node;
 };
 
+// a random node: the first chain at or after a random slot, then a random
+// node of it; not uniform, but good enough for sampling. NULL if empty
+HNode *h_sample(HTab *htab, uint64_t rnd){
+    if(htab->size == 0){
+        return NULL;
+    }
+    size_t pos = rnd & htab->mask;
+    while(!htab->tab[pos]){
+        pos = (pos + 1) & htab->mask;
+    }
+    size_t len = 0;
+    for(HNode *node = htab->tab[pos]; node; node = node->next){
+        len++;
+    }
+    HNode *node = htab->tab[pos];
+    for(size_t i = (rnd >> 32) % len; i > 0; --i){
+        node = node->next;
+    }
+    return node;
+};
+
 bool h_foreach(HTab *htab, bool (*f)(HNode*, void *), void *arg){
     for(size_t i=0; htab->mask != 0 && i <= htab->mask; i++){
         for(HNode *node = htab->tab[i]; node != NULL; node = node->next){
@@ -20,6 +20,7 @@ void h_insert(HTab *htab, HNode *node);
 HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *));
 HNode *h_detach(HTab *htab, HNode **from);
 bool h_foreach(HTab *htab, bool (*f)(HNode*, void *), void *arg);
+HNode *h_sample(HTab *htab, uint64_t rnd);
 
 #define container_of(ptr, type, member) \
     ((type *)((char *)(ptr) - offsetof(type, member)))
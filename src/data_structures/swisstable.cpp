@@ -0,0 +1,161 @@
+#include "swisstable.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum : uint8_t {
+    CTRL_EMPTY = 0x80,
+    CTRL_DELETED = 0xfe,
+    // 0x00-0x7f: a full slot, the low 7 bits of the hash
+};
+
+// the hash is split: h1 picks the first group, h2 is kept in the control byte
+static size_t st_h1(uint64_t hcode){
+    return (size_t)(hcode >> 7);
+};
+
+static uint8_t st_h2(uint64_t hcode){
+    return (uint8_t)(hcode & 0x7f);
+};
+
+// bit i is set if control byte i of the group equals `b`
+static uint32_t group_match(const uint8_t *group, uint8_t b){
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    uint32_t bits = 0;
+    for(size_t i = 0; i < k_st_group; ++i){
+        bits |= (uint32_t)(group[i] == b) << i;
+    }
+    return bits;
+#endif
+};
+
+// empty or deleted, the slots an insert can take
+static uint32_t group_match_free(const uint8_t *group){
+#ifdef __SSE2__
+    // only those have the high bit set
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+    uint32_t bits = 0;
+    for(size_t i = 0; i < k_st_group; ++i){
+        bits |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return bits;
+#endif
+};
+
+void st_init(STab *stab, size_t ngroups){
+    assert(ngroups > 0 && ((ngroups - 1) & ngroups) == 0);
+    size_t cap = ngroups * k_st_group;
+    stab->ctrl = (uint8_t *)malloc(cap);
+    stab->slots = (HNode **)malloc(cap * sizeof(HNode *));
+    memset(stab->ctrl, CTRL_EMPTY, cap);
+    stab->mask = ngroups - 1;
+    stab->size = 0;
+    stab->used = 0;
+};
+
+void st_free(STab *stab){
+    free(stab->ctrl);
+    free(stab->slots);
+    *stab = STab{};
+};
+
+size_t st_capacity(const STab *stab){
+    return stab->ctrl ? (stab->mask + 1) * k_st_group : 0;
+};
+
+// the max load factor is 7/8, tombstones included
+bool st_full(const STab *stab){
+    return stab->used + 1 > st_capacity(stab) / 8 * 7;
+};
+
+// triangular probing over groups visits every group once
+void st_insert(STab *stab, HNode *node){
+    assert(!st_full(stab));
+    size_t g = st_h1(node->hcode) & stab->mask;
+    for(size_t step = 1; ; ++step){
+        uint8_t *group = stab->ctrl + g * k_st_group;
+        uint32_t bits = group_match_free(group);
+        if(bits){
+            size_t i = g * k_st_group + __builtin_ctz(bits);
+            if(stab->ctrl[i] == CTRL_EMPTY){
+                stab->used++;   // not reusing a tombstone
+            }
+            stab->ctrl[i] = st_h2(node->hcode);
+            stab->slots[i] = node;
+            stab->size++;
+            return;
+        }
+        g = (g + step) & stab->mask;
+    }
+};
+
+HNode **st_lookup(STab *stab, HNode *key, bool (*eq)(HNode *, HNode *)){
+    if(!stab->ctrl){
+        return NULL;
+    }
+    uint8_t h2 = st_h2(key->hcode);
+    size_t g = st_h1(key->hcode) & stab->mask;
+    for(size_t step = 1; step <= stab->mask + 1; ++step){
+        const uint8_t *group = stab->ctrl + g * k_st_group;
+        for(uint32_t bits = group_match(group, h2); bits; bits &= bits - 1){
+            size_t i = g * k_st_group + __builtin_ctz(bits);
+            HNode *cur = stab->slots[i];
+            if(cur->hcode == key->hcode && eq(cur, key)){
+                return &stab->slots[i];
+            }
+        }
+        if(group_match(group, CTRL_EMPTY)){
+            return NULL;    // the key would have been put here
+        }
+        g = (g + step) & stab->mask;
+    }
+    return NULL;
+};
+
+HNode *st_detach(STab *stab, HNode **from){
+    size_t i = from - stab->slots;
+    HNode *node = *from;
+    // a probe stops at a group with an empty slot anyway, so the slot can
+    // become empty instead of a tombstone then
+    if(group_match(stab->ctrl + (i / k_st_group) * k_st_group, CTRL_EMPTY)){
+        stab->ctrl[i] = CTRL_EMPTY;
+        stab->used--;
+    } else {
+        stab->ctrl[i] = CTRL_DELETED;
+    }
+    stab->size--;
+    return node;
+};
+
+bool st_foreach(STab *stab, bool (*f)(HNode *, void *), void *arg){
+    size_t cap = st_capacity(stab);
+    for(size_t i = 0; i < cap; ++i){
+        if(!(stab->ctrl[i] & 0x80) && !f(stab->slots[i], arg)){
+            return false;
+        }
+    }
+    return true;
+};
+
+// the first live slot at or after a random one; NULL if empty
+HNode *st_sample(STab *stab, uint64_t rnd){
+    if(stab->size == 0){
+        return NULL;
+    }
+    size_t mask = st_capacity(stab) - 1;
+    size_t i = rnd & mask;
+    while(stab->ctrl[i] & 0x80){
+        i = (i + 1) & mask;
+    }
+    return stab->slots[i];
+};
@@ -0,0 +1,30 @@
+#ifndef SWISSTABLE_H
+#define SWISSTABLE_H
+
+#include "hashtable.h"
+
+// An open addressing table of intrusive `HNode`s, Swiss table style: one
+// control byte per slot (empty, deleted or 7 bits of the hash) and the
+// control bytes of a 16 slot group are matched at once with SSE2. A
+// lookup mostly touches one control group and one matching node.
+const size_t k_st_group = 16;
+
+struct STab {
+    uint8_t *ctrl = NULL;   // one byte per slot
+    HNode **slots = NULL;
+    size_t mask = 0;        // number of groups - 1
+    size_t size = 0;        // live nodes
+    size_t used = 0;        // live nodes + tombstones
+};
+
+void st_init(STab *stab, size_t ngroups);
+void st_free(STab *stab);
+size_t st_capacity(const STab *stab);
+bool st_full(const STab *stab);
+void st_insert(STab *stab, HNode *node);
+HNode **st_lookup(STab *stab, HNode *key, bool (*eq)(HNode *, HNode *));
+HNode *st_detach(STab *stab, HNode **from);
+bool st_foreach(STab *stab, bool (*f)(HNode *, void *), void *arg);
+HNode *st_sample(STab *stab, uint64_t rnd);
+
+#endif
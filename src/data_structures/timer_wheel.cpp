@@ -0,0 +1,205 @@
+#include "timer_wheel.h"
+#include "hashtable.h"
+
+#include <assert.h>
+
+static uint32_t tw_digit(uint64_t t, uint32_t level){
+    return (uint32_t)(t >> (level * k_tw_bits)) & (k_tw_slots - 1);
+};
+
+static void bitmap_set(TimerWheel *tw, uint32_t level, uint32_t idx){
+    tw->bitmap[level][idx / 64] |= (uint64_t)1 << (idx % 64);
+};
+
+static void bitmap_clear(TimerWheel *tw, uint32_t level, uint32_t idx){
+    tw->bitmap[level][idx / 64] &= ~((uint64_t)1 << (idx % 64));
+};
+
+// the first non-empty slot at or after `idx`, or k_tw_slots
+static uint32_t bitmap_next(const TimerWheel *tw, uint32_t level, uint32_t idx){
+    while(idx < k_tw_slots){
+        uint64_t word = tw->bitmap[level][idx / 64] >> (idx % 64);
+        if(word){
+            return idx + (uint32_t)__builtin_ctzll(word);
+        }
+        idx = (idx / 64 + 1) * 64;
+    }
+    return k_tw_slots;
+};
+
+void tw_init(TimerWheel *tw, uint64_t now_ms){
+    tw->cur = now_ms;
+    tw->size = 0;
+    for(uint32_t l = 0; l < k_tw_levels; ++l){
+        for(uint32_t i = 0; i < k_tw_slots; ++i){
+            dlist_init(&tw->slots[l][i]);
+        }
+    }
+    dlist_init(&tw->overflow);
+    dlist_init(&tw->due);
+};
+
+// the level is the highest digit where the expiry and `cur` differ, so
+// the timer is cascaded down exactly when `cur` reaches that digit
+static void tw_place(TimerWheel *tw, TWTimer *timer){
+    uint64_t expire = timer->expire;
+    if(expire < tw->cur){
+        dlist_insert_before(&tw->due, &timer->node);
+        return;
+    }
+    uint64_t diff = expire ^ tw->cur;
+    uint32_t level = 0;
+    while(level < k_tw_levels && (diff >> ((level + 1) * k_tw_bits)) != 0){
+        level++;
+    }
+    if(level == k_tw_levels){
+        dlist_insert_before(&tw->overflow, &timer->node);
+        return;
+    }
+    uint32_t idx = tw_digit(expire, level);
+    dlist_insert_before(&tw->slots[level][idx], &timer->node);
+    bitmap_set(tw, level, idx);
+};
+
+void tw_add(TimerWheel *tw, TWTimer *timer, uint64_t expire_ms){
+    if(tw_active(timer)){
+        tw_del(tw, timer);
+    }
+    timer->expire = expire_ms;
+    tw_place(tw, timer);
+    tw->size++;
+};
+
+void tw_del(TimerWheel *tw, TWTimer *timer){
+    assert(tw_active(timer));
+    DList *next = timer->node.next;
+    dlist_detach(&timer->node);
+    timer->node.prev = timer->node.next = nullptr;
+    tw->size--;
+
+    // the last timer of a slot, `next` is the slot itself
+    DList *first = &tw->slots[0][0];
+    if(next >= first && next < first + k_tw_levels * k_tw_slots && dlist_empty(next)){
+        size_t pos = next - first;
+        bitmap_clear(tw, (uint32_t)(pos / k_tw_slots), (uint32_t)(pos % k_tw_slots));
+    }
+};
+
+// move the timers of a slot down, relative to the new `cur`
+static void tw_redistribute(TimerWheel *tw, DList *list){
+    // detach them all first, overflow timers may go back to the same list
+    DList pending;
+    dlist_init(&pending);
+    if(!dlist_empty(list)){
+        dlist_insert_before(list, &pending);
+        dlist_detach(list);
+        dlist_init(list);
+    }
+    while(!dlist_empty(&pending)){
+        TWTimer *timer = container_of(pending.next, TWTimer, node);
+        dlist_detach(&timer->node);
+        tw_place(tw, timer);
+    }
+};
+
+// `cur` moves to `t`; crossing a level 0 round cascades the higher levels
+static void tw_step(TimerWheel *tw, uint64_t t){
+    tw->cur = t;
+    if(tw_digit(t, 0) != 0){
+        return;
+    }
+    uint32_t top = 1;
+    while(top + 1 < k_tw_levels && tw_digit(t, top) == 0){
+        top++;
+    }
+    if(top + 1 == k_tw_levels && tw_digit(t, top) == 0){
+        tw_redistribute(tw, &tw->overflow);
+    }
+    // from the top, so timers falling through several levels end up right
+    for(uint32_t l = top; l >= 1; --l){
+        uint32_t idx = tw_digit(t, l);
+        bitmap_clear(tw, l, idx);
+        tw_redistribute(tw, &tw->slots[l][idx]);
+    }
+};
+
+// the earliest time something may be due: the exact expiry on level 0,
+// otherwise the next cascade, which is never later than the expiry
+uint64_t tw_next(TimerWheel *tw){
+    if(tw->size == 0){
+        return (uint64_t)-1;
+    }
+    if(!dlist_empty(&tw->due)){
+        return container_of(tw->due.next, TWTimer, node)->expire;
+    }
+    uint64_t cur = tw->cur;
+    uint32_t idx = bitmap_next(tw, 0, tw_digit(cur, 0));
+    if(idx < k_tw_slots){
+        return cur - tw_digit(cur, 0) + idx;
+    }
+    for(uint32_t l = 1; l < k_tw_levels; ++l){
+        idx = bitmap_next(tw, l, tw_digit(cur, l) + 1);
+        if(idx < k_tw_slots){
+            uint32_t shift = (l + 1) * k_tw_bits;
+            return ((cur >> shift) << shift) | ((uint64_t)idx << (l * k_tw_bits));
+        }
+    }
+    uint32_t shift = k_tw_levels * k_tw_bits;
+    return ((cur >> shift) + 1) << shift;
+};
+
+static uint64_t list_min_expire(DList *list){
+    uint64_t best = (uint64_t)-1;
+    for(DList *node = list->next; node != list; node = node->next){
+        uint64_t expire = container_of(node, TWTimer, node)->expire;
+        best = expire < best ? expire : best;
+    }
+    return best;
+};
+
+// Like tw_next(), but a slot of a higher level or the overflow list holds
+// a range of expiries, so the first one is searched for. The due timers
+// precede all the others: a slot is only passed once it is empty.
+uint64_t tw_next_expire(TimerWheel *tw){
+    if(tw->size == 0){
+        return (uint64_t)-1;
+    }
+    if(!dlist_empty(&tw->due)){
+        return list_min_expire(&tw->due);
+    }
+    uint64_t cur = tw->cur;
+    uint32_t idx = bitmap_next(tw, 0, tw_digit(cur, 0));
+    if(idx < k_tw_slots){
+        return cur - tw_digit(cur, 0) + idx;
+    }
+    for(uint32_t l = 1; l < k_tw_levels; ++l){
+        idx = bitmap_next(tw, l, tw_digit(cur, l) + 1);
+        if(idx < k_tw_slots){
+            return list_min_expire(&tw->slots[l][idx]);
+        }
+    }
+    return list_min_expire(&tw->overflow);
+};
+
+// one timer with `expire <= now_ms`, unlinked, or NULL
+TWTimer *tw_pop_expired(TimerWheel *tw, uint64_t now_ms){
+    if(!dlist_empty(&tw->due)){
+        TWTimer *timer = container_of(tw->due.next, TWTimer, node);
+        tw_del(tw, timer);
+        return timer;
+    }
+    while(tw->cur <= now_ms){
+        uint32_t idx = tw_digit(tw->cur, 0);
+        DList *slot = &tw->slots[0][idx];
+        if(!dlist_empty(slot)){
+            TWTimer *timer = container_of(slot->next, TWTimer, node);
+            tw_del(tw, timer);
+            return timer;
+        }
+        // jump to the next occupied slot or cascade, the ones in between
+        // are empty
+        uint64_t t = tw_next(tw);
+        tw_step(tw, t <= now_ms ? t : now_ms + 1);
+    }
+    return NULL;
+};
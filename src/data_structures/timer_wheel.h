@@ -0,0 +1,43 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "DList.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// A hierarchical timing wheel with millisecond ticks: 4 levels of 256
+// slots cover ~49 days, later timers wait in an overflow list. Insert and
+// cancel are O(1); a timer is moved down a level at most 3 times.
+const uint32_t k_tw_bits = 8;
+const uint32_t k_tw_slots = 1 << k_tw_bits;
+const uint32_t k_tw_levels = 4;
+
+struct TWTimer {
+    DList node;             // unlinked when not armed
+    uint64_t expire = 0;    // in ms
+};
+
+struct TimerWheel {
+    uint64_t cur = 0;       // the next ms to process
+    size_t size = 0;
+    DList slots[k_tw_levels][k_tw_slots];
+    uint64_t bitmap[k_tw_levels][k_tw_slots / 64] = {};  // non-empty slots
+    DList overflow;
+    DList due;              // already expired when added
+};
+
+void tw_init(TimerWheel *tw, uint64_t now_ms);
+void tw_add(TimerWheel *tw, TWTimer *timer, uint64_t expire_ms);
+void tw_del(TimerWheel *tw, TWTimer *timer);
+TWTimer *tw_pop_expired(TimerWheel *tw, uint64_t now_ms);
+// when to process the wheel next: the next expiry or cascade
+uint64_t tw_next(TimerWheel *tw);
+// the earliest expiry of any timer, -1 if none; scans one list
+uint64_t tw_next_expire(TimerWheel *tw);
+
+inline bool tw_active(const TWTimer *timer){
+    return timer->node.next != nullptr;
+};
+
+#endif
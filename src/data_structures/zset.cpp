@@ -1,15 +1,57 @@
 #include "zset.h"
+#include "hash.h"
+#include "slab.h"
+#include "thread_pool.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <vector>
 #include "assert.h"
 
-static uint64_t str_hash(const uint8_t *data, size_t len){
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i< len; i++){
-        h = (h + data[i]) * 0x01000193;
-    }
-    return h;
+uint32_t g_zset_pack_max_entries = 64;
+uint32_t g_zset_pack_max_name = 64;
+
+// smaller batches are inserted one by one
+const size_t k_zset_bulk_min = 256;
+// members per task when sorting on the thread pool
+const size_t k_zset_sort_chunk = 1 << 16;
+
+// the packed buffer, the members follow the struct
+struct ZPack {
+    uint32_t n = 0;     // members
+    uint32_t used = 0;  // bytes of members
+    uint32_t cap = 0;   // bytes for members
+    uint8_t data[0];
+};
+
+// a packed member: score, name length, name
+const size_t k_zp_hdr = sizeof(double) + sizeof(uint16_t);
+
+static double zp_score(const uint8_t *p){
+    double score;
+    memcpy(&score, p, sizeof(score));
+    return score;
+};
+
+static size_t zp_len(const uint8_t *p){
+    uint16_t len;
+    memcpy(&len, p + sizeof(double), sizeof(len));
+    return len;
+};
+
+static const char *zp_name(const uint8_t *p){
+    return (const char *)p + k_zp_hdr;
+};
+
+static size_t zp_size(const uint8_t *p){
+    return k_zp_hdr + zp_len(p);
+};
+
+bool zset_pack_limits_ok(uint32_t max_entries, uint32_t max_name){
+    uint64_t bytes = (uint64_t)max_entries * (k_zp_hdr + max_name);
+    return bytes + bytes / 2 + sizeof(ZPack) < UINT32_MAX / 2;
 };
 
 static bool hcmp(HNode *node, HNode *key){
@@ -27,24 +69,85 @@ static size_t min(size_t lhs, size_t rhs) {
 
 // compare by the (score, name) tuple
 static bool zless(
-    AVLNode *lhs, double score, const char *name, size_t len)
+    double ls, const char *lname, size_t llen, double score, const char *name, size_t len)
 {
-    ZNode *zl = container_of(lhs, ZNode, tree);
-    if (zl->score != score) {
-        return zl->score < score;
+    if (ls != score) {
+        return ls < score;
     }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
+    int rv = memcmp(lname, name, min(llen, len));
     if (rv != 0) {
         return rv < 0;
     }
-    return zl->len < len;
+    return llen < len;
+}
+
+#ifdef USE_BTREE_ZSET
+// equal scores are ordered by name
+static int zname_cmp(void *item, const void *key){
+    ZNode *node = (ZNode *)item;
+    const HKey *hkey = (const HKey *)key;
+    int rv = memcmp(node->name, hkey->name, min(node->len, hkey->len));
+    if(rv != 0){
+        return rv;
+    }
+    return node->len < hkey->len ? -1 : node->len > hkey->len ? 1 : 0;
+};
+
+static HKey znode_key(ZNode *node){
+    HKey key;
+    key.name = node->name;
+    key.len = node->len;
+    return key;
+};
+
+// the B+tree nodes are accounted with the members
+static void index_insert(ZSet *zset, ZNode *node){
+    HKey key = znode_key(node);
+    size_t bytes = zset->tree.bytes;
+    bt_insert(&zset->tree, node->score, node, &key, &zname_cmp);
+    zset->bytes = zset->bytes - bytes + zset->tree.bytes;
+};
+
+static void index_delete(ZSet *zset, ZNode *node){
+    HKey key = znode_key(node);
+    size_t bytes = zset->tree.bytes;
+    void *found = bt_delete(&zset->tree, node->score, &key, &zname_cmp);
+    assert(found == node);
+    zset->bytes = zset->bytes - bytes + zset->tree.bytes;
+};
+
+static void keep_node(void *){};
+
+// drops the tree nodes only, the members stay in the hashtable
+static void index_detach(ZSet *zset){
+    zset->bytes -= zset->tree.bytes;
+    bt_clear(&zset->tree, &keep_node);
+};
+
+static void index_build(ZSet *zset, ZNode **nodes, size_t n){
+    std::vector<BKey> items(n);
+    for(size_t i = 0; i < n; ++i){
+        items[i] = BKey{nodes[i]->score, nodes[i]};
+    }
+    bt_build(&zset->tree, items.data(), n);
+    zset->bytes += zset->tree.bytes;
+};
+#else
+static bool zless(
+    AVLNode *lhs, double score, const char *name, size_t len)
+{
+    ZNode *zl = container_of(lhs, ZNode, tree);
+    return zless(zl->score, zl->name, zl->len, score, name, len);
 }
 
 static bool zless(AVLNode *lhs, AVLNode *rhs) {
     ZNode *zr = container_of(rhs, ZNode, tree);
     return zless(lhs, zr->score, zr->name, zr->len);
 }
-static void tree_insert(ZSet *zset, ZNode *node){
+
+static void index_insert(ZSet *zset, ZNode *node){
+    node->tree.val = node->score;
+    avl_init(&node->tree);
     AVLNode *parent = NULL;
     AVLNode **from = &zset->root;
 
@@ -57,19 +160,35 @@ static void tree_insert(ZSet *zset, ZNode *node){
     zset->root = avl_fix(&node->tree);
 };
 
+static void index_delete(ZSet *zset, ZNode *node){
+    zset->root = avl_del(&node->tree);
+};
+
+// the members stay in the hashtable, their links are rewritten by the build
+static void index_detach(ZSet *zset){
+    zset->root = NULL;
+};
+
+static void index_build(ZSet *zset, ZNode **nodes, size_t n){
+    std::vector<AVLNode *> tnodes(n);
+    for(size_t i = 0; i < n; ++i){
+        nodes[i]->tree.val = nodes[i]->score;
+        tnodes[i] = &nodes[i]->tree;
+    }
+    zset->root = avl_build(tnodes.data(), n);
+};
+#endif
+
 static void zset_update(ZSet *zset, ZNode *node, double score){
     // detach the tree node
-    zset->root = avl_del(&node->tree);
-    avl_init(&node->tree);
+    index_delete(zset, node);
     // reinsert the tree node
     node->score = score;
-    tree_insert(zset, node);
+    index_insert(zset, node);
 };
 
-
 static ZNode *znode_new(const char *name, size_t len, double score){
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
-    avl_init(&node->tree);
+    ZNode *node = (ZNode *)slab_alloc(sizeof(ZNode) + len);
     node->hmap.next = NULL;
     node->hmap.hcode = str_hash((uint8_t *)name, len);
     node->score = score;
@@ -78,12 +197,13 @@ static ZNode *znode_new(const char *name, size_t len, double score){
     return node;
 };
 
+// any thread, large sets are freed by the thread pool
 static void znode_del(ZNode *node){
-    free(node);
+    slab_free(node, sizeof(ZNode) + node->len);
 };
 
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len){
-    if(!zset->root){
+static ZNode *zset_lookup(ZSet *zset, const char *name, size_t len){
+    if(hm_size(&zset->hmap) == 0){
         return NULL;
     }
 
@@ -95,19 +215,23 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len){
     return found ? container_of(found, ZNode, hmap) : NULL;
 };
 
+// the slot arrays after the table may have been resized, also by lookups
+// finishing a rehash since the last write
+static void hmap_account(ZSet *zset){
+    size_t bytes = hm_bytes(&zset->hmap);
+    zset->bytes = zset->bytes - zset->hmap_bytes + bytes;
+    zset->hmap_bytes = bytes;
+};
 
-bool zset_insert(ZSet *zset, const char *name, size_t len, double score){
-    if (ZNode *node = zset_lookup(zset, name, len)) {
-        zset_update(zset, node, score);
-        return false;
-    }
+static void tree_add(ZSet *zset, const char *name, size_t len, double score){
     ZNode *node = znode_new(name, len, score);
+    zset->bytes += slab_good_size(sizeof(ZNode) + len);
     hm_insert(&zset->hmap, &node->hmap);
-    tree_insert(zset, node);
-    return true;
+    hmap_account(zset);
+    index_insert(zset, node);
 };
 
-void zset_delete(ZSet *zset, ZNode *node){
+static void zset_delete(ZSet *zset, ZNode *node){
     // remove from hashtable
     HKey key;
     key.node.hcode = node->hmap.hcode;
@@ -115,15 +239,298 @@ void zset_delete(ZSet *zset, ZNode *node){
     key.len = node->len;
     HNode *found = hm_delete(&zset->hmap, &key.node, &hcmp);
     assert(found);
+    hmap_account(zset);
     //remove from the tree
-    zset->root = avl_del(&node->tree);
+    index_delete(zset, node);
     // deallocate the node:
+    zset->bytes -= slab_good_size(sizeof(ZNode) + node->len);
     znode_del(node);
 };
 
-ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len){
-    AVLNode *found = NULL;
+// the packed encoding
+
+static void pack_free(ZPack *pack){
+    slab_free(pack, sizeof(ZPack) + pack->cap);
+};
+
+// the offset of a member by name, -1 if not found
+static int64_t pack_find(ZPack *pack, const char *name, size_t len){
+    for(uint32_t pos = 0; pack && pos < pack->used; pos += zp_size(pack->data + pos)){
+        const uint8_t *p = pack->data + pos;
+        if(zp_len(p) == len && memcmp(zp_name(p), name, len) == 0){
+            return pos;
+        }
+    }
+    return -1;
+};
+
+// the first member not less than (score, name): its index and offset
+static void pack_seekge(
+    ZPack *pack, double score, const char *name, size_t len, uint32_t *idx, uint32_t *pos)
+{
+    *idx = 0;
+    *pos = 0;
+    while(pack && *pos < pack->used){
+        const uint8_t *p = pack->data + *pos;
+        if(!zless(zp_score(p), zp_name(p), zp_len(p), score, name, len)){
+            break;
+        }
+        (*idx)++;
+        *pos += zp_size(p);
+    }
+};
+
+// room for `extra` more bytes, grown by half to amortize the copies
+static void pack_reserve(ZSet *zset, size_t extra){
+    ZPack *pack = zset->pack;
+    size_t used = pack ? pack->used : 0;
+    if(pack && used + extra <= pack->cap){
+        return;
+    }
+    size_t size = slab_good_size(sizeof(ZPack) + used + extra + used / 2);
+    assert(size - sizeof(ZPack) <= UINT32_MAX);     // see zset_pack_limits_ok()
+    ZPack *bigger = new (slab_alloc(size)) ZPack();
+    bigger->cap = (uint32_t)(size - sizeof(ZPack));
+    if(pack){
+        bigger->n = pack->n;
+        bigger->used = pack->used;
+        memcpy(bigger->data, pack->data, pack->used);
+        zset->bytes -= sizeof(ZPack) + pack->cap;
+        pack_free(pack);
+    }
+    zset->bytes += size;
+    zset->pack = bigger;
+};
+
+static void pack_erase(ZPack *pack, uint32_t pos){
+    size_t size = zp_size(pack->data + pos);
+    memmove(pack->data + pos, pack->data + pos + size, pack->used - pos - size);
+    pack->used -= (uint32_t)size;
+    pack->n--;
+};
+
+static void pack_add(ZSet *zset, const char *name, size_t len, double score){
+    pack_reserve(zset, k_zp_hdr + len);
+    ZPack *pack = zset->pack;
+    uint32_t idx = 0, pos = 0;
+    pack_seekge(pack, score, name, len, &idx, &pos);
+    uint8_t *p = pack->data + pos;
+    memmove(p + k_zp_hdr + len, p, pack->used - pos);
+    uint16_t len16 = (uint16_t)len;
+    memcpy(p, &score, sizeof(score));
+    memcpy(p + sizeof(score), &len16, sizeof(len16));
+    memcpy(p + k_zp_hdr, name, len);
+    pack->used += (uint32_t)(k_zp_hdr + len);
+    pack->n++;
+};
+
+// converts to the tree encoding, for good
+static void pack_convert(ZSet *zset){
+    ZPack *pack = zset->pack;
+    zset->encoding = ZSET_TREE;
+    zset->pack = NULL;
+    zset->bytes = 0;
+    if(!pack){
+        return;
+    }
+    for(uint32_t pos = 0; pos < pack->used; pos += zp_size(pack->data + pos)){
+        const uint8_t *p = pack->data + pos;
+        tree_add(zset, zp_name(p), zp_len(p), zp_score(p));
+    }
+    pack_free(pack);
+};
 
+bool zset_insert(ZSet *zset, const char *name, size_t len, double score){
+    if(zset->encoding == ZSET_PACKED){
+        int64_t pos = pack_find(zset->pack, name, len);
+        if(pos >= 0){
+            // update: remove and add back in order
+            if(zp_score(zset->pack->data + pos) != score){
+                pack_erase(zset->pack, (uint32_t)pos);
+                pack_add(zset, name, len, score);
+            }
+            return false;
+        }
+        uint32_t n = zset->pack ? zset->pack->n : 0;
+        if(n < g_zset_pack_max_entries && len <= g_zset_pack_max_name){
+            pack_add(zset, name, len, score);
+            return true;
+        }
+        pack_convert(zset);
+    }
+    if (ZNode *node = zset_lookup(zset, name, len)) {
+        zset_update(zset, node, score);
+        return false;
+    }
+    tree_add(zset, name, len, score);
+    return true;
+};
+
+// bulk loads
+
+struct ZSort {
+    ZNode **begin = NULL;
+    ZNode **mid = NULL;
+    ZNode **end = NULL;
+};
+
+static bool znode_less(ZNode *lhs, ZNode *rhs){
+    return zless(lhs->score, lhs->name, lhs->len, rhs->score, rhs->name, rhs->len);
+};
+
+static void sort_task(void *arg){
+    ZSort *run = (ZSort *)arg;
+    std::sort(run->begin, run->end, &znode_less);
+};
+
+static void merge_task(void *arg){
+    ZSort *run = (ZSort *)arg;
+    std::inplace_merge(run->begin, run->mid, run->end, &znode_less);
+};
+
+static void run_sort_tasks(ThreadPool *pool, void (*f)(void *), std::vector<ZSort> &runs){
+    std::vector<void *> args;
+    for(ZSort &run : runs){
+        args.push_back(&run);
+    }
+    thread_pool_run(pool, f, args.data(), args.size());
+};
+
+// sorted runs on the pool and the caller, then merged pairwise, also in
+// parallel, until one is left
+static void zsort(std::vector<ZNode *> &nodes, ThreadPool *pool){
+    size_t n = nodes.size();
+    if(std::is_sorted(nodes.begin(), nodes.end(), &znode_less)){
+        return;     // pre-sorted input costs one pass
+    }
+    size_t tasks = pool ? std::min(pool->workers.size() + 1, n / k_zset_sort_chunk) : 0;
+    if(tasks < 2){
+        std::sort(nodes.begin(), nodes.end(), &znode_less);
+        return;
+    }
+    ZNode **data = nodes.data();
+    size_t len = (n + tasks - 1) / tasks;
+    std::vector<ZSort> runs;
+    for(size_t lo = 0; lo < n; lo += len){
+        runs.push_back(ZSort{data + lo, NULL, data + std::min(lo + len, n)});
+    }
+    run_sort_tasks(pool, &sort_task, runs);
+    for(; len < n; len *= 2){
+        runs.clear();
+        for(size_t lo = 0; lo + len < n; lo += 2 * len){
+            runs.push_back(ZSort{data + lo, data + lo + len, data + std::min(lo + 2 * len, n)});
+        }
+        run_sort_tasks(pool, &merge_task, runs);
+    }
+};
+
+static bool cb_collect(HNode *node, void *arg){
+    ((std::vector<ZNode *> *)arg)->push_back(container_of(node, ZNode, hmap));
+    return true;
+};
+
+size_t zset_insert_bulk(ZSet *zset, const ZMember *members, size_t n, ThreadPool *pool){
+    size_t size = zset_size(zset);
+    bool fits_packed = zset->encoding == ZSET_PACKED && size + n <= g_zset_pack_max_entries;
+    if(n < k_zset_bulk_min || n < size || fits_packed){
+        if(zset->encoding == ZSET_TREE){
+            hm_reserve(&zset->hmap, n);
+        }
+        size_t added = 0;
+        for(size_t i = 0; i < n; ++i){
+            added += zset_insert(zset, members[i].name, members[i].len, members[i].score);
+        }
+        if(zset->encoding == ZSET_TREE){
+            hmap_account(zset);     // the reserve
+        }
+        return added;
+    }
+
+    if(zset->encoding == ZSET_PACKED){
+        pack_convert(zset);
+    }
+    // no rehashing during the load, and no tree until the end
+    hm_reserve(&zset->hmap, n);
+    index_detach(zset);
+    std::vector<ZNode *> nodes;
+    nodes.reserve(size + n);
+    size_t added = 0;
+    for(size_t i = 0; i < n; ++i){
+        const ZMember &m = members[i];
+        if(ZNode *node = zset_lookup(zset, m.name, m.len)){
+            node->score = m.score;
+            continue;
+        }
+        ZNode *node = znode_new(m.name, m.len, m.score);
+        zset->bytes += slab_good_size(sizeof(ZNode) + m.len);
+        hm_insert(&zset->hmap, &node->hmap);
+        nodes.push_back(node);
+        added++;
+    }
+    hmap_account(zset);
+    // a new set keeps the input order, so a sorted batch (a snapshot being
+    // loaded) isn't sorted again
+    if(size > 0 || added < n){
+        nodes.clear();
+        hm_foreach(&zset->hmap, &cb_collect, &nodes);
+    }
+    zsort(nodes, pool);
+    index_build(zset, nodes.data(), nodes.size());
+    return added;
+};
+
+bool zset_remove(ZSet *zset, const char *name, size_t len){
+    if(zset->encoding == ZSET_PACKED){
+        int64_t pos = pack_find(zset->pack, name, len);
+        if(pos >= 0){
+            pack_erase(zset->pack, (uint32_t)pos);
+        }
+        return pos >= 0;
+    }
+    ZNode *node = zset_lookup(zset, name, len);
+    if(node){
+        zset_delete(zset, node);
+    }
+    return node != NULL;
+};
+
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score){
+    if(zset->encoding == ZSET_PACKED){
+        int64_t pos = pack_find(zset->pack, name, len);
+        if(pos >= 0){
+            *score = zp_score(zset->pack->data + pos);
+        }
+        return pos >= 0;
+    }
+    ZNode *node = zset_lookup(zset, name, len);
+    if(node){
+        *score = node->score;
+    }
+    return node != NULL;
+};
+
+size_t zset_size(ZSet *zset){
+    if(zset->encoding == ZSET_PACKED){
+        return zset->pack ? zset->pack->n : 0;
+    }
+    return hm_size(&zset->hmap);
+};
+
+ZIter zset_seekge(ZSet *zset, double score, const char *name, size_t len){
+    ZIter it;
+    it.zset = zset;
+    if(zset->encoding == ZSET_PACKED){
+        pack_seekge(zset->pack, score, name, len, &it.idx, &it.pos);
+        return it;
+    }
+
+#ifdef USE_BTREE_ZSET
+    HKey key;
+    key.name = name;
+    key.len = len;
+    it.bpos = bt_seekge(&zset->tree, score, &key, &zname_cmp);
+#else
+    AVLNode *found = NULL;
     for(AVLNode *node = zset->root; node;){
         if(zless(node, score, name, len)){
             node= node->right;
@@ -132,14 +539,166 @@ ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len){
             node = node->left;
         }
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
+    it.node = found ? container_of(found, ZNode, tree) : NULL;
+#endif
+    return it;
 };
 
-ZNode *znode_offset(ZNode *node, int64_t offset) {
-    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
-    return tnode ? container_of(tnode, ZNode, tree) : NULL;
-}
+bool zset_iter_ok(const ZIter *it){
+    if(it->zset->encoding == ZSET_PACKED){
+        return it->zset->pack && it->idx < it->zset->pack->n;
+    }
+#ifdef USE_BTREE_ZSET
+    return it->bpos.leaf != NULL;
+#else
+    return it->node != NULL;
+#endif
+};
+
+// moves by `offset` members, past either end makes it invalid
+void zset_iter_offset(ZIter *it, int64_t offset){
+    // a move as long as the set always leaves it, and the rank sums below
+    // can't overflow for a LIMIT offset near INT64_MAX
+    int64_t size = (int64_t)zset_size(it->zset);
+    if(offset >= size || offset <= -size){
+        if(it->zset->encoding == ZSET_PACKED){
+            it->idx = it->zset->pack ? it->zset->pack->n : 0;
+            return;
+        }
+#ifdef USE_BTREE_ZSET
+        it->bpos = BPos();
+#else
+        it->node = NULL;
+#endif
+        return;
+    }
+    if(it->zset->encoding == ZSET_TREE){
+#ifdef USE_BTREE_ZSET
+        bt_offset(&it->zset->tree, &it->bpos, offset);
+#else
+        AVLNode *tnode = it->node ? avl_offset(&it->node->tree, offset) : NULL;
+        it->node = tnode ? container_of(tnode, ZNode, tree) : NULL;
+#endif
+        return;
+    }
+    ZPack *pack = it->zset->pack;
+    uint32_t n = pack ? pack->n : 0;
+    int64_t idx = (int64_t)it->idx + offset;
+    if(it->idx >= n || idx < 0 || idx >= n){
+        it->idx = n;
+        return;
+    }
+    if(offset < 0){
+        // the sizes are only known forward, rescan
+        it->idx = 0;
+        it->pos = 0;
+        offset = idx;
+    }
+    for(; offset > 0; --offset){
+        it->pos += (uint32_t)zp_size(pack->data + it->pos);
+        it->idx++;
+    }
+};
 
+ZMember zset_iter_get(const ZIter *it){
+    assert(zset_iter_ok(it));
+    if(it->zset->encoding == ZSET_PACKED){
+        const uint8_t *p = it->zset->pack->data + it->pos;
+        return ZMember{zp_score(p), zp_name(p), zp_len(p)};
+    }
+#ifdef USE_BTREE_ZSET
+    ZNode *node = (ZNode *)bt_item(&it->bpos)->ptr;
+#else
+    ZNode *node = it->node;
+#endif
+    return ZMember{node->score, node->name, node->len};
+};
+
+int64_t zset_rank(ZSet *zset, const char *name, size_t len){
+    if(zset->encoding == ZSET_PACKED){
+        ZIter it;
+        it.zset = zset;
+        int64_t pos = pack_find(zset->pack, name, len);
+        if(pos < 0){
+            return -1;
+        }
+        double score = zp_score(zset->pack->data + pos);
+        pack_seekge(zset->pack, score, name, len, &it.idx, &it.pos);
+        return it.idx;
+    }
+    ZNode *node = zset_lookup(zset, name, len);
+    if(!node){
+        return -1;
+    }
+#ifdef USE_BTREE_ZSET
+    ZIter it = zset_seekge(zset, node->score, name, len);
+    return (int64_t)it.bpos.rank;
+#else
+    return avl_rank(&node->tree);
+#endif
+};
+
+ZIter zset_at(ZSet *zset, int64_t rank){
+    ZIter it;
+    it.zset = zset;
+    if(rank < 0 || rank >= (int64_t)zset_size(zset)){
+        it.idx = (uint32_t)zset_size(zset);
+        return it;
+    }
+    if(zset->encoding == ZSET_PACKED){
+        zset_iter_offset(&it, rank);
+        return it;
+    }
+#ifdef USE_BTREE_ZSET
+    it.bpos = bt_at(&zset->tree, (uint64_t)rank);
+#else
+    // from the root, whose rank is the size of its left subtree
+    AVLNode *node = avl_offset(zset->root, rank - avl_cnt(zset->root->left));
+    it.node = container_of(node, ZNode, tree);
+#endif
+    return it;
+};
+
+int64_t zset_iter_rank(const ZIter *it){
+    if(!zset_iter_ok(it)){
+        return (int64_t)zset_size(it->zset);
+    }
+    if(it->zset->encoding == ZSET_PACKED){
+        return it->idx;
+    }
+#ifdef USE_BTREE_ZSET
+    return (int64_t)it->bpos.rank;
+#else
+    return avl_rank(&it->node->tree);
+#endif
+};
+
+double zset_range_sum(ZSet *zset, int64_t lo, int64_t hi){
+    lo = lo < 0 ? 0 : lo;
+    hi = std::min<int64_t>(hi, (int64_t)zset_size(zset));
+    if(lo >= hi){
+        return 0;
+    }
+    if(zset->encoding == ZSET_PACKED){
+        double sum = 0;
+        ZIter it = zset_at(zset, lo);
+        for(int64_t i = lo; i < hi; ++i, zset_iter_offset(&it, +1)){
+            sum += zset_iter_get(&it).score;
+        }
+        return sum;
+    }
+#ifdef USE_BTREE_ZSET
+    return bt_range_sum(&zset->tree, (uint64_t)lo, (uint64_t)hi);
+#else
+    return avl_range_sum(zset->root, lo, hi);
+#endif
+};
+
+#ifdef USE_BTREE_ZSET
+static void tree_dispose(void *node){
+    znode_del((ZNode *)node);
+};
+#else
 static void tree_dispose(AVLNode *node){
     if(!node){
         return;
@@ -148,9 +707,20 @@ static void tree_dispose(AVLNode *node){
     tree_dispose(node->right);
     znode_del(container_of(node, ZNode, tree));
 };
+#endif
 
 void zset_clear(ZSet *zset){
+    if(zset->pack){
+        pack_free(zset->pack);
+        zset->pack = NULL;
+    }
     hm_clear(&zset->hmap);
+#ifdef USE_BTREE_ZSET
+    bt_clear(&zset->tree, &tree_dispose);
+#else
     tree_dispose(zset->root);
     zset->root = NULL;
-};
\ No newline at end of file
+#endif
+    zset->bytes = 0;
+    zset->hmap_bytes = 0;
+};
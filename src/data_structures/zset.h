@@ -2,16 +2,49 @@
 #define ZSET_H
 
 #include "avltree.h"
+#include "btree.h"
 #include "hashmap.h"
 
+// Built with USE_BTREE_ZSET (`make ZINDEX=btree`) large sets are ordered
+// by a B+tree instead of the AVL tree.
+
+// Small sets are packed: the members sorted by (score, name) in one
+// buffer, each as a score, a 16 bit length and the name, searched
+// linearly. Past either limit the set is converted to an AVL tree plus a
+// hashtable for good, like Redis' listpack encoding.
+extern uint32_t g_zset_pack_max_entries;
+extern uint32_t g_zset_pack_max_name;
+// whether a set packed up to these limits, and grown by half, keeps its
+// offsets within 32 bits
+bool zset_pack_limits_ok(uint32_t max_entries, uint32_t max_name);
+
+enum {
+    ZSET_PACKED = 0,
+    ZSET_TREE = 1,
+};
+
+struct ZPack;
+
 struct ZSet {
+    uint32_t encoding = ZSET_PACKED;
+    ZPack *pack = NULL;   // NULL when empty
+#ifdef USE_BTREE_ZSET
+    BTree tree;           // index by (score, name)
+#else
     AVLNode *root = NULL; // index by (scroe, name)
+#endif
     HMap    hmap; // index by name
+    // the member nodes and the hash slots, or the packed buffer, for memory
+    // accounting; updated by writes only
+    size_t bytes = 0;
+    size_t hmap_bytes = 0;  // the part of `bytes` for the hash slots
 };
 
 struct ZNode {
     // data structure nodes
+#ifndef USE_BTREE_ZSET
     AVLNode tree;
+#endif
     HNode hmap;
 
     // data
@@ -26,10 +59,45 @@ struct HKey{
     size_t len = 0;
 };
 
+// a position in (score, name) order, in either encoding
+struct ZIter {
+    ZSet *zset = NULL;
+#ifdef USE_BTREE_ZSET
+    BPos bpos;              // tree: no leaf past either end
+#else
+    ZNode *node = NULL;     // tree: NULL past either end
+#endif
+    uint32_t idx = 0;       // packed: the member index, the size past either end
+    uint32_t pos = 0;       // packed: its offset in the buffer
+};
+
+struct ZMember {
+    double score;
+    const char *name;
+    size_t len;
+};
+
+struct ThreadPool;
+
 bool zset_insert(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-void zset_delete(ZSet *zset, ZNode *node);
-ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
-ZNode *znode_offset(ZNode *node, int64_t offset);
+// adds or updates n members, the last of a repeated name wins; returns the
+// number added. A batch at least as large as the set rebuilds the tree in
+// O(n) from the sorted members, sorted on `pool` when large (NULL: inline).
+size_t zset_insert_bulk(ZSet *zset, const ZMember *members, size_t n, ThreadPool *pool);
+bool zset_remove(ZSet *zset, const char *name, size_t len);
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score);
+size_t zset_size(ZSet *zset);
 void zset_clear(ZSet *zset);
-#endif
\ No newline at end of file
+
+ZIter zset_seekge(ZSet *zset, double score, const char *name, size_t len);
+bool zset_iter_ok(const ZIter *it);
+void zset_iter_offset(ZIter *it, int64_t offset);
+ZMember zset_iter_get(const ZIter *it);
+
+// ranks count from 0 in (score, name) order, in O(log n) for the trees
+int64_t zset_rank(ZSet *zset, const char *name, size_t len);   // -1 if absent
+ZIter zset_at(ZSet *zset, int64_t rank);
+int64_t zset_iter_rank(const ZIter *it);    // the size past either end
+// the sum of the scores of the ranks [lo, hi), from the subtree sums
+double zset_range_sum(ZSet *zset, int64_t lo, int64_t hi);
+#endif
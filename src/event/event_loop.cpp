@@ -0,0 +1,324 @@
+#include "event_loop.h"
+#include "buffer_operations.h"
+#include "log_utils.h"
+#include "server_config.h"
+
+#include <assert.h>
+#include <sys/socket.h>
+
+const size_t k_max_epoll_events = 1024;
+
+// the interest set derived from the application's intent
+static uint32_t conn_interest(Conn *conn){
+    uint32_t mask = 0;
+    if(conn->want_read){
+        mask |= EV_READ;
+    }
+    if(conn->want_write){
+        mask |= EV_WRITE;
+    }
+    return mask;
+};
+
+#ifdef __linux__
+static uint32_t epoll_flags(EventLoop *loop, uint32_t mask){
+    if(loop->backend == EV_EPOLL_ET){
+        // edge-triggered: always watch both directions, the
+        // readiness is cached in `Conn::io_ready` until EAGAIN
+        return EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    }
+    uint32_t flags = 0;
+    if(mask & EV_READ){
+        flags |= EPOLLIN;
+    }
+    if(mask & EV_WRITE){
+        flags |= EPOLLOUT;
+    }
+    return flags;
+};
+
+static void epoll_ctl_fd(EventLoop *loop, int op, int fd, uint32_t flags){
+    struct epoll_event ev = {};
+    ev.events = flags;
+    ev.data.fd = fd;
+    if(epoll_ctl(loop->epfd, op, fd, &ev) < 0){
+        die("epoll_ctl()");
+    }
+};
+#endif
+
+const char *ev_backend_name(uint32_t backend){
+    switch(backend){
+        case EV_EPOLL: return "epoll";
+        case EV_EPOLL_ET: return "epoll-et";
+        case EV_IO_URING: return "io_uring";
+        default: return "poll";
+    }
+};
+
+bool ev_init(EventLoop *loop, uint32_t backend, int listen_fd, int wake_fd){
+    loop->listen_fd = listen_fd;
+    loop->wake_fd = wake_fd;
+    loop->backend = EV_POLL;
+    if(backend == EV_POLL){
+        return true;
+    }
+    if(backend == EV_IO_URING){
+#ifdef USE_IO_URING
+        if(!uring_init(&loop->ring, k_uring_entries, k_uring_bufs, k_uring_buf_size)){
+            msg("io_uring is not usable, falling back to epoll");
+            return false;
+        }
+        loop->backend = EV_IO_URING;
+        ev_uring_accept(loop);
+        ev_uring_wake(loop);
+        return true;
+#else
+        msg("built without io_uring (IO_URING=1), falling back to epoll");
+        return false;
+#endif
+    }
+#ifdef __linux__
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd < 0){
+        msg_errno("epoll_create1() error, falling back to poll()");
+        return false;
+    }
+    loop->backend = backend;
+    loop->events.resize(k_max_epoll_events);
+    uint32_t flags = EPOLLIN;
+    if(backend == EV_EPOLL_ET){
+        flags |= EPOLLET;
+    }
+    epoll_ctl_fd(loop, EPOLL_CTL_ADD, listen_fd, flags);
+    epoll_ctl_fd(loop, EPOLL_CTL_ADD, wake_fd, EPOLLIN);
+    return true;
+#else
+    msg("epoll is not available, falling back to poll()");
+    return false;
+#endif
+};
+
+#ifdef USE_IO_URING
+static uint64_t ur_data(Conn *conn, uint64_t op){
+    return (uint64_t)(uintptr_t)conn | op;
+};
+
+// multishot receive into the provided buffer ring
+static void ev_uring_recv(EventLoop *loop, Conn *conn){
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = k_uring_bgid;
+    sqe->user_data = ur_data(conn, UR_RECV);
+    conn->refs++;
+    conn->uring_recv = true;
+};
+
+// `outgoing` must not be touched until the send completes; one segment
+// at a time, a large value is sent from the keyspace without a copy
+static void ev_uring_send(EventLoop *loop, Conn *conn){
+    struct iovec seg;
+    buf_iov(conn->outgoing, &seg, 1);
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)seg.iov_base;
+    sqe->len = (uint32_t)seg.iov_len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ur_data(conn, UR_SEND);
+    conn->refs++;
+    conn->uring_send = true;
+};
+
+static void ev_uring_cancel(EventLoop *loop, Conn *conn){
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ur_data(conn, UR_RECV);
+    sqe->user_data = UR_CANCEL;
+};
+
+// multishot accept on the listening socket
+void ev_uring_accept(EventLoop *loop){
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UR_ACCEPT;
+};
+
+// multishot poll on the mailbox
+void ev_uring_wake(EventLoop *loop){
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = UR_WAKE;
+};
+#else
+void ev_uring_accept(EventLoop *){
+    assert(!"built without io_uring");
+};
+
+void ev_uring_wake(EventLoop *){
+    assert(!"built without io_uring");
+};
+#endif
+
+bool ev_edge_triggered(EventLoop *loop){
+    return loop->backend == EV_EPOLL_ET;
+};
+
+void ev_watch(EventLoop *loop, Conn *conn){
+    conn->ev_mask = conn_interest(conn);
+#ifdef USE_IO_URING
+    if(loop->backend == EV_IO_URING){
+        return ev_uring_recv(loop, conn);
+    }
+#endif
+#ifdef __linux__
+    if(loop->backend != EV_POLL){
+        epoll_ctl_fd(loop, EPOLL_CTL_ADD, conn->fd, epoll_flags(loop, conn->ev_mask));
+    }
+#else
+    (void)loop;
+#endif
+};
+
+// only touch the kernel when `want_read` or `want_write` flipped
+void ev_update(EventLoop *loop, Conn *conn){
+#ifdef USE_IO_URING
+    if(loop->backend == EV_IO_URING){
+        // sends are queued here and submitted together at the next wait
+        if(conn->want_write && !conn->uring_send){
+            ev_uring_send(loop, conn);
+        }
+        return;
+    }
+#endif
+    uint32_t mask = conn_interest(conn);
+    if(mask == conn->ev_mask){
+        return;
+    }
+    conn->ev_mask = mask;
+#ifdef __linux__
+    if(loop->backend == EV_EPOLL){
+        epoll_ctl_fd(loop, EPOLL_CTL_MOD, conn->fd, epoll_flags(loop, mask));
+    }
+#else
+    (void)loop;
+#endif
+};
+
+void ev_unwatch(EventLoop *loop, Conn *conn){
+#ifdef USE_IO_URING
+    if(loop->backend == EV_IO_URING){
+        // the receive stays armed until cancelled
+        if(conn->uring_recv){
+            ev_uring_cancel(loop, conn);
+        }
+        // the fd is closed next and may be reused by the next accept; the
+        // kernel resolves it at submission, so whatever still names it
+        // goes out now, while it is this socket
+        if(uring_submit_and_wait(&loop->ring, 0) < 0){
+            die("io_uring_enter()");
+        }
+        return;
+    }
+#endif
+#ifdef __linux__
+    if(loop->backend != EV_POLL){
+        epoll_ctl_fd(loop, EPOLL_CTL_DEL, conn->fd, 0);
+    }
+#else
+    (void)loop;
+#endif
+    conn->ev_mask = 0;
+};
+
+static int poll_wait(EventLoop *loop, const std::vector<Conn *> &fd2conn, int32_t timeout_ms){
+    std::vector<struct pollfd> &poll_args = loop->poll_args;
+    poll_args.clear();
+    // put the listening socket in the first position
+    struct pollfd pfd = {loop->listen_fd, POLLIN, 0};
+    poll_args.push_back(pfd);
+    struct pollfd wake = {loop->wake_fd, POLLIN, 0};
+    poll_args.push_back(wake);
+    // the rest are connection sockets
+    for(Conn *conn : fd2conn){
+        if(!conn){
+            continue;
+        }
+        // always poll for error
+        struct pollfd pfd = {conn->fd, POLLERR, 0};
+        // poll() flags from the application's intent
+        if(conn->want_read){
+            pfd.events |= POLLIN;
+        }
+        if(conn->want_write){
+            pfd.events |= POLLOUT;
+        }
+        poll_args.push_back(pfd);
+    }
+
+    int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+    if(rv <= 0){
+        return rv;
+    }
+
+    for(const struct pollfd &pfd : poll_args){
+        if(pfd.revents == 0){
+            continue;
+        }
+        ReadyEvent ev;
+        ev.fd = pfd.fd;
+        if(pfd.revents & POLLIN){
+            ev.events |= EV_READ;
+        }
+        if(pfd.revents & POLLOUT){
+            ev.events |= EV_WRITE;
+        }
+        if(pfd.revents & POLLERR){
+            ev.events |= EV_ERR;
+        }
+        loop->ready.push_back(ev);
+    }
+    return (int)loop->ready.size();
+};
+
+#ifdef __linux__
+static int epoll_wait_ready(EventLoop *loop, int32_t timeout_ms){
+    int rv = epoll_wait(loop->epfd, loop->events.data(), (int)loop->events.size(), timeout_ms);
+    for(int i = 0; i < rv; ++i){
+        const struct epoll_event &ev = loop->events[i];
+        ReadyEvent ready;
+        ready.fd = ev.data.fd;
+        // a hangup is reported as readable so that read() sees the EOF
+        if(ev.events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)){
+            ready.events |= EV_READ;
+        }
+        if(ev.events & EPOLLOUT){
+            ready.events |= EV_WRITE;
+        }
+        if(ev.events & EPOLLERR){
+            ready.events |= EV_ERR;
+        }
+        loop->ready.push_back(ready);
+    }
+    return rv;
+};
+#endif
+
+int ev_wait(EventLoop *loop, const std::vector<Conn *> &fd2conn, int32_t timeout_ms){
+    loop->ready.clear();
+#ifdef __linux__
+    if(loop->backend != EV_POLL){
+        return epoll_wait_ready(loop, timeout_ms);
+    }
+#endif
+    return poll_wait(loop, fd2conn, timeout_ms);
+};
@@ -0,0 +1,75 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "server_common.h"
+
+#include <poll.h>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "uring.h"
+
+// event loop backends
+enum {
+    EV_POLL = 0,        // rebuild the pollfd array on every iteration
+    EV_EPOLL = 1,       // epoll, level-triggered
+    EV_EPOLL_ET = 2,    // epoll, edge-triggered
+    EV_IO_URING = 3,    // io_uring, completion-based (IO_URING=1 builds)
+};
+
+// backend independent readiness flags
+enum {
+    EV_READ = 1,
+    EV_WRITE = 2,
+    EV_ERR = 4,
+};
+
+struct ReadyEvent {
+    int fd = -1;
+    uint32_t events = 0;
+};
+
+struct EventLoop {
+    uint32_t backend = EV_POLL;
+    int listen_fd = -1;
+    int wake_fd = -1;   // the reactor's mailbox
+    // the ready sockets of the last ev_wait()
+    std::vector<ReadyEvent> ready;
+    // poll()
+    std::vector<struct pollfd> poll_args;
+#ifdef __linux__
+    // epoll
+    int epfd = -1;
+    std::vector<struct epoll_event> events;
+#endif
+#ifdef USE_IO_URING
+    URing ring;
+    // conns whose receive ended, armed again after the batch of
+    // completions unless one of them closed the conn
+    std::vector<Conn *> rearm;
+#endif
+};
+
+// io_uring `user_data` tags, or'ed into the `Conn` pointer
+enum {
+    UR_CANCEL = 0,
+    UR_ACCEPT = 1,
+    UR_RECV = 2,
+    UR_SEND = 3,
+    UR_WAKE = 4,
+    UR_MASK = 7,
+};
+
+bool ev_init(EventLoop *loop, uint32_t backend, int listen_fd, int wake_fd);
+bool ev_edge_triggered(EventLoop *loop);
+void ev_watch(EventLoop *loop, Conn *conn);
+void ev_update(EventLoop *loop, Conn *conn);
+void ev_unwatch(EventLoop *loop, Conn *conn);
+int ev_wait(EventLoop *loop, const std::vector<Conn *> &fd2conn, int32_t timeout_ms);
+const char *ev_backend_name(uint32_t backend);
+void ev_uring_accept(EventLoop *loop);
+void ev_uring_wake(EventLoop *loop);
+
+#endif
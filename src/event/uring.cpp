@@ -0,0 +1,246 @@
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+#include "log_utils.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+};
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+};
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nargs){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+};
+
+// the opcodes the event loop submits
+static bool uring_probe(URing *ring){
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, sz);
+    bool ok = sys_register(ring->ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const uint8_t ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD,
+    };
+    for(size_t i = 0; ok && i < sizeof(ops); ++i){
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+};
+
+// multishot receives (6.0) are a flag of IORING_OP_RECV, which the probe
+// can't see; an older kernel fails them with EINVAL
+static bool uring_multishot_recv(){
+    struct utsname un;
+    int major = 0;
+    if(uname(&un) != 0 || sscanf(un.release, "%d.", &major) != 1){
+        return false;
+    }
+    return major >= 6;
+};
+
+static bool uring_setup_bufs(URing *ring, uint32_t buf_count, uint32_t buf_size){
+    assert(buf_count > 0 && ((buf_count - 1) & buf_count) == 0);
+    size_t ring_sz = buf_count * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, ring_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED){
+        return false;
+    }
+    ring->buf_ring = (struct io_uring_buf_ring *)mem;
+    ring->buf_ring_size = ring_sz;
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    ring->bufs = (uint8_t *)malloc((size_t)buf_count * buf_size);
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = buf_count;
+    reg.bgid = k_uring_bgid;
+    if(sys_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        return false;
+    }
+    for(uint32_t bid = 0; bid < buf_count; ++bid){
+        uring_buf_recycle(ring, (uint16_t)bid);
+    }
+    return true;
+};
+
+// undoes a partial uring_setup()
+static void uring_free(URing *ring){
+    if(ring->buf_ring){
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->bufs);
+    if(ring->sqes){
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if(ring->ring_mem){
+        munmap(ring->ring_mem, ring->ring_size);
+    }
+    if(ring->ring_fd >= 0){
+        (void)close(ring->ring_fd);
+    }
+    *ring = URing();
+};
+
+static bool uring_setup(URing *ring, unsigned entries, uint32_t buf_count, uint32_t buf_size){
+    struct io_uring_params p = {};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;     // multishot requests complete many times
+    int fd = sys_setup(entries, &p);
+    if(fd < 0){
+        msg_errno("io_uring_setup() error");
+        return false;
+    }
+    ring->ring_fd = fd;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)){
+        msg("io_uring: kernel is too old");
+        return false;
+    }
+
+    // the SQ and CQ rings share one mapping
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    uint8_t *ptr = (uint8_t *)mmap(NULL, ring_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ptr == MAP_FAILED){
+        msg_errno("io_uring: mmap() error");
+        return false;
+    }
+    ring->ring_mem = ptr;
+    ring->ring_size = ring_sz;
+    ring->sq_head = (unsigned *)(ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned *)(ptr + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)(ptr + p.sq_off.ring_mask);
+    ring->cq_head = (unsigned *)(ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED){
+        msg_errno("io_uring: mmap() error");
+        return false;
+    }
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    ring->sq_entries = p.sq_entries;
+
+    if(!uring_probe(ring)){
+        msg("io_uring: required opcodes are not supported");
+        return false;
+    }
+    if(!uring_multishot_recv()){
+        msg("io_uring: multishot receives need linux 6.0");
+        return false;
+    }
+    if(!uring_setup_bufs(ring, buf_count, buf_size)){
+        msg_errno("io_uring: cannot register the provided buffer ring");
+        return false;
+    }
+    return true;
+};
+
+// on failure nothing is left open or mapped, the caller falls back
+bool uring_init(URing *ring, unsigned entries, uint32_t buf_count, uint32_t buf_size){
+    if(!uring_setup(ring, entries, buf_count, buf_size)){
+        uring_free(ring);
+        return false;
+    }
+    return true;
+};
+
+// the SQEs are only handed to the kernel by uring_submit_and_wait(),
+// so everything prepared in one loop tick goes out in one syscall
+struct io_uring_sqe *uring_get_sqe(URing *ring){
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if(tail - head >= ring->sq_entries){
+        // full, flush without waiting
+        if(uring_submit_and_wait(ring, 0) < 0){
+            die("io_uring_enter()");
+        }
+        tail = *ring->sq_tail;
+    }
+    unsigned idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+    return sqe;
+};
+
+int uring_submit_and_wait(URing *ring, int32_t timeout_ms){
+    unsigned to_submit = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    unsigned flags = 0;
+    unsigned min_complete = 0;
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if(timeout_ms != 0){
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        min_complete = 1;
+        arg.sigmask_sz = _NSIG / 8;
+        if(timeout_ms > 0){
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000 * 1000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    int rv = sys_enter(ring->ring_fd, to_submit, min_complete, flags,
+        flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+    if(rv < 0 && errno == ETIME){
+        return 0;   // timed out
+    }
+    return rv;
+};
+
+struct io_uring_cqe *uring_peek_cqe(URing *ring){
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+};
+
+void uring_cqe_seen(URing *ring){
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+};
+
+uint8_t *uring_buf(URing *ring, uint16_t bid){
+    return ring->bufs + (size_t)bid * ring->buf_size;
+};
+
+// give a buffer back to the kernel
+void uring_buf_recycle(URing *ring, uint16_t bid){
+    struct io_uring_buf_ring *br = ring->buf_ring;
+    uint16_t tail = br->tail;
+    // not `br->bufs`: the flexible array member is offset differently in C++
+    struct io_uring_buf *buf = (struct io_uring_buf *)br + (tail & (ring->buf_count - 1));
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+};
+
+#endif // USE_IO_URING
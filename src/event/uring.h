@@ -0,0 +1,53 @@
+#ifndef URING_H
+#define URING_H
+
+// A minimal io_uring wrapper on top of the raw syscalls, enabled by
+// building with IO_URING=1. Only what the server needs is covered:
+// one submission/completion ring pair and one provided-buffer ring.
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct URing {
+    int ring_fd = -1;
+    // the mapping shared by the SQ and CQ rings
+    void *ring_mem = NULL;
+    size_t ring_size = 0;
+    // submission queue
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned *sq_array = NULL;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_pending = 0;    // prepared but not yet submitted
+    struct io_uring_sqe *sqes = NULL;
+    // completion queue
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+    // provided buffers for multishot receives
+    struct io_uring_buf_ring *buf_ring = NULL;
+    size_t buf_ring_size = 0;
+    uint8_t *bufs = NULL;
+    uint32_t buf_count = 0;
+    uint32_t buf_size = 0;
+};
+
+// the buffer group used for receives
+const uint16_t k_uring_bgid = 0;
+
+bool uring_init(URing *ring, unsigned entries, uint32_t buf_count, uint32_t buf_size);
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+int uring_submit_and_wait(URing *ring, int32_t timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+uint8_t *uring_buf(URing *ring, uint16_t bid);
+void uring_buf_recycle(URing *ring, uint16_t bid);
+
+#endif // USE_IO_URING
+
+#endif
@@ -11,16 +11,26 @@ bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out){
     return true;
 };
 
-bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out){
-    if(cur + n > end){
+bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string_view &out){
+    if(n > (size_t)(end - cur)){
         return false;
     }
-    out.assign(cur, cur + n);
+    out = std::string_view((const char *)cur, n);
     cur+=n;
     return true;
 };
 
-int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out){
+void args_push(CmdArgs &args, std::string_view arg){
+    if(args.n < k_inline_args){
+        args.inline_args[args.n] = arg;
+    } else {
+        args.spill.push_back(arg);
+    }
+    args.n++;
+};
+
+// no copies, the args point into `data`
+int32_t parse_req(const uint8_t *data, size_t size, CmdArgs &out){
     const uint8_t *end = data + size;
     uint32_t nstr = 0;
     if(!read_u32(data, end, nstr)){
@@ -36,10 +46,11 @@ int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &ou
         if(!read_u32(data, end, len)){
             return -1;
         }
-        out.push_back(std::string());
-        if(!read_str(data, end, len, out.back())){
+        std::string_view arg;
+        if(!read_str(data, end, len, arg)){
             return -1;
         }
+        args_push(out, arg);
     }
     if (data != end){
         return -1; // trailing garbage
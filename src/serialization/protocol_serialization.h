@@ -3,10 +3,26 @@
 
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include "server_common.h"
+#include "server_config.h"
+
+// The arguments of one request, viewing the receive buffer; only valid
+// until the request is consumed. Most commands fit in the inline array.
+struct CmdArgs {
+    std::string_view inline_args[k_inline_args];
+    std::vector<std::string_view> spill;    // the rest of a long command
+    size_t n = 0;
+
+    size_t size() const { return n; }
+    std::string_view operator[](size_t i) const {
+        return i < k_inline_args ? inline_args[i] : spill[i - k_inline_args];
+    }
+};
 
 bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out);
-bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out);
-int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out);
+bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string_view &out);
+void args_push(CmdArgs &args, std::string_view arg);
+int32_t parse_req(const uint8_t *data, size_t size, CmdArgs &out);
 
-#endif
\ No newline at end of file
+#endif
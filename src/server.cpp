@@ -7,18 +7,31 @@
 #include "server_config.h"
 #include "socket_utils.h"
 #include "hashmap.h"
+#include "hash.h"
 #include "DList.h"
 #include "utils/timer.h"
 #include "heap.h"
+#include "event_loop.h"
+#include "reactor.h"
+#include "slab.h"
+#include "eviction.h"
+#include "zset.h"
 
 #include <sys/socket.h>
-#include <poll.h>
 #include <assert.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <signal.h>
 
 
 static int32_t next_timer_ms(){
+    // keep evicting without waiting
+    if(evict_pending()){
+        return 0;
+    }
     uint64_t now_ms = get_monotonic_msec();
     uint64_t next_ms = (uint64_t)-1;
 
@@ -28,9 +41,21 @@ static int32_t next_timer_ms(){
         next_ms = conn->last_active_ms + k_idle_timeout_ms;        
     }
 
-    // TTL timers using a heap
-    if(!g_data.heap.empty() && g_data.heap[0].val < next_ms){
-        next_ms = g_data.heap[0].val;
+    // TTL timers using a heap or the timing wheel
+    uint64_t ttl_ms = ttl_next_ms();
+    if(ttl_ms < next_ms){
+        next_ms = ttl_ms;
+    }
+
+    // blocked pops
+    uint64_t wait_ms = tw_next(&g_data.zwait_timers);
+    if(wait_ms < next_ms){
+        next_ms = wait_ms;
+    }
+
+    // a background save to reap
+    if(g_data.save.child > 0 && now_ms + k_bgsave_poll_ms < next_ms){
+        next_ms = now_ms + k_bgsave_poll_ms;
     }
 
     // timeout value
@@ -46,53 +71,241 @@ static int32_t next_timer_ms(){
 };
 
 static void conn_destroy(Conn *conn){
+    ev_unwatch(&g_data.loop, conn);
     (void)close(conn->fd);
     g_data.fd2conn[conn->fd] = NULL;
     dlist_detach(&conn->idle_node);
-    delete conn;
-};
-
-static bool hnode_same(HNode *node, HNode *key){
-    return node == key;
+    conn->fd = -1;
+    conn->closed = true;
+    // a blocking pop without a timeout would wait for it forever
+    if(conn->blocked){
+        reactor_cancel(conn);
+    }
+    // freed by the last in-flight completion or forwarded command instead
+    if(conn->refs == 0){
+        conn_free(conn);
+    }
 };
 
 static void process_timers(){
+    // objects freed into our slabs by other threads
+    slab_collect();
+    // over maxmemory, a bounded amount of work per iteration
+    evict_cycle();
+
     uint64_t now_ms = get_monotonic_msec();
-    while(!dlist_empty(&g_data.idle_list)){
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
-        uint64_t next_ms = conn->last_active_ms + k_idle_timeout_ms;
-        if(next_ms >= now_ms){
-            break; // not expired
+    while(Conn *conn = conn_idle_expired(now_ms)){
+        fprintf(stderr, "removing idle connection: %d\n", conn->fd);
+        conn_destroy(conn);
+    }
+
+    // TTL timers using a heap or the timing wheel, under a time budget
+    expire_cycle();
+    // blocked pops past their timeout
+    zwait_expire(now_ms);
+    // a finished background save
+    bgsave_check();
+};
+
+// update the idle timer by moving the conn to the end of the list; a
+// blocked conn stays off it until conn_resume()
+static void conn_active(Conn *conn){
+    conn->last_active_ms = get_monotonic_msec();
+    if(!conn->blocked){
+        dlist_detach(&conn->idle_node);
+        dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    }
+};
+
+// handle IO for a ready connection
+static void handle_conn(Conn *conn, uint32_t ready){
+    conn_active(conn);
+
+    if(ev_edge_triggered(&g_data.loop)){
+        // the readiness stays valid until the socket returns EAGAIN
+        conn->io_ready |= ready;
+        while(!conn->want_close){
+            if(conn->want_read && (conn->io_ready & EV_READ)){
+                handle_read(conn);
+            } else if(conn->want_write && (conn->io_ready & EV_WRITE)){
+                handle_write(conn);
+            } else {
+                break;
+            }
+        }
+    } else {
+        // a paused conn is still read: pipelined requests queue up behind
+        // the one it waits for, and a hangup closes it
+        if((ready & EV_READ) && conn->want_read){
+            handle_read(conn); // app logic
+        }
+        if((ready & EV_WRITE) && conn->want_write){
+            handle_write(conn); // app logic
         }
+    }
 
-        fprintf(stderr, "removing idle connection: %d\n", conn->fd);
+    // handle closing socket due to error or app logic
+    if((ready & EV_ERR) || conn->want_close){
         conn_destroy(conn);
+        return;
+    }
+    ev_update(&g_data.loop, conn);
+};
+
+// a paused conn got the response from another reactor
+static void conn_resumed(Conn *conn){
+    handle_conn(conn, 0);
+};
+
+#ifdef USE_IO_URING
+static void uring_handle_cqe(uint64_t user_data, int32_t res, uint32_t flags){
+    URing *ring = &g_data.loop.ring;
+    uint64_t op = user_data & UR_MASK;
+    Conn *conn = (Conn *)(uintptr_t)(user_data & ~(uint64_t)UR_MASK);
+    bool more = flags & IORING_CQE_F_MORE;
+
+    if(op == UR_CANCEL){
+        return;
+    } else if(op == UR_WAKE){
+        reactor_drain(&conn_resumed);
+        if(!more){
+            ev_uring_wake(&g_data.loop); // re-arm
+        }
+        return;
+    } else if(op == UR_ACCEPT){
+        if(res >= 0){
+            ev_watch(&g_data.loop, uring_handle_accept(res));
+        }
+        if(!more){
+            ev_uring_accept(&g_data.loop); // re-arm
+        }
+        return;
     }
 
-    // TTL timers using a heap
+    bool alive = conn->fd >= 0;
+    if(op == UR_RECV){
+        if(flags & IORING_CQE_F_BUFFER){
+            uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if(alive && res > 0){
+                conn_active(conn);
+                uring_handle_recv(conn, uring_buf(ring, bid), (size_t)res);
+            }
+            uring_buf_recycle(ring, bid);
+        }
+        if(alive && (res == 0 || (res < 0 && res != -ENOBUFS))){
+            conn->want_close = true;    // EOF or error
+        }
+        if(!more){
+            conn->uring_recv = false;
+        }
+    } else if(op == UR_SEND){
+        conn->uring_send = false;
+        if(alive && res < 0){
+            conn->want_close = true;
+        } else if(alive){
+            uring_handle_send(conn, (size_t)res);
+        }
+    }
+
+    if(alive){
+        if(conn->want_close){
+            conn_destroy(conn);
+        } else {
+            if(op == UR_RECV && !conn->uring_recv){
+                // re-arm, e.g. after -ENOBUFS, once the batch is done
+                conn->refs++;
+                g_data.loop.rearm.push_back(conn);
+            }
+            ev_update(&g_data.loop, conn);
+        }
+    }
+    if(op == UR_SEND || !more){
+        conn_unref(conn);
+    }
+};
 
-    size_t nworks = 0;
-    const std::vector<HeapItem> &heap = g_data.heap;
-    while(!heap.empty() && heap[0].val < now_ms){
-        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
-        assert(node == &ent->node);
-        fprintf(stderr, "key expired: %s\n", ent->key.c_str());
-        // delete the key
-        entry_del(ent);
-        if(nworks++ >= k_max_works){
-            // don't stall the server if too many keys are expiring at once
+// submit everything queued in the last tick, then wait for completions
+static void uring_loop_once(int32_t timeout_ms){
+    URing *ring = &g_data.loop.ring;
+    int rv = uring_submit_and_wait(ring, timeout_ms);
+    if(rv < 0 && errno != EINTR){
+        die("io_uring_enter()");
+    }
+    while(struct io_uring_cqe *cqe = uring_peek_cqe(ring)){
+        uint64_t user_data = cqe->user_data;
+        int32_t res = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_cqe_seen(ring);
+        uring_handle_cqe(user_data, res, flags);
+    }
+    for(Conn *conn : g_data.loop.rearm){
+        if(conn->fd >= 0 && !conn->uring_recv){
+            ev_watch(&g_data.loop, conn);
+        }
+        conn_unref(conn);
+    }
+    g_data.loop.rearm.clear();
+};
+#endif
+
+static void accept_conns(int fd){
+    // with epoll, accept until the backlog is drained
+    bool drain = g_data.loop.backend != EV_POLL;
+    do {
+        Conn *conn = handle_accept(fd);
+        if(!conn){
             break;
         }
+        ev_watch(&g_data.loop, conn);
+    } while(drain);
+};
+
+static uint32_t parse_backend(const char *name){
+    if(strcmp(name, "poll") == 0){
+        return EV_POLL;
+    } else if(strcmp(name, "epoll") == 0){
+        return EV_EPOLL;
+    } else if(strcmp(name, "epoll-et") == 0){
+        return EV_EPOLL_ET;
+    } else if(strcmp(name, "io_uring") == 0){
+        return EV_IO_URING;
     }
+    fprintf(stderr, "unknown event loop: %s\n", name);
+    exit(1);
 };
 
-int main(){
+static uint32_t parse_timers(const char *name){
+    if(strcmp(name, "heap") == 0){
+        return TIMERS_HEAP;
+    } else if(strcmp(name, "wheel") == 0){
+        return TIMERS_WHEEL;
+    }
+    fprintf(stderr, "unknown timer engine: %s\n", name);
+    exit(1);
+};
 
-    // initialization
-    dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.thread_pool, 4);
+// bytes, with an optional kb/mb/gb suffix
+static size_t parse_memory(const char *str){
+    char *endp = NULL;
+    unsigned long long val = strtoull(str, &endp, 10);
+    if(endp == str){
+        fprintf(stderr, "bad memory size: %s\n", str);
+        exit(1);
+    }
+    if(strcasecmp(endp, "kb") == 0){
+        val <<= 10;
+    } else if(strcasecmp(endp, "mb") == 0){
+        val <<= 20;
+    } else if(strcasecmp(endp, "gb") == 0){
+        val <<= 30;
+    } else if(*endp){
+        fprintf(stderr, "bad memory size: %s\n", str);
+        exit(1);
+    }
+    return (size_t)val;
+};
 
+static int listen_socket(bool reuseport){
     // the listenin socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -105,6 +318,10 @@ int main(){
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) == -1 ){
         die("setsockopt()");
     }
+    // every reactor binds its own listener, the kernel spreads the connections
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == -1 ){
+        die("setsockopt()");
+    }
 
     // bind
     struct sockaddr_in addr = {};
@@ -124,38 +341,129 @@ int main(){
     if(rv){
         die("listen()");
     }
-    
-    // the event loop
-    std::vector<struct pollfd> poll_args;
-
-    while(true){
-        //prepare the argument for the poll()
-        poll_args.clear();
-        // put the listening socket in the first position
-        struct pollfd pfd = {fd, POLLIN, 0}; //POLLIN or POLLIN
-        poll_args.push_back(pfd);
-        // the rest are connection sockets
-        for (Conn *conn : g_data.fd2conn){
-            if(!conn){
-                continue;
-            }
+    return fd;
+};
 
-            // always poll for error
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
-            // poll() flags from the application's intent
-            if(conn->want_read){
-                pfd.events |= POLLIN;
-            }
-            if(conn->want_write){
-                pfd.events |= POLLOUT;
-            }
+static ThreadPool g_thread_pool;
+static uint32_t g_backend = EV_POLL;
+static uint32_t g_timers = TIMERS_HEAP;
+static size_t g_maxmemory = 0;
+static uint32_t g_evict_policy = EVICT_NOEVICTION;
+static size_t g_io_threads = 1;  // counting the event loop
+static size_t g_threads = 0;     // 0: one per core
+static const char *g_dbfilename = "dump.rdb";
+
+// --io-threads: the sockets of the ready connections are read and written
+// on the I/O threads, in two rounds around the commands run here
+struct IORound {
+    std::vector<ReadyEvent> ready;  // of conns, taken before the mailbox and accepts
+    std::vector<Conn *> conns;
+    std::vector<uint32_t> events;
+    std::vector<Conn *> reads;
+    std::vector<Conn *> writes;
+};
 
-            poll_args.push_back(pfd);
+static void handle_conns_threaded(IOThreads *io, IORound &r){
+    for(const ReadyEvent &ev : r.ready){
+        if(Conn *conn = g_data.fd2conn[ev.fd]){
+            r.conns.push_back(conn);
+            r.events.push_back(ev.events);
+        }
+    }
+    for(size_t i = 0; i < r.conns.size(); ++i){
+        Conn *conn = r.conns[i];
+        conn_active(conn);
+        if((r.events[i] & EV_READ) && conn->want_read){
+            r.reads.push_back(conn);
+        }
+    }
+    io_threads_run(io, r.reads, &conn_read_io);
+    for(Conn *conn : r.reads){
+        if(!conn->want_close){
+            handle_requests(conn);
+        }
+    }
+    // the responses, and any left from earlier rounds
+    for(Conn *conn : r.conns){
+        if(!conn->want_close && conn->want_write){
+            r.writes.push_back(conn);
         }
+    }
+    io_threads_run(io, r.writes, &conn_write_io);
+    for(Conn *conn : r.writes){
+        // requests pipelined behind the responses just sent
+        if(!conn->want_close && conn->want_read){
+            handle_requests(conn);
+        }
+    }
+    for(size_t i = 0; i < r.conns.size(); ++i){
+        Conn *conn = r.conns[i];
+        if((r.events[i] & EV_ERR) || conn->want_close){
+            conn_destroy(conn);
+        } else {
+            ev_update(&g_data.loop, conn);
+        }
+    }
+    r.ready.clear();
+    r.conns.clear();
+    r.events.clear();
+    r.reads.clear();
+    r.writes.clear();
+};
 
-        // wait for readiness
+// the event loop of one reactor
+static void *reactor_main(void *arg){
+    Reactor *reactor = (Reactor *)arg;
+
+    // initialization
+    g_data.shard_id = reactor->id;
+    g_data.thread_pool = &g_thread_pool;
+    dlist_init(&g_data.idle_list);
+    g_data.timers = g_timers;
+    // every shard gets an equal share of the limit
+    g_data.maxmemory = g_maxmemory / g_reactors.size();
+    g_data.evict_policy = g_evict_policy;
+    tw_init(&g_data.wheel, get_monotonic_msec());
+    tw_init(&g_data.zwait_timers, get_monotonic_msec());
+    // this shard's keys of the last snapshot, before any client is served
+    g_data.dbfilename = g_dbfilename;
+    db_load();
+
+    int fd = listen_socket(g_reactors.size() > 1);
+    int wake_fd = reactor->mailbox.wake_fd;
+
+    // the event loop, falling back from io_uring to epoll to poll()
+    uint32_t backend = g_backend;
+    while(!ev_init(&g_data.loop, backend, fd, wake_fd)){
+        backend = backend == EV_IO_URING ? EV_EPOLL : EV_POLL;
+    }
+    fprintf(stderr, "reactor %u, event loop: %s, timers: %s\n",
+        reactor->id, ev_backend_name(g_data.loop.backend),
+        g_data.timers == TIMERS_WHEEL ? "wheel" : "heap");
+
+    // a connection is handed over for one read or write per round, which
+    // an edge-triggered or completion-based loop can't use
+    bool threaded = g_io_threads > 1;
+    if(threaded && (ev_edge_triggered(&g_data.loop) || g_data.loop.backend == EV_IO_URING)){
+        fprintf(stderr, "reactor %u: --io-threads needs poll or epoll, ignored\n", reactor->id);
+        threaded = false;
+    }
+    if(threaded){
+        io_threads_init(&reactor->io, g_io_threads);
+    }
+    IORound round;
+
+    while(true){
         int32_t timeout_ms = next_timer_ms();
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+#ifdef USE_IO_URING
+        if(g_data.loop.backend == EV_IO_URING){
+            uring_loop_once(timeout_ms);
+            process_timers();
+            continue;
+        }
+#endif
+        // wait for readiness
+        int rv = ev_wait(&g_data.loop, g_data.fd2conn, timeout_ms);
         if (rv < 0 && errno == EINTR){
             continue; // not an error
         }
@@ -164,46 +472,138 @@ int main(){
             die("poll");
         }
 
-        // handle listening socket
-        if (poll_args[0].revents){
-           handle_accept(fd);
-        }
-
-        //handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); ++i){
-            uint32_t ready = poll_args[i].revents;
-            if(ready == 0){
+        // only the ready sockets are visited; the events name fds, so the
+        // listener and the mailbox, which may close conns and accept new
+        // ones on their fds, go after all the conns of the batch
+        bool accept_ready = false;
+        bool wake_ready = false;
+        for(const ReadyEvent &ev : g_data.loop.ready){
+            if(ev.fd == fd){
+                accept_ready = true;
+                continue;
+            }
+            if(ev.fd == wake_fd){
+                wake_ready = true;
                 continue;
             }
 
-            Conn *conn = g_data.fd2conn[poll_args[i].fd];
+            //handle connection sockets
+            Conn *conn = g_data.fd2conn[ev.fd];
+            if(conn && threaded){
+                // the I/O threads take them all at once, below
+                round.ready.push_back(ev);
+            } else if(conn){
+                handle_conn(conn, ev.events);
+            }
+        } // for each ready socket
+        if(threaded){
+            handle_conns_threaded(&reactor->io, round);
+        }
+        if(wake_ready){
+            // messages from other reactors
+            reactor_drain(&conn_resumed);
+        }
+        if(accept_ready){
+            // handle listening socket
+            accept_conns(fd);
+        }
 
-            // update the idle timer by moving the conn to the end of the list
+        //handle timers
+        process_timers();
+
+    }  // the event loop
+    return NULL;
+};
 
-            conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [--event-loop poll|epoll|epoll-et|io_uring]"
+        " [--reactors N] [--threads N] [--io-threads N] [--dbfilename PATH] [--timers heap|wheel] [--maxmemory BYTES[kb|mb|gb]]"
+        " [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]"
+        " [--zset-max-packed-entries N] [--zset-max-packed-value N]\n", prog);
+    exit(1);
+};
 
-            // handle IO
-            if (ready & POLLIN){
-                assert(conn->want_read);
-                handle_read(conn); // app logic
+int main(int argc, char **argv){
+    // command line options
+#ifdef __linux__
+    g_backend = EV_EPOLL;
+#endif
+    int nreactors = 1;
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "--event-loop") == 0 && i + 1 < argc){
+            g_backend = parse_backend(argv[++i]);
+        } else if(strcmp(argv[i], "--reactors") == 0 && i + 1 < argc){
+            nreactors = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            int n = atoi(argv[++i]);
+            if(n < 1){
+                usage(argv[0]);
             }
-            if(ready & POLLOUT){
-                assert(conn->want_write);
-                handle_write(conn); // app logic
+            g_threads = (size_t)n;
+        } else if(strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc){
+            int n = atoi(argv[++i]);
+            if(n < 1){
+                usage(argv[0]);
             }
-
-            // handle closing socket due to error or app logic
-            if((ready & POLLERR) || conn->want_close){
-                conn_destroy(conn);
+            g_io_threads = (size_t)n;
+        } else if(strcmp(argv[i], "--dbfilename") == 0 && i + 1 < argc){
+            g_dbfilename = argv[++i];
+        } else if(strcmp(argv[i], "--timers") == 0 && i + 1 < argc){
+            g_timers = parse_timers(argv[++i]);
+        } else if(strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc){
+            g_maxmemory = parse_memory(argv[++i]);
+        } else if(strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc){
+            if(!evict_policy_parse(argv[++i], &g_evict_policy)){
+                fprintf(stderr, "unknown maxmemory policy: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if(strcmp(argv[i], "--zset-max-packed-entries") == 0 && i + 1 < argc){
+            // a negative one would keep every set packed
+            char *endp = NULL;
+            long n = strtol(argv[++i], &endp, 10);
+            if(endp == argv[i] || *endp || n < 0 || n > (long)UINT32_MAX){
+                usage(argv[0]);
+            }
+            g_zset_pack_max_entries = (uint32_t)n;
+        } else if(strcmp(argv[i], "--zset-max-packed-value") == 0 && i + 1 < argc){
+            // the packed length is 16 bits
+            char *endp = NULL;
+            long len = strtol(argv[++i], &endp, 10);
+            if(endp == argv[i] || *endp || len < 0 || len > 65535){
+                usage(argv[0]);
             }
+            g_zset_pack_max_name = (uint32_t)len;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if(nreactors < 1){
+        usage(argv[0]);
+    }
+    if(!zset_pack_limits_ok(g_zset_pack_max_entries, g_zset_pack_max_name)){
+        fprintf(stderr, "--zset-max-packed-entries times --zset-max-packed-value is too large\n");
+        usage(argv[0]);
+    }
 
-        } // for each connection socket
+    // the peer may close before a response is written
+    signal(SIGPIPE, SIG_IGN);
 
-        //handle timers
-        process_timers();
+    // before any key is hashed
+    hash_seed(hash_random_seed());
 
-    }  // the event loop
+    // the last snapshot, split by shard while this is the only thread
+    reactors_init((uint32_t)nreactors);
+    db_load_read(g_dbfilename);
+
+    thread_pool_init(&g_thread_pool, g_threads ? g_threads : thread_pool_default_size());
+
+    // reactor 0 runs on the main thread
+    for(int i = 1; i < nreactors; ++i){
+        int rv = pthread_create(&g_reactors[i]->thread, NULL, &reactor_main, g_reactors[i]);
+        if(rv){
+            die("pthread_create()");
+        }
+    }
+    reactor_main(g_reactors[0]);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,5 @@
 #include "socket_utils.h"
 
 void fd_set_nb(int fd){
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0 | O_NONBLOCK));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include <assert.h>
+
+#include "io_threads.h"
+#include "thread_pool.h"
+
+// about a millisecond of polling before a thread parks
+const uint32_t k_io_spins = 1 << 14;
+// smaller rounds aren't worth the handoff
+const size_t k_io_min_per_thread = 2;
+
+struct IOThreadArg {
+    IOThreads *io;
+    IOThread *t;
+};
+
+static void *io_thread_main(void *arg){
+    IOThreadArg a = *(IOThreadArg *)arg;
+    delete (IOThreadArg *)arg;
+    uint64_t seen = 0;
+    while(true){
+        uint64_t round = a.t->round.load(std::memory_order_acquire);
+        for(uint32_t i = 0; round == seen && i < k_io_spins; ++i){
+            cpu_relax();
+            round = a.t->round.load(std::memory_order_acquire);
+        }
+        if(round == seen){
+            pthread_mutex_lock(&a.t->mu);
+            while((round = a.t->round.load(std::memory_order_acquire)) == seen){
+                a.t->parked = true;
+                pthread_cond_wait(&a.t->wake, &a.t->mu);
+            }
+            a.t->parked = false;
+            pthread_mutex_unlock(&a.t->mu);
+        }
+        seen = round;
+
+        for(Conn *conn : a.t->conns){
+            a.io->f(conn);
+        }
+        a.io->left.fetch_sub(1, std::memory_order_release);
+    }
+    return NULL;
+};
+
+void io_threads_init(IOThreads *io, size_t n){
+    assert(n > 0);
+    for(size_t i = 1; i < n; ++i){
+        IOThread *t = new IOThread();
+        pthread_mutex_init(&t->mu, NULL);
+        pthread_cond_init(&t->wake, NULL);
+        io->threads.push_back(t);
+        int rv = pthread_create(&t->thread, NULL, &io_thread_main, new IOThreadArg{io, t});
+        assert(rv == 0);
+    }
+};
+
+void io_threads_run(IOThreads *io, std::vector<Conn *> &conns, void (*f)(Conn *conn)){
+    size_t n = io->threads.size() + 1;
+    if(conns.size() < n * k_io_min_per_thread){
+        for(Conn *conn : conns){
+            f(conn);
+        }
+        return;
+    }
+    // round robin, every n-th one stays on the loop thread
+    for(IOThread *t : io->threads){
+        t->conns.clear();
+    }
+    for(size_t i = 0; i < conns.size(); ++i){
+        if(i % n != 0){
+            io->threads[i % n - 1]->conns.push_back(conns[i]);
+        }
+    }
+    io->f = f;
+    io->left.store((uint32_t)io->threads.size(), std::memory_order_relaxed);
+    for(IOThread *t : io->threads){
+        t->round.fetch_add(1, std::memory_order_release);
+        // the thread checks `round` under the lock before it waits
+        pthread_mutex_lock(&t->mu);
+        if(t->parked){
+            pthread_cond_signal(&t->wake);
+        }
+        pthread_mutex_unlock(&t->mu);
+    }
+    for(size_t i = 0; i < conns.size(); i += n){
+        f(conns[i]);
+    }
+    while(io->left.load(std::memory_order_acquire) > 0){
+        cpu_relax();
+    }
+};
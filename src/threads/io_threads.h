@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+struct Conn;
+
+struct IOThread {
+    pthread_t thread;
+    std::vector<Conn *> conns;      // this round's share
+    std::atomic<uint64_t> round{0}; // bumped by the loop to start one
+    // a thread with nothing to do spins for a while, then parks here
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    bool parked = false;            // under `mu`
+};
+
+// Threaded socket I/O like Redis 6 io-threads: the event loop splits the
+// ready connections between itself and the I/O threads, which only read
+// or write their sockets, and waits for all of them before it runs the
+// commands. No two threads touch one connection at a time.
+struct IOThreads {
+    std::vector<IOThread *> threads;    // besides the loop thread
+    void (*f)(Conn *conn) = nullptr;
+    std::atomic<uint32_t> left{0};      // threads still busy this round
+};
+
+// `n` threads in all, counting the loop; 1 runs everything inline
+void io_threads_init(IOThreads *io, size_t n);
+// f on every conn, split between the threads; returns when all are done
+void io_threads_run(IOThreads *io, std::vector<Conn *> &conns, void (*f)(Conn *conn));
@@ -0,0 +1,84 @@
+#include "mailbox.h"
+#include "log_utils.h"
+#include "socket_utils.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+void mailbox_init(Mailbox *mb){
+    mb->stub.next.store(nullptr, std::memory_order_relaxed);
+    mb->head.store(&mb->stub, std::memory_order_relaxed);
+    mb->tail = &mb->stub;
+#ifdef __linux__
+    mb->wake_fd = mb->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(mb->wake_fd < 0){
+        die("eventfd()");
+    }
+#else
+    int fds[2];
+    if(pipe(fds) < 0){
+        die("pipe()");
+    }
+    fd_set_nb(fds[0]);
+    fd_set_nb(fds[1]);
+    mb->wake_fd = fds[0];
+    mb->notify_fd = fds[1];
+#endif
+};
+
+static void mailbox_enqueue(Mailbox *mb, MsgNode *node){
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MsgNode *prev = mb->head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+};
+
+// any thread
+void mailbox_push(Mailbox *mb, MsgNode *node){
+    mailbox_enqueue(mb, node);
+    // only the first message after an ack pays for the syscall
+    if(!mb->notified.exchange(true, std::memory_order_acq_rel)){
+        uint64_t one = 1;
+        ssize_t rv = write(mb->notify_fd, &one, sizeof(one));
+        (void)rv;   // a full pipe already means "wake up"
+    }
+};
+
+// the consumer thread only; NULL when empty
+MsgNode *mailbox_pop(Mailbox *mb){
+    MsgNode *tail = mb->tail;
+    MsgNode *next = tail->next.load(std::memory_order_acquire);
+    if(tail == &mb->stub){
+        if(!next){
+            return NULL;
+        }
+        mb->tail = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if(next){
+        mb->tail = next;
+        return tail;
+    }
+    if(tail != mb->head.load(std::memory_order_acquire)){
+        return NULL;    // a producer is half way through a push
+    }
+    mailbox_enqueue(mb, &mb->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if(next){
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+};
+
+// the consumer thread, before draining the queue
+void mailbox_ack(Mailbox *mb){
+    uint64_t buf[16];
+    while(read(mb->wake_fd, buf, sizeof(buf)) > 0){}
+    // an RMW, so it acquires whatever the producers released
+    mb->notified.exchange(false, std::memory_order_acq_rel);
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <atomic>
+
+// intrusive node, embedded in the message
+struct MsgNode {
+    std::atomic<MsgNode *> next{nullptr};
+};
+
+// A lock-free multi-producer single-consumer queue (Vyukov) plus a
+// file descriptor the consumer's event loop watches for wakeups.
+struct Mailbox {
+    std::atomic<MsgNode *> head{nullptr};   // producers push here
+    MsgNode *tail = nullptr;                // the consumer pops here
+    MsgNode stub;
+    // wakeup: eventfd on Linux, a pipe elsewhere
+    int wake_fd = -1;       // readable side, watched by the event loop
+    int notify_fd = -1;     // writable side
+    std::atomic<bool> notified{false};
+};
+
+void mailbox_init(Mailbox *mb);
+void mailbox_push(Mailbox *mb, MsgNode *node);
+MsgNode *mailbox_pop(Mailbox *mb);
+void mailbox_ack(Mailbox *mb);
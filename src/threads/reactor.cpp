@@ -0,0 +1,263 @@
+#include "reactor.h"
+#include "buffer_operations.h"
+#include "connection_handlers.h"
+#include "data_store.h"
+#include "utils/timer.h"
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+std::vector<Reactor *> g_reactors;
+
+// KEYS is answered by every shard, the partial arrays are merged on the origin
+struct Gather {
+    uint32_t left = 0;      // shards that haven't replied yet
+    uint32_t count = 0;     // array elements so far
+    Buffer items;
+};
+
+void reactors_init(uint32_t n){
+    assert(n > 0);
+    for(uint32_t i = 0; i < n; ++i){
+        Reactor *r = new Reactor();
+        r->id = i;
+        mailbox_init(&r->mailbox);
+        g_reactors.push_back(r);
+    }
+};
+
+// `{tag}` hashes only the tag, so related keys can be put on one shard
+uint32_t shard_of(const uint8_t *key, size_t len){
+    if(g_reactors.size() <= 1){
+        return 0;
+    }
+    const uint8_t *open = (const uint8_t *)memchr(key, '{', len);
+    if(open){
+        const uint8_t *close = (const uint8_t *)memchr(open + 1, '}', key + len - open - 1);
+        if(close && close > open + 1){
+            key = open + 1;
+            len = close - open - 1;
+        }
+    }
+    uint64_t h = str_hash(key, len);
+    // the hashtables index with the low bits, so mix before picking a shard
+    return (uint32_t)(((h * 0x9E3779B97F4A7C15ull) >> 32) % g_reactors.size());
+};
+
+static void post(uint32_t to, ShardMsg *msg){
+    mailbox_push(&g_reactors[to]->mailbox, &msg->node);
+};
+
+static void gather_add(Gather *g, const Buffer &out){
+    // strip the array header of the partial result
+    assert(out.size() >= 5 && out[0] == TAG_ARR && out.refs.empty());
+    uint32_t n = 0;
+    memcpy(&n, &out[1], 4);
+    g->count += n;
+    buf_append(g->items, out.data() + 5, out.size() - 5);
+};
+
+static void gather_done(Gather *g, Conn *conn){
+    Buffer out;
+    buf_append_u8(out, TAG_ARR);
+    buf_append_u32(out, g->count);
+    buf_append(out, g->items.data(), g->items.size());
+    conn_resume(conn, out);
+};
+
+// whether the request must run on another reactor, from the key
+// positions in the command table
+bool reactor_remote(const CmdArgs &cmd){
+    if(g_reactors.size() <= 1 || cmd.size() == 0){
+        return false;
+    }
+    const Command *c = cmd_lookup(cmd[0]);
+    if(!c || !cmd_arity_ok(c, cmd.size())){
+        return false;   // the error is reported locally
+    }
+    if(c->flags & CMD_ALL_SHARDS){
+        return true;
+    }
+    if(c->first_key == 0){
+        return false;
+    }
+    std::string_view key = cmd[c->first_key];
+    return shard_of((const uint8_t *)key.data(), key.size()) != g_data.shard_id;
+};
+
+static void msg_set_cmd(ShardMsg *msg, const CmdArgs &cmd){
+    msg->cmd.resize(cmd.size());
+    for(size_t i = 0; i < cmd.size(); ++i){
+        msg->cmd[i].assign(cmd[i]);
+    }
+};
+
+// the clock for a request to all shards, and a different value for every
+// such request, so a SAVE can tell its parts from those of another
+static uint64_t scatter_stamp(){
+    static std::atomic<uint64_t> last{0};
+    uint64_t prev = last.load();
+    uint64_t next = 0;
+    do {
+        next = std::max(get_realtime_msec(), prev + 1);
+    } while(!last.compare_exchange_weak(prev, next));
+    return next;
+};
+
+// hand the request over, the connection is paused until the response is back
+void reactor_forward(Conn *conn, const CmdArgs &cmd){
+    uint32_t self = g_data.shard_id;
+    uint32_t n = (uint32_t)g_reactors.size();
+    conn_block(conn);
+
+    const Command *c = cmd_lookup(cmd[0]);
+    if(c->flags & CMD_ALL_SHARDS){
+        // scatter to the other shards, the local part is done right away
+        Gather *g = new Gather();
+        g->left = n - 1;
+        uint64_t unix_ms = scatter_stamp();
+        Buffer out;
+        g_data.scatter_unix_ms = unix_ms;
+        do_request(cmd, out);
+        g_data.scatter_unix_ms = 0;
+        gather_add(g, out);
+        for(uint32_t i = 0; i < n; ++i){
+            if(i == self){
+                continue;
+            }
+            ShardMsg *msg = new ShardMsg();
+            msg->from = self;
+            msg->conn = conn;
+            msg->gather = g;
+            msg->unix_ms = unix_ms;
+            msg_set_cmd(msg, cmd);
+            conn->refs++;
+            post(i, msg);
+        }
+        return;
+    }
+
+    ShardMsg *msg = new ShardMsg();
+    msg->from = self;
+    msg->conn = conn;
+    msg_set_cmd(msg, cmd);
+    conn->refs++;
+    std::string_view key = cmd[c->first_key];
+    conn->blocked_on = shard_of((const uint8_t *)key.data(), key.size());
+    post(conn->blocked_on, msg);
+};
+
+// from the pool, or the shard itself for a parked command
+static void async_finished(AsyncCmd *cmd){
+    ShardMsg *msg = (ShardMsg *)cmd->token;
+    if(!cmd->work){
+        msg->conn->parked = NULL;   // on the shard, nothing left to cancel
+    }
+    msg->type = MSG_DONE;
+    post(msg->owner, msg);
+};
+
+static void async_work(void *arg){
+    AsyncCmd *cmd = (AsyncCmd *)arg;
+    cmd->work(cmd);
+};
+
+void reactor_offload(Conn *conn, ShardMsg *msg){
+    AsyncCmd *cmd = g_data.async;
+    g_data.async = NULL;
+    if(!msg){
+        // the conn waits as if the request was forwarded to this shard
+        msg = new ShardMsg();
+        msg->from = g_data.shard_id;
+        msg->conn = conn;
+        conn->refs++;
+        conn_block(conn);
+        conn->blocked_on = g_data.shard_id;
+    }
+    msg->async = cmd;
+    msg->owner = g_data.shard_id;
+    cmd->token = msg;
+    cmd->conn = msg->conn;
+    cmd->finished = &async_finished;
+    if(cmd->work){
+        thread_pool_queue(g_data.thread_pool, &async_work, cmd);
+    } else {
+        assert(cmd->cancel);
+        msg->conn->parked = cmd;
+    }
+};
+
+void reactor_cancel(Conn *conn){
+    ShardMsg *msg = new ShardMsg();
+    msg->type = MSG_CANCEL;
+    msg->from = g_data.shard_id;
+    msg->conn = conn;
+    conn->refs++;
+    post(conn->blocked_on, msg);
+};
+
+// process the messages of the current reactor
+void reactor_drain(void (*resumed)(Conn *)){
+    Mailbox *mb = &g_reactors[g_data.shard_id]->mailbox;
+    mailbox_ack(mb);
+    while(MsgNode *node = mailbox_pop(mb)){
+        ShardMsg *msg = container_of(node, ShardMsg, node);
+        if(msg->type == MSG_REQUEST){
+            // we own the key, execute and send the response back
+            CmdArgs args;
+            for(const std::string &arg : msg->cmd){
+                args_push(args, arg);
+            }
+            g_data.async_ok = true;
+            g_data.scatter_unix_ms = msg->unix_ms;
+            do_request(args, msg->out);
+            g_data.scatter_unix_ms = 0;
+            g_data.async_ok = false;
+            if(g_data.async){
+                reactor_offload(NULL, msg);
+                continue;
+            }
+            msg->type = MSG_REPLY;
+            post(msg->from, msg);
+            continue;
+        }
+        if(msg->type == MSG_CANCEL){
+            // behind the request in the mailbox, so it is parked or done;
+            // the response goes nowhere and drops the last references
+            if(AsyncCmd *cmd = msg->conn->parked){
+                cmd->cancel(cmd);
+            }
+            msg->type = MSG_REPLY;
+            post(msg->from, msg);
+            continue;
+        }
+        if(msg->type == MSG_DONE){
+            // the response goes to the origin like any other
+            msg->async->done(msg->async, msg->out);
+            msg->async = NULL;
+            msg->type = MSG_REPLY;
+            post(msg->from, msg);
+            continue;
+        }
+
+        Conn *conn = msg->conn;
+        bool alive = conn->fd >= 0;
+        if(Gather *g = msg->gather){
+            gather_add(g, msg->out);
+            if(--g->left == 0){
+                if(alive){
+                    gather_done(g, conn);
+                    resumed(conn);
+                }
+                delete g;
+            }
+        } else if(alive){
+            conn_resume(conn, msg->out);
+            resumed(conn);
+        }
+        conn_unref(conn);
+        delete msg;
+    }
+};
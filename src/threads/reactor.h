@@ -0,0 +1,57 @@
+#pragma once
+
+#include "mailbox.h"
+#include "io_threads.h"
+#include "server_common.h"
+#include "protocol_serialization.h"
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// One event loop thread. In multi-reactor mode every reactor owns its
+// listener, connections, timers and a shard of the keyspace; requests
+// for keys of another shard are forwarded through the owner's mailbox.
+struct Reactor {
+    uint32_t id = 0;
+    pthread_t thread;
+    Mailbox mailbox;
+    IOThreads io;       // --io-threads, for this reactor's connections
+};
+
+enum {
+    MSG_REQUEST = 0,    // execute `cmd` on the owner shard
+    MSG_REPLY = 1,      // the response in `out`, back on the origin
+    MSG_DONE = 2,       // `async` finished on the thread pool, back on its shard
+    MSG_CANCEL = 3,     // `conn` is closed, drop the request parked for it
+};
+
+struct Gather;
+struct AsyncCmd;
+
+struct ShardMsg {
+    MsgNode node;
+    uint32_t type = MSG_REQUEST;
+    uint32_t from = 0;          // the origin reactor
+    Conn *conn = NULL;          // owned by the origin reactor
+    Gather *gather = NULL;      // set when the request is sent to all shards
+    AsyncCmd *async = NULL;     // an offloaded command
+    uint32_t owner = 0;         // the shard it runs on
+    uint64_t unix_ms = 0;       // sent to all shards: g_data.scatter_unix_ms
+    std::vector<std::string> cmd;   // copied, the request buffer moves on
+    Buffer out;
+};
+
+extern std::vector<Reactor *> g_reactors;
+
+void reactors_init(uint32_t n);
+uint32_t shard_of(const uint8_t *key, size_t len);
+bool reactor_remote(const CmdArgs &cmd);
+void reactor_forward(Conn *conn, const CmdArgs &cmd);
+void reactor_drain(void (*resumed)(Conn *));
+// takes the command left in g_data.async, to the thread pool or parked;
+// `msg` is the forwarded request it came in, NULL for a request of `conn`
+void reactor_offload(Conn *conn, ShardMsg *msg);
+// for a closed conn that is still blocked, a parked request would keep it
+// and its waiter forever
+void reactor_cancel(Conn *conn);
@@ -1,24 +1,254 @@
 #include <assert.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "thread_pool.h"
 
-static void *worker(void *arg){
-    ThreadPool *tp = (ThreadPool *)arg;
+const int64_t k_deque_init = 256;
+const uint64_t k_inject_size = 1 << 14;
+// rounds over all the queues before an idle worker parks
+const uint32_t k_pool_spins = 64;
+
+static thread_local PoolWorker *tl_worker = NULL;
+
+void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+};
+
+static WorkRing *ring_new(int64_t size){
+    WorkRing *ring = new WorkRing;
+    ring->mask = size - 1;
+    ring->cells = new WorkCell[size];
+    return ring;
+};
+
+static void cell_put(WorkCell *cell, const Work &work){
+    cell->f.store(work.f, std::memory_order_relaxed);
+    cell->arg.store(work.arg, std::memory_order_relaxed);
+};
+
+static Work cell_get(WorkCell *cell){
+    return Work{cell->f.load(std::memory_order_relaxed), cell->arg.load(std::memory_order_relaxed)};
+};
+
+// the owner only
+static void deque_push(WorkDeque *dq, const Work &work){
+    int64_t b = dq->bottom.load(std::memory_order_relaxed);
+    int64_t t = dq->top.load(std::memory_order_acquire);
+    WorkRing *ring = dq->ring.load(std::memory_order_relaxed);
+    if(b - t > ring->mask){
+        WorkRing *bigger = ring_new((ring->mask + 1) * 2);
+        for(int64_t i = t; i < b; ++i){
+            cell_put(&bigger->cells[i & bigger->mask], cell_get(&ring->cells[i & ring->mask]));
+        }
+        dq->retired.push_back(ring);
+        dq->ring.store(bigger, std::memory_order_release);
+        ring = bigger;
+    }
+    cell_put(&ring->cells[b & ring->mask], work);
+    std::atomic_thread_fence(std::memory_order_release);
+    dq->bottom.store(b + 1, std::memory_order_relaxed);
+};
 
+// the owner only, the newest first
+static bool deque_pop(WorkDeque *dq, Work *out){
+    int64_t b = dq->bottom.load(std::memory_order_relaxed) - 1;
+    WorkRing *ring = dq->ring.load(std::memory_order_relaxed);
+    dq->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = dq->top.load(std::memory_order_relaxed);
+    if(t > b){
+        dq->bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+    *out = cell_get(&ring->cells[b & ring->mask]);
+    if(t < b){
+        return true;
+    }
+    // the last one, race the thieves for it
+    bool won = dq->top.compare_exchange_strong(
+        t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    dq->bottom.store(b + 1, std::memory_order_relaxed);
+    return won;
+};
+
+enum { STEAL_EMPTY, STEAL_OK, STEAL_RETRY };
+
+// any other thread, the oldest first
+static int deque_steal(WorkDeque *dq, Work *out){
+    int64_t t = dq->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = dq->bottom.load(std::memory_order_acquire);
+    if(t >= b){
+        return STEAL_EMPTY;
+    }
+    WorkRing *ring = dq->ring.load(std::memory_order_acquire);
+    Work work = cell_get(&ring->cells[t & ring->mask]);
+    if(!dq->top.compare_exchange_strong(
+            t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)){
+        return STEAL_RETRY;     // lost to the owner or another thief
+    }
+    *out = work;
+    return STEAL_OK;
+};
+
+static bool deque_empty(WorkDeque *dq){
+    return dq->top.load() >= dq->bottom.load();
+};
+
+// every cell carries the lap it is ready for: pos when free, pos + 1
+// when holding the work pushed at pos
+static void inject_init(InjectQueue *q, uint64_t size){
+    q->cells = new InjectCell[size];
+    q->mask = size - 1;
+    for(uint64_t i = 0; i < size; ++i){
+        q->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+};
+
+static bool inject_push(InjectQueue *q, const Work &work){
+    uint64_t pos = q->tail.load(std::memory_order_relaxed);
+    InjectCell *cell = NULL;
     while(true){
-        pthread_mutex_lock(&tp->mu);
-        // wait for the condition: a non-empty queue
-        while(tp->queue.empty()){
-            pthread_cond_wait(&tp->not_empty, &tp->mu);
+        cell = &q->cells[pos & q->mask];
+        int64_t diff = (int64_t)(cell->seq.load(std::memory_order_acquire) - pos);
+        if(diff == 0){
+            if(q->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        } else if(diff < 0){
+            return false;   // full
+        } else {
+            pos = q->tail.load(std::memory_order_relaxed);
         }
+    }
+    cell->work = work;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+};
 
-        // got the job
-        Work w = tp->queue.front();
-        tp->queue.pop_front();
-        pthread_mutex_unlock(&tp->mu);
+static bool inject_pop(InjectQueue *q, Work *out){
+    uint64_t pos = q->head.load(std::memory_order_relaxed);
+    InjectCell *cell = NULL;
+    while(true){
+        cell = &q->cells[pos & q->mask];
+        int64_t diff = (int64_t)(cell->seq.load(std::memory_order_acquire) - (pos + 1));
+        if(diff == 0){
+            if(q->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        } else if(diff < 0){
+            return false;   // empty
+        } else {
+            pos = q->head.load(std::memory_order_relaxed);
+        }
+    }
+    *out = cell->work;
+    cell->seq.store(pos + q->mask + 1, std::memory_order_release);
+    return true;
+};
+
+static bool pool_has_work(ThreadPool *tp){
+    if(tp->inject.head.load() != tp->inject.tail.load()){
+        return true;
+    }
+    for(PoolWorker *w : tp->workers){
+        if(!deque_empty(&w->deque)){
+            return true;
+        }
+    }
+    return false;
+};
+
+// after a push: hand a wakeup to one parked worker, if any
+static void pool_wake(ThreadPool *tp){
+    // pairs with the fence in pool_park, so either the worker sees the
+    // work or this sees the worker
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t n = tp->sleeping.load(std::memory_order_relaxed);
+    while(n > 0 && !tp->sleeping.compare_exchange_weak(n, n - 1)){}
+    if(n == 0){
+        return;
+    }
+    pthread_mutex_lock(&tp->mu);
+    tp->wakeups++;
+    pthread_cond_signal(&tp->wake);
+    pthread_mutex_unlock(&tp->mu);
+};
+
+static void pool_park(PoolWorker *w){
+    ThreadPool *tp = w->pool;
+    tp->sleeping.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(pool_has_work(tp)){
+        // back out, unless a submitter has already counted us out
+        uint32_t n = tp->sleeping.load(std::memory_order_relaxed);
+        while(n > 0 && !tp->sleeping.compare_exchange_weak(n, n - 1)){}
+        if(n > 0){
+            return;
+        }
+    }
+    w->parks.store(w->parks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    pthread_mutex_lock(&tp->mu);
+    while(tp->wakeups == 0){
+        pthread_cond_wait(&tp->wake, &tp->mu);
+    }
+    tp->wakeups--;
+    pthread_mutex_unlock(&tp->mu);
+};
+
+static bool pool_find(PoolWorker *w, Work *out){
+    ThreadPool *tp = w->pool;
+    if(deque_pop(&w->deque, out) || inject_pop(&tp->inject, out)){
+        return true;
+    }
+    // xorshift, so the thieves spread over the victims
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 17;
+    w->rng ^= w->rng << 5;
+    size_t n = tp->workers.size();
+    for(size_t i = 0; i < n; ++i){
+        PoolWorker *victim = tp->workers[(w->rng + i) % n];
+        if(victim == w){
+            continue;
+        }
+        int rv;
+        while((rv = deque_steal(&victim->deque, out)) == STEAL_RETRY){
+            cpu_relax();
+        }
+        if(rv == STEAL_OK){
+            w->steals.store(w->steals.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+};
+
+static void *worker(void *arg){
+    PoolWorker *w = (PoolWorker *)arg;
+    tl_worker = w;
+
+    while(true){
+        Work work;
+        bool found = false;
+        for(uint32_t i = 0; i < k_pool_spins && !found; ++i){
+            found = pool_find(w, &work);
+            if(!found){
+                cpu_relax();
+            }
+        }
+        if(!found){
+            pool_park(w);
+            continue;
+        }
 
         // do the work
-        w.f(w.arg);
+        work.f(work.arg);
+        w->tasks.store(w->tasks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     }
     return NULL;
 };
@@ -28,19 +258,100 @@ void thread_pool_init(ThreadPool *tp, size_t num_threads){
 
     int rv = pthread_mutex_init(&tp->mu, NULL);
     assert(rv == 0);
-    rv = pthread_cond_init(&tp->not_empty, NULL);
+    rv = pthread_cond_init(&tp->wake, NULL);
     assert(rv == 0);
+    inject_init(&tp->inject, k_inject_size);
 
-    tp->threads.resize(num_threads);
-    for(size_t i = 0; i< num_threads; ++i){
-        int rv = pthread_create(&tp->threads[i],NULL, &worker, tp);
+    // all the deques exist before any worker steals
+    tp->workers.resize(num_threads);
+    for(size_t i = 0; i < num_threads; ++i){
+        PoolWorker *w = new PoolWorker;
+        w->pool = tp;
+        w->rng = (uint32_t)(i * 2654435761u) | 1;
+        w->deque.ring.store(ring_new(k_deque_init), std::memory_order_relaxed);
+        tp->workers[i] = w;
+    }
+    for(PoolWorker *w : tp->workers){
+        rv = pthread_create(&w->thread, NULL, &worker, w);
         assert(rv == 0);
     }
 };
 
 void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg){
-    pthread_mutex_lock(&tp->mu);
-    tp->queue.push_back(Work {f, arg});
-    pthread_cond_signal(&tp->not_empty);
-    pthread_mutex_unlock(&tp->mu);
-};
\ No newline at end of file
+    Work work{f, arg};
+    if(tl_worker && tl_worker->pool == tp){
+        deque_push(&tl_worker->deque, work);
+    } else {
+        // full: wait for the workers to make room
+        while(!inject_push(&tp->inject, work)){
+            pool_wake(tp);
+            sched_yield();
+        }
+    }
+    pool_wake(tp);
+};
+
+// a fork-join batch: the tasks count down, the caller waits for zero
+struct Batch {
+    void (*f)(void *) = nullptr;
+    void *arg = nullptr;
+    size_t *left = nullptr;
+    pthread_mutex_t *mu = nullptr;
+    pthread_cond_t *done = nullptr;
+};
+
+static void batch_task(void *arg){
+    Batch *b = (Batch *)arg;
+    b->f(b->arg);
+    pthread_mutex_lock(b->mu);
+    if(--*b->left == 0){
+        pthread_cond_signal(b->done);
+    }
+    pthread_mutex_unlock(b->mu);
+};
+
+void thread_pool_run(ThreadPool *tp, void (*f)(void *), void **args, size_t n){
+    if(n == 0){
+        return;
+    }
+    pthread_mutex_t mu;
+    pthread_cond_t done;
+    pthread_mutex_init(&mu, NULL);
+    pthread_cond_init(&done, NULL);
+    size_t left = n - 1;
+    std::vector<Batch> tasks(n);
+    for(size_t i = 1; i < n; ++i){
+        tasks[i] = Batch{f, args[i], &left, &mu, &done};
+        thread_pool_queue(tp, &batch_task, &tasks[i]);
+    }
+    f(args[0]);
+    pthread_mutex_lock(&mu);
+    while(left > 0){
+        pthread_cond_wait(&done, &mu);
+    }
+    pthread_mutex_unlock(&mu);
+    pthread_cond_destroy(&done);
+    pthread_mutex_destroy(&mu);
+};
+
+void thread_pool_stats(ThreadPool *tp, PoolStats *stats){
+    *stats = PoolStats{};
+    stats->threads = tp->workers.size();
+    uint64_t head = tp->inject.head.load(std::memory_order_relaxed);
+    uint64_t tail = tp->inject.tail.load(std::memory_order_relaxed);
+    stats->submitted = tail;
+    stats->queued = tail > head ? tail - head : 0;
+    for(PoolWorker *w : tp->workers){
+        int64_t depth = w->deque.bottom.load(std::memory_order_relaxed)
+            - w->deque.top.load(std::memory_order_relaxed);
+        stats->queued += depth > 0 ? (size_t)depth : 0;
+        stats->tasks += w->tasks.load(std::memory_order_relaxed);
+        stats->steals += w->steals.load(std::memory_order_relaxed);
+        stats->parks += w->parks.load(std::memory_order_relaxed);
+    }
+};
+
+size_t thread_pool_default_size(){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 4;
+};
@@ -1,21 +1,96 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <atomic>
 #include <vector>
-#include <deque>
 
 struct Work {
     void (*f)(void *) = nullptr;
     void *arg = nullptr;
 };
 
+// one slot of a deque; thieves read it while the owner may write the
+// next lap, so the fields are atomics
+struct WorkCell {
+    std::atomic<void (*)(void *)> f{nullptr};
+    std::atomic<void *> arg{nullptr};
+};
+
+struct WorkRing {
+    int64_t mask = 0;
+    WorkCell *cells = nullptr;
+};
+
+// A Chase-Lev deque: the owning worker pushes and pops at the bottom,
+// the other workers steal from the top. A full ring is doubled; the old
+// one is kept since a thief may still be reading it.
+struct WorkDeque {
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<WorkRing *> ring{nullptr};
+    std::vector<WorkRing *> retired;
+};
+
+struct InjectCell {
+    std::atomic<uint64_t> seq{0};
+    Work work;
+};
+
+// A bounded lock-free multi-producer multi-consumer queue (Vyukov) for
+// the work submitted from outside the pool, i.e. by the event loops.
+struct InjectQueue {
+    InjectCell *cells = nullptr;
+    uint64_t mask = 0;
+    alignas(64) std::atomic<uint64_t> head{0};  // the workers pop here
+    alignas(64) std::atomic<uint64_t> tail{0};  // the submitters push here
+};
+
+struct ThreadPool;
+
+struct PoolWorker {
+    ThreadPool *pool = nullptr;
+    pthread_t thread;
+    uint32_t rng = 0;       // picks the first victim to steal from
+    WorkDeque deque;
+    // written by the worker only
+    std::atomic<uint64_t> tasks{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> parks{0};
+};
+
+// Workers run their own deque first, then the injection queue, then
+// steal from the others. An idle worker spins for a while before it
+// parks on the condition variable; a submission wakes one parked worker.
 struct ThreadPool {
-    std::vector<pthread_t> threads;
-    std::deque<Work> queue;
+    std::vector<PoolWorker *> workers;
+    InjectQueue inject;
+    std::atomic<uint32_t> sleeping{0};  // parked, or about to park
     pthread_mutex_t mu;
-    pthread_cond_t not_empty;
+    pthread_cond_t wake;
+    uint32_t wakeups = 0;   // under `mu`, one per woken worker
+};
+
+struct PoolStats {
+    size_t threads = 0;
+    size_t queued = 0;      // waiting in the deques and the injection queue
+    uint64_t submitted = 0; // through the injection queue
+    uint64_t tasks = 0;
+    uint64_t steals = 0;
+    uint64_t parks = 0;
 };
 
 void thread_pool_init(ThreadPool *tp, size_t num_threads);
-void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
\ No newline at end of file
+// from a worker of `tp` onto its own deque, from any other thread onto
+// the injection queue
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+// runs f on each of the n args, one on the calling thread and the rest on
+// the pool, and returns when all are done. Not for the pool's own threads.
+void thread_pool_run(ThreadPool *tp, void (*f)(void *), void **args, size_t n);
+// a racy snapshot, for INFO
+void thread_pool_stats(ThreadPool *tp, PoolStats *stats);
+// the number of online cores, the default pool size
+size_t thread_pool_default_size();
+// a pause hint for spin loops
+void cpu_relax();
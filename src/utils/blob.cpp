@@ -0,0 +1,29 @@
+#include "blob.h"
+#include "log_utils.h"
+
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+Blob *blob_new(const uint8_t *data, size_t len){
+    void *mem = malloc(sizeof(Blob) + len);
+    if(!mem){
+        die("malloc()");
+    }
+    Blob *blob = new (mem) Blob();
+    blob->len = (uint32_t)len;
+    memcpy(blob_data(blob), data, len);
+    return blob;
+};
+
+void blob_ref(Blob *blob){
+    blob->refs.fetch_add(1, std::memory_order_relaxed);
+};
+
+// any thread, a reply may be sent by another reactor than the owner
+void blob_unref(Blob *blob){
+    if(blob->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        blob->~Blob();
+        free(blob);
+    }
+};
@@ -0,0 +1,25 @@
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// An immutable, reference counted byte string for large values. The
+// keyspace holds one reference and every queued response pointing to it
+// holds another, so an overwritten or deleted value stays alive until it
+// has been sent. The bytes follow the struct.
+struct Blob {
+    std::atomic<uint32_t> refs{1};
+    uint32_t len = 0;
+};
+
+Blob *blob_new(const uint8_t *data, size_t len);
+void blob_ref(Blob *blob);
+void blob_unref(Blob *blob);
+
+inline uint8_t *blob_data(Blob *blob){
+    return (uint8_t *)(blob + 1);
+};
+
+#endif
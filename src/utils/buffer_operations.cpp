@@ -1,16 +1,182 @@
 #include "buffer_operations.h"
+#include "blob.h"
+#include "log_utils.h"
 
+#include <assert.h>
+#include <string.h>
 
-void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len){
-    buf.insert(buf.end(), data, data + len);
-}
+Buffer::~Buffer(){
+    for(const BufRef &ref : refs){
+        blob_unref(ref.blob);
+    }
+    free(buffer_begin);
+};
+
+// free bytes after the data
+size_t buf_space(const Buffer &buf){
+    return buf.buffer_end - buf.data_end;
+};
+
+// make room for `n` more bytes at the back and return where they go
+uint8_t *buf_reserve(Buffer &buf, size_t n){
+    if(buf_space(buf) >= n){
+        return buf.data_end;
+    }
+    size_t size = buf.size();
+    size_t cap = buf.buffer_end - buf.buffer_begin;
+    if(size + n <= cap / 2 + cap / 4){
+        // mostly consumed, slide the data to the front instead of growing
+        memmove(buf.buffer_begin, buf.data_begin, size);
+    } else {
+        size_t new_cap = cap ? cap * 2 : 64;
+        while(new_cap < size + n){
+            new_cap *= 2;
+        }
+        uint8_t *mem = (uint8_t *)malloc(new_cap);
+        if(!mem){
+            die("malloc()");
+        }
+        if(size){
+            memcpy(mem, buf.data_begin, size);
+        }
+        free(buf.buffer_begin);
+        buf.buffer_begin = mem;
+        buf.buffer_end = mem + new_cap;
+    }
+    buf.data_begin = buf.buffer_begin;
+    buf.data_end = buf.buffer_begin + size;
+    return buf.data_end;
+};
+
+// `n` bytes were written to the space returned by buf_reserve()
+void buf_commit(Buffer &buf, size_t n){
+    assert(n <= buf_space(buf));
+    buf.data_end += n;
+};
+
+void buf_append(Buffer &buf, const uint8_t *data, size_t len){
+    if(len == 0){
+        return;
+    }
+    memcpy(buf_reserve(buf, len), data, len);
+    buf.data_end += len;
+};
 
-void buf_consume(std::vector<uint8_t> &buf, size_t n){
-    buf.erase(buf.begin(), buf.begin() + n);
-}
+static void buf_consume_bytes(Buffer &buf, size_t n){
+    buf.data_begin += n;
+    buf.base += n;
+    if(buf.data_begin == buf.data_end){
+        // empty, start over from the front for free
+        buf.data_begin = buf.data_end = buf.buffer_begin;
+    }
+};
+
+// remove `n` bytes from the front of the stream, blobs included;
+// O(1) per segment, only the read cursor moves
+void buf_consume(Buffer &buf, size_t n){
+    assert(n <= buf.total());
+    while(n > 0 && !buf.refs.empty()){
+        BufRef &ref = buf.refs.front();
+        size_t before = (size_t)(ref.pos - buf.base);
+        if(n < before){
+            break;
+        }
+        buf_consume_bytes(buf, before);
+        n -= before;
+        size_t left = ref.blob->len - buf.ref_off;
+        if(n < left){
+            buf.ref_off += n;
+            buf.ref_bytes -= n;
+            return;
+        }
+        n -= left;
+        buf.ref_bytes -= left;
+        buf.ref_off = 0;
+        blob_unref(ref.blob);
+        buf.refs.pop_front();
+    }
+    buf_consume_bytes(buf, n);
+};
+
+// reference a blob at the back instead of copying it
+void buf_append_ref(Buffer &buf, Blob *blob){
+    blob_ref(blob);
+    BufRef ref;
+    ref.pos = buf.base + buf.size();
+    ref.blob = blob;
+    buf.refs.push_back(ref);
+    buf.ref_bytes += blob->len;
+};
+
+// move everything from `src` to the back of `dst`
+void buf_append_buf(Buffer &dst, Buffer &src){
+    assert(src.ref_off == 0);
+    size_t done = 0;
+    for(const BufRef &ref : src.refs){
+        size_t at = (size_t)(ref.pos - src.base);
+        buf_append(dst, src.data() + done, at - done);
+        done = at;
+        BufRef moved = ref;
+        moved.pos = dst.base + dst.size();
+        dst.refs.push_back(moved);
+        dst.ref_bytes += ref.blob->len;
+    }
+    buf_append(dst, src.data() + done, src.size() - done);
+    src.refs.clear();
+    src.ref_bytes = 0;
+    buf_consume_bytes(src, src.size());
+};
+
+// stream size from the byte position `pos` to the end
+size_t buf_total_from(const Buffer &buf, size_t pos){
+    size_t n = buf.size() - pos;
+    for(size_t i = buf.refs.size(); i-- > 0 && buf.refs[i].pos > buf.base + pos; ){
+        n += buf.refs[i].blob->len;
+    }
+    return n;
+};
+
+// the front segments of the stream for writev(), returns the count
+size_t buf_iov(const Buffer &buf, struct iovec *iov, size_t max){
+    size_t cnt = 0;
+    size_t done = 0;
+    for(size_t i = 0; i < buf.refs.size() && cnt < max; ++i){
+        const BufRef &ref = buf.refs[i];
+        size_t at = (size_t)(ref.pos - buf.base);
+        if(at > done){
+            iov[cnt].iov_base = (void *)(buf.data_begin + done);
+            iov[cnt].iov_len = at - done;
+            done = at;
+            if(++cnt == max){
+                return cnt;
+            }
+        }
+        size_t off = i == 0 ? buf.ref_off : 0;
+        iov[cnt].iov_base = (void *)(blob_data(ref.blob) + off);
+        iov[cnt].iov_len = ref.blob->len - off;
+        cnt++;
+    }
+    if(cnt < max && buf.size() > done){
+        iov[cnt].iov_base = (void *)(buf.data_begin + done);
+        iov[cnt].iov_len = buf.size() - done;
+        cnt++;
+    }
+    return cnt;
+};
+
+// drop the data after the first `n` bytes
+void buf_truncate(Buffer &buf, size_t n){
+    assert(n <= buf.size());
+    buf.data_end = buf.data_begin + n;
+    while(!buf.refs.empty() && buf.refs.back().pos > buf.base + n){
+        buf.ref_bytes -= buf.refs.back().blob->len;
+        blob_unref(buf.refs.back().blob);
+        buf.refs.pop_back();
+    }
+};
 
 void buf_append_u8(Buffer &buf, uint8_t data){
-    buf.push_back(data);
+    buf_append(buf, &data, 1);
 };
 
 void buf_append_u32(Buffer &buf, uint32_t data){
@@ -23,4 +189,4 @@ void buf_append_i64(Buffer &buf, uint64_t data){
 
 void buf_append_dbl(Buffer &buf, double data){
     buf_append(buf, (const uint8_t *)&data, 8);
-};
\ No newline at end of file
+};
@@ -2,12 +2,21 @@
 #define BUFFER_OPERATIONS_H
 
 #include "server_common.h"
-#include <vector>
 
-void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len);
-void buf_consume(std::vector<uint8_t> &buf, size_t n);
+#include <sys/uio.h>
+
+void buf_append(Buffer &buf, const uint8_t *data, size_t len);
+void buf_consume(Buffer &buf, size_t n);
+void buf_truncate(Buffer &buf, size_t n);
+void buf_append_ref(Buffer &buf, Blob *blob);
+void buf_append_buf(Buffer &dst, Buffer &src);
+size_t buf_total_from(const Buffer &buf, size_t pos);
+size_t buf_iov(const Buffer &buf, struct iovec *iov, size_t max);
+uint8_t *buf_reserve(Buffer &buf, size_t n);
+void buf_commit(Buffer &buf, size_t n);
+size_t buf_space(const Buffer &buf);
 void buf_append_u8(Buffer &buf, uint8_t data);
 void buf_append_u32(Buffer &buf, uint32_t data);
 void buf_append_i64(Buffer &buf, uint64_t data);
 void buf_append_dbl(Buffer &buf, double data);
-#endif
\ No newline at end of file
+#endif
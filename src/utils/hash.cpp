@@ -0,0 +1,181 @@
+#include "hash.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// keys longer than this take the striped path
+const size_t k_hash_long = 256;
+const size_t k_stripe = 64;
+const size_t k_secret_size = 192;
+// stripes per block, then the accumulators are scrambled
+const size_t k_stripes_per_block = (k_secret_size - k_stripe) / 8;
+
+static const uint64_t k_wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static uint64_t g_seed = 0;
+static uint64_t g_seed_short = 0;     // g_seed premixed for hash_short()
+alignas(16) static uint8_t g_secret[k_secret_size];
+
+static uint64_t r8(const uint8_t *p){
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+};
+
+static uint64_t r4(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+};
+
+// the 128-bit product, folded
+static uint64_t mix(uint64_t a, uint64_t b){
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+};
+
+static uint64_t splitmix64(uint64_t &state){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+};
+
+void hash_seed(uint64_t seed){
+    uint64_t state = seed;
+    g_seed = splitmix64(state);
+    g_seed_short = g_seed ^ mix(g_seed ^ k_wyp[0], k_wyp[1]);
+    for(size_t i = 0; i < k_secret_size; i += 8){
+        uint64_t v = splitmix64(state);
+        memcpy(g_secret + i, &v, 8);
+    }
+};
+
+uint64_t hash_random_seed(){
+    uint64_t seed = 0;
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if(!fp || fread(&seed, sizeof(seed), 1, fp) != 1){
+        struct timespec ts = {0, 0};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)getpid();
+    }
+    if(fp){
+        fclose(fp);
+    }
+    return seed;
+};
+
+// wyhash: up to 48 bytes per round in 3 independent lanes
+static uint64_t hash_short(const uint8_t *p, size_t len){
+    uint64_t seed = g_seed_short;
+    uint64_t a = 0, b = 0;
+    if(len <= 16){
+        if(len >= 4){
+            a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+            b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+        } else if(len > 0){
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        }
+    } else {
+        size_t i = len;
+        if(i > 48){
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix(r8(p) ^ k_wyp[1], r8(p + 8) ^ seed);
+                see1 = mix(r8(p + 16) ^ k_wyp[2], r8(p + 24) ^ see1);
+                see2 = mix(r8(p + 32) ^ k_wyp[3], r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while(i > 16){
+            seed = mix(r8(p) ^ k_wyp[1], r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = r8(p + i - 16);
+        b = r8(p + i - 8);
+    }
+    a ^= k_wyp[1];
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return mix(a ^ k_wyp[0] ^ len, b ^ k_wyp[1]);
+};
+
+// XXH3 style: 8 accumulators, each adds the other's input word plus the
+// product of the two 32-bit halves of input ^ secret; SSE2 does 2 a time
+static void accumulate_stripe(uint64_t *acc, const uint8_t *p, const uint8_t *secret){
+#ifdef __SSE2__
+    __m128i *xacc = (__m128i *)acc;
+    for(size_t j = 0; j < 4; ++j){
+        __m128i data = _mm_loadu_si128((const __m128i *)(p + 16 * j));
+        __m128i key = _mm_loadu_si128((const __m128i *)(secret + 16 * j));
+        __m128i dk = _mm_xor_si128(data, key);
+        __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        xacc[j] = _mm_add_epi64(xacc[j], _mm_add_epi64(swapped, prod));
+    }
+#else
+    for(size_t i = 0; i < 8; ++i){
+        uint64_t data = r8(p + 8 * i);
+        uint64_t dk = data ^ r8(secret + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (dk & 0xffffffff) * (dk >> 32);
+    }
+#endif
+};
+
+static void scramble(uint64_t *acc, const uint8_t *secret){
+    for(size_t i = 0; i < 8; ++i){
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= r8(secret + 8 * i);
+        acc[i] = a * 0x9E3779B1ull;
+    }
+};
+
+static uint64_t hash_long(const uint8_t *p, size_t len){
+    alignas(16) uint64_t acc[8] = {
+        0xC2B2AE3Dull, 0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull,
+        0x85EBCA77C2B2AE63ull, 0x85EBCA77ull, 0x27D4EB2F165667C5ull, 0x9E3779B1ull,
+    };
+    const size_t block = k_stripe * k_stripes_per_block;
+    size_t nblocks = (len - 1) / block;
+    for(size_t n = 0; n < nblocks; ++n){
+        for(size_t s = 0; s < k_stripes_per_block; ++s){
+            accumulate_stripe(acc, p + n * block + s * k_stripe, g_secret + s * 8);
+        }
+        scramble(acc, g_secret + k_secret_size - k_stripe);
+    }
+    // the last partial block, then the last 64 bytes (overlapping)
+    const uint8_t *tail = p + nblocks * block;
+    size_t nstripes = (len - 1 - nblocks * block) / k_stripe;
+    for(size_t s = 0; s < nstripes; ++s){
+        accumulate_stripe(acc, tail + s * k_stripe, g_secret + s * 8);
+    }
+    accumulate_stripe(acc, p + len - k_stripe, g_secret + k_secret_size - k_stripe - 7);
+
+    uint64_t h = len * 0x9E3779B185EBCA87ull ^ g_seed;
+    for(size_t i = 0; i < 8; i += 2){
+        h += mix(acc[i] ^ r8(g_secret + 11 + 8 * i), acc[i + 1] ^ r8(g_secret + 19 + 8 * i));
+    }
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    return h ^ (h >> 32);
+};
+
+uint64_t str_hash(const uint8_t *data, size_t len){
+    return len <= k_hash_long ? hash_short(data, len) : hash_long(data, len);
+};
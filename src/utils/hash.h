@@ -0,0 +1,14 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The 64-bit hash of all the hashtables (wyhash for short keys, an XXH3
+// style SIMD loop for long ones). It is keyed with a per-process seed so
+// that collisions can't be precomputed.
+void hash_seed(uint64_t seed);
+uint64_t hash_random_seed();
+uint64_t str_hash(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,226 @@
+#include "slab.h"
+#include "DList.h"
+#include "hashtable.h"
+#include "log_utils.h"
+
+#include <assert.h>
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+// classes: 16 byte steps up to 256, then 4 per doubling up to 4KB
+const size_t k_slab_classes = 32;
+const size_t k_slab_steps = k_slab_max / 16 + 1;
+
+struct SlabClasses {
+    uint32_t size[k_slab_classes] = {};
+    uint8_t index[k_slab_steps] = {};   // by (size + 15) / 16
+};
+
+static constexpr SlabClasses slab_classes_build(){
+    SlabClasses sc;
+    size_t n = 0;
+    for(uint32_t s = 16; s <= 256; s += 16){
+        sc.size[n++] = s;
+    }
+    for(uint32_t base = 256; base < k_slab_max; base *= 2){
+        for(uint32_t i = 1; i <= 4; ++i){
+            sc.size[n++] = base + base / 4 * i;
+        }
+    }
+    size_t cls = 0;
+    for(size_t step = 0; step < k_slab_steps; ++step){
+        while(sc.size[cls] < step * 16){
+            cls++;
+        }
+        sc.index[step] = (uint8_t)cls;
+    }
+    return sc;
+};
+
+static constexpr SlabClasses k_classes = slab_classes_build();
+static_assert(k_classes.size[k_slab_classes - 1] == k_slab_max, "slab classes");
+
+struct SlabHeap;
+
+// the header at the start of every page, objects follow it
+struct SlabPage {
+    DList node;             // in the class's partial list, unless full
+    SlabHeap *owner = NULL;
+    void *free_list = NULL; // freed objects, linked by their first word
+    char *fresh = NULL;     // never handed out, carved on demand
+    uint32_t cls = 0;
+    uint32_t used = 0;
+    uint32_t cap = 0;
+};
+
+const size_t k_page_hdr = (sizeof(SlabPage) + 63) & ~(size_t)63;
+
+struct SlabClass {
+    DList partial;          // pages with free objects
+    size_t pages = 0;
+    size_t objects = 0;
+    size_t req_bytes = 0;
+};
+
+struct SlabHeap {
+    SlabClass classes[k_slab_classes];
+    // objects freed by other threads: a lock-free stack, taken whole
+    std::atomic<void *> remote{nullptr};
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+    uint64_t remote_frees = 0;
+};
+
+static thread_local SlabHeap *t_heap = NULL;
+
+// malloc'd objects may be freed by any thread, so these are process-wide
+static std::atomic<size_t> g_large_objects{0};
+static std::atomic<size_t> g_large_bytes{0};
+
+static SlabHeap *heap_get(){
+    if(!t_heap){
+        t_heap = new SlabHeap();
+        for(SlabClass &c : t_heap->classes){
+            dlist_init(&c.partial);
+        }
+    }
+    return t_heap;
+};
+
+static SlabPage *page_of(void *ptr){
+    return (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_slab_page - 1));
+};
+
+static SlabPage *page_new(SlabHeap *heap, uint32_t cls){
+    void *mem = aligned_alloc(k_slab_page, k_slab_page);
+    if(!mem){
+        die("aligned_alloc()");
+    }
+    SlabPage *page = new (mem) SlabPage();
+    page->owner = heap;
+    page->cls = cls;
+    page->fresh = (char *)mem + k_page_hdr;
+    page->cap = (uint32_t)((k_slab_page - k_page_hdr) / k_classes.size[cls]);
+    SlabClass *c = &heap->classes[cls];
+    dlist_insert_before(&c->partial, &page->node);
+    c->pages++;
+    return page;
+};
+
+// by the owner thread
+static void page_put(SlabHeap *heap, void *ptr, size_t size){
+    SlabPage *page = page_of(ptr);
+    SlabClass *c = &heap->classes[page->cls];
+    *(void **)ptr = page->free_list;
+    page->free_list = ptr;
+    if(page->used-- == page->cap){
+        dlist_insert_before(&c->partial, &page->node);  // was full
+    }
+    c->objects--;
+    c->req_bytes -= size;
+    heap->frees++;
+    // an empty page goes back unless it's the only one left to allocate from
+    bool alone = c->partial.next == &page->node && page->node.next == &c->partial;
+    if(page->used == 0 && !alone){
+        dlist_detach(&page->node);
+        c->pages--;
+        page->~SlabPage();
+        free(page);
+    }
+};
+
+size_t slab_good_size(size_t size){
+    if(size > k_slab_max){
+        return (size + 15) & ~(size_t)15;
+    }
+    return k_classes.size[k_classes.index[(size + 15) / 16]];
+};
+
+void *slab_alloc(size_t size){
+    SlabHeap *heap = heap_get();
+    if(size > k_slab_max){
+        void *ptr = malloc(size);
+        if(!ptr){
+            die("malloc()");
+        }
+        g_large_objects.fetch_add(1, std::memory_order_relaxed);
+        g_large_bytes.fetch_add(size, std::memory_order_relaxed);
+        return ptr;
+    }
+    heap->allocs++;
+    uint32_t cls = k_classes.index[(size + 15) / 16];
+    SlabClass *c = &heap->classes[cls];
+    if(dlist_empty(&c->partial)){
+        slab_collect();
+    }
+    SlabPage *page = dlist_empty(&c->partial)
+        ? page_new(heap, cls) : container_of(c->partial.next, SlabPage, node);
+    void *ptr = page->free_list;
+    if(ptr){
+        page->free_list = *(void **)ptr;
+    } else {
+        ptr = page->fresh;
+        page->fresh += k_classes.size[cls];
+    }
+    if(++page->used == page->cap){
+        dlist_detach(&page->node);
+    }
+    c->objects++;
+    c->req_bytes += size;
+    return ptr;
+};
+
+// any thread
+void slab_free(void *ptr, size_t size){
+    if(!ptr){
+        return;
+    }
+    if(size > k_slab_max){
+        g_large_objects.fetch_sub(1, std::memory_order_relaxed);
+        g_large_bytes.fetch_sub(size, std::memory_order_relaxed);
+        return free(ptr);
+    }
+    SlabHeap *owner = page_of(ptr)->owner;
+    if(owner == t_heap){
+        return page_put(owner, ptr, size);
+    }
+    // the size rides along in the second word
+    ((size_t *)ptr)[1] = size;
+    void *head = owner->remote.load(std::memory_order_relaxed);
+    do {
+        *(void **)ptr = head;
+    } while(!owner->remote.compare_exchange_weak(
+        head, ptr, std::memory_order_release, std::memory_order_relaxed));
+};
+
+void slab_collect(){
+    SlabHeap *heap = t_heap;
+    if(!heap || !heap->remote.load(std::memory_order_relaxed)){
+        return;
+    }
+    void *ptr = heap->remote.exchange(nullptr, std::memory_order_acquire);
+    while(ptr){
+        void *next = *(void **)ptr;
+        page_put(heap, ptr, ((size_t *)ptr)[1]);
+        heap->remote_frees++;
+        ptr = next;
+    }
+};
+
+void slab_stats(SlabStats *stats){
+    SlabHeap *heap = heap_get();
+    *stats = SlabStats();
+    for(size_t i = 0; i < k_slab_classes; ++i){
+        const SlabClass &c = heap->classes[i];
+        stats->pages += c.pages;
+        stats->objects += c.objects;
+        stats->used_bytes += c.objects * k_classes.size[i];
+        stats->req_bytes += c.req_bytes;
+    }
+    stats->large_objects = g_large_objects.load(std::memory_order_relaxed);
+    stats->large_bytes = g_large_bytes.load(std::memory_order_relaxed);
+    stats->allocs = heap->allocs;
+    stats->frees = heap->frees;
+    stats->remote_frees = heap->remote_frees;
+};
@@ -0,0 +1,39 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Size-class slab allocator for the hot objects (Entry, ZNode, Conn).
+// Every thread has its own heap of 64KB pages, each page holding objects
+// of one class, so the common path takes no lock. An object freed by
+// another thread (the lazy-free pool, a reply on another reactor) goes
+// on its owner's remote list and is reclaimed by the owner later.
+// Sizes above the largest class fall back to malloc.
+const size_t k_slab_page = 64 * 1024;
+const size_t k_slab_max = 4096;     // the largest class
+
+void *slab_alloc(size_t size);
+// `size` is the one given to slab_alloc()
+void slab_free(void *ptr, size_t size);
+// the usable size of an allocation of `size` bytes
+size_t slab_good_size(size_t size);
+// reclaims the objects other threads have freed, by the owner thread
+void slab_collect();
+
+// the current thread's heap; the large allocations are process-wide
+struct SlabStats {
+    size_t pages = 0;           // pages in use, 64KB each
+    size_t objects = 0;         // live objects in the pages
+    size_t used_bytes = 0;      // their class sizes
+    size_t req_bytes = 0;       // their requested sizes
+    size_t large_objects = 0;   // allocations passed to malloc
+    size_t large_bytes = 0;
+    uint64_t allocs = 0;        // of slab objects
+    uint64_t frees = 0;
+    uint64_t remote_frees = 0;  // objects freed by other threads
+};
+
+void slab_stats(SlabStats *stats);
+
+#endif
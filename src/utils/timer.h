@@ -5,5 +5,8 @@
 #include <cstdint>
 
 uint64_t get_monotonic_msec();
+uint64_t get_monotonic_usec();
+// wall clock, for what outlives the process
+uint64_t get_realtime_msec();
 
 #endif
\ No newline at end of file
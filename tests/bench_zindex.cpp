@@ -0,0 +1,187 @@
+// The AVL tree against the B+tree as a sorted set index, on the
+// operations zquery needs: inserts, seeks, rank offsets, range scans and
+// deletes. Build with `make clean && make bench_zindex`, which uses -O2.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "avltree.h"
+#include "btree.h"
+
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type, member) );})
+
+struct Item {
+    AVLNode node;
+    double score = 0;
+    uint64_t id = 0;
+};
+
+static uint64_t now_ns(){
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+};
+
+static bool item_less(double score, uint64_t id, double rscore, uint64_t rid){
+    return score != rscore ? score < rscore : id < rid;
+};
+
+// the AVL tree, as zset.cpp uses it
+struct AVLIndex {
+    AVLNode *root = NULL;
+
+    void insert(Item *item){
+        avl_init(&item->node);
+        AVLNode *parent = NULL;
+        AVLNode **from = &root;
+        while(*from){
+            parent = *from;
+            Item *cur = container_of(parent, Item, node);
+            bool less = item_less(item->score, item->id, cur->score, cur->id);
+            from = less ? &parent->left : &parent->right;
+        }
+        *from = &item->node;
+        item->node.parent = parent;
+        root = avl_fix(&item->node);
+    }
+    void remove(Item *item){
+        root = avl_del(&item->node);
+    }
+    AVLNode *seekge(double score, uint64_t id){
+        AVLNode *found = NULL;
+        for(AVLNode *node = root; node;){
+            Item *cur = container_of(node, Item, node);
+            if(item_less(cur->score, cur->id, score, id)){
+                node = node->right;
+            } else {
+                found = node;
+                node = node->left;
+            }
+        }
+        return found;
+    }
+};
+
+static int id_cmp(void *item, const void *key){
+    uint64_t lhs = ((Item *)item)->id, rhs = *(const uint64_t *)key;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+};
+
+struct Result {
+    double insert, seek, offset, scan, remove;
+};
+
+static void report(const char *name, const Result &r){
+    printf("%-6s insert %6.0f  seek %6.0f  offset %6.0f  scan(100) %6.0f  delete %6.0f  ns/op\n",
+        name, r.insert, r.seek, r.offset, r.scan, r.remove);
+};
+
+static Result bench_avl(std::vector<Item> &items, const std::vector<uint32_t> &queries){
+    AVLIndex index;
+    uint64_t t0 = now_ns();
+    for(Item &item : items){
+        index.insert(&item);
+    }
+    uint64_t t1 = now_ns();
+    uint64_t sum = 0;
+    for(uint32_t q : queries){
+        AVLNode *node = index.seekge(items[q].score, items[q].id);
+        sum += container_of(node, Item, node)->id;
+    }
+    uint64_t t2 = now_ns();
+    AVLNode *first = index.seekge(-1, 0);
+    for(uint32_t q : queries){
+        AVLNode *node = avl_offset(first, q);
+        sum += container_of(node, Item, node)->id;
+    }
+    uint64_t t3 = now_ns();
+    for(uint32_t q : queries){
+        AVLNode *node = index.seekge(items[q].score, items[q].id);
+        for(int i = 0; i < 100 && node; ++i){
+            sum += container_of(node, Item, node)->id;
+            node = avl_offset(node, +1);
+        }
+    }
+    uint64_t t4 = now_ns();
+    for(Item &item : items){
+        index.remove(&item);
+    }
+    uint64_t t5 = now_ns();
+    double n = items.size(), m = queries.size();
+    if(sum == 42){
+        printf("\n");
+    }
+    return Result{(t1 - t0) / n, (t2 - t1) / m, (t3 - t2) / m, (t4 - t3) / m, (t5 - t4) / n};
+};
+
+static Result bench_btree(std::vector<Item> &items, const std::vector<uint32_t> &queries){
+    BTree tree;
+    uint64_t t0 = now_ns();
+    for(Item &item : items){
+        bt_insert(&tree, item.score, &item, &item.id, &id_cmp);
+    }
+    uint64_t t1 = now_ns();
+    uint64_t sum = 0;
+    for(uint32_t q : queries){
+        BPos pos = bt_seekge(&tree, items[q].score, &items[q].id, &id_cmp);
+        sum += ((Item *)bt_item(&pos)->ptr)->id;
+    }
+    uint64_t t2 = now_ns();
+    uint64_t zero = 0;
+    BPos first = bt_seekge(&tree, -1, &zero, &id_cmp);
+    for(uint32_t q : queries){
+        BPos pos = first;
+        bt_offset(&tree, &pos, q);
+        sum += ((Item *)bt_item(&pos)->ptr)->id;
+    }
+    uint64_t t3 = now_ns();
+    for(uint32_t q : queries){
+        BPos pos = bt_seekge(&tree, items[q].score, &items[q].id, &id_cmp);
+        for(int i = 0; i < 100 && pos.leaf; ++i){
+            sum += ((Item *)bt_item(&pos)->ptr)->id;
+            bt_offset(&tree, &pos, +1);
+        }
+    }
+    uint64_t t4 = now_ns();
+    for(Item &item : items){
+        bt_delete(&tree, item.score, &item.id, &id_cmp);
+    }
+    uint64_t t5 = now_ns();
+    double n = items.size(), m = queries.size();
+    if(sum == 42){
+        printf("\n");
+    }
+    return Result{(t1 - t0) / n, (t2 - t1) / m, (t3 - t2) / m, (t4 - t3) / m, (t5 - t4) / n};
+};
+
+int main(int argc, char **argv){
+    uint32_t sizes[] = {10000, 1000000, 4000000};
+    uint32_t nsizes = 3;
+    if(argc > 1){
+        sizes[0] = (uint32_t)atoi(argv[1]);
+        nsizes = 1;
+    }
+    srand(1);
+    for(uint32_t s = 0; s < nsizes; ++s){
+        uint32_t n = sizes[s];
+        std::vector<Item> items(n);
+        for(uint32_t i = 0; i < n; ++i){
+            items[i].score = rand() % (n / 4 + 1);
+            items[i].id = i;
+        }
+        // inserted in random order
+        std::shuffle(items.begin(), items.end(), std::mt19937(n));
+        std::vector<uint32_t> queries(200000);
+        for(uint32_t &q : queries){
+            q = rand() % n;
+        }
+        printf("%u members\n", n);
+        report("avl", bench_avl(items, queries));
+        report("btree", bench_btree(items, queries));
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <set>
+#include <vector>
 #include "avltree.h"
 
 
@@ -21,8 +22,9 @@ struct Container {
 
 static void add(Container &c, uint32_t val) {
     Data *data = new Data();    // allocate the data
-    avl_init(&data->node);
     data->val = val;
+    data->node.val = val;
+    avl_init(&data->node);
 
     AVLNode *cur = NULL;        // current node
     AVLNode **from = &c.root;   // the incoming pointer to the next node
@@ -64,6 +66,7 @@ static void avl_verify(AVLNode *parent, AVLNode *node) {
     avl_verify(node, node->right);
 
     assert(node->cnt == 1 + avl_cnt(node->left) + avl_cnt(node->right));
+    assert(node->sum == node->val + avl_sum(node->left) + avl_sum(node->right));
 
     uint32_t l = avl_height(node->left);
     uint32_t r = avl_height(node->right);
@@ -98,6 +101,18 @@ static void container_verify(
     std::multiset<uint32_t> extracted;
     extract(c.root, extracted);
     assert(extracted == ref);
+
+    // range sums, against the sorted values
+    std::vector<uint32_t> vals(ref.begin(), ref.end());
+    for (size_t lo = 0; lo <= vals.size(); lo += 1 + vals.size() / 8) {
+        double sum = 0;
+        for (size_t hi = lo; hi <= vals.size(); ++hi) {
+            assert(avl_range_sum(c.root, lo, hi) == sum);
+            if (hi < vals.size()) {
+                sum += vals[hi];
+            }
+        }
+    }
 }
 
 static void dispose(Container &c) {
@@ -162,6 +177,30 @@ static void test_remove(uint32_t sz) {
     }
 }
 
+// a built tree is balanced and still takes inserts and deletes
+static void test_build(uint32_t sz) {
+    Container c;
+    std::multiset<uint32_t> ref;
+    std::vector<AVLNode *> nodes;
+    for (uint32_t val = 0; val < sz; ++val) {
+        Data *data = new Data();
+        data->val = data->node.val = val * 2;
+        nodes.push_back(&data->node);
+        ref.insert(val * 2);
+    }
+    c.root = avl_build(nodes.data(), nodes.size());
+    container_verify(c, ref);
+    add(c, sz);
+    ref.insert(sz);
+    container_verify(c, ref);
+    if (sz > 0) {
+        assert(del(c, 0));
+        ref.erase(0);
+        container_verify(c, ref);
+    }
+    dispose(c);
+}
+
 int main() {
     Container c;
 
@@ -207,6 +246,7 @@ int main() {
         test_insert(i);
         test_insert_dup(i);
         test_remove(i);
+        test_build(i);
     }
 
     dispose(c);
@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include "btree.h"
+
+// the items are ids, ordered by (score, id)
+typedef std::pair<double, uint64_t> Item;
+
+static int id_cmp(void *item, const void *key){
+    uint64_t lhs = (uint64_t)(uintptr_t)item, rhs = *(const uint64_t *)key;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+};
+
+static void no_del(void *){};
+
+static bool item_eq(const BKey *key, const Item &item){
+    return key->score == item.first && (uint64_t)(uintptr_t)key->ptr == item.second;
+};
+
+static double kid_sum(BNode *node){
+    double sum = 0;
+    for(uint32_t i = 0; i < node->n; ++i){
+        sum += node->leaf ? node->keys[i].score : ((BInner *)node)->sum[i];
+    }
+    return sum;
+};
+
+// checks the counts, the sums, the order, the fill and the leaf links
+static uint64_t bt_verify(BNode *node, bool root, uint32_t depth, uint32_t *leaf_depth){
+    if(!root){
+        assert(node->n >= k_bt_min);
+    }
+    assert(node->n <= k_bt_max);
+    if(node->leaf){
+        assert(*leaf_depth == 0 || *leaf_depth == depth);
+        *leaf_depth = depth;
+        return node->n;
+    }
+    assert(node->n >= 2);
+    BInner *inner = (BInner *)node;
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < node->n; ++i){
+        BNode *kid = inner->kids[i];
+        assert(kid->keys[0].score == node->keys[i].score);
+        assert(kid->keys[0].ptr == node->keys[i].ptr);
+        uint64_t cnt = bt_verify(kid, false, depth + 1, leaf_depth);
+        assert(cnt == inner->cnt[i]);
+        assert(kid_sum(kid) == inner->sum[i]);
+        total += cnt;
+    }
+    return total;
+};
+
+static void verify(BTree *tree, const std::set<Item> &ref){
+    assert(tree->size == ref.size());
+    if(!tree->root){
+        assert(ref.empty());
+        return;
+    }
+    uint32_t leaf_depth = 0;
+    assert(bt_verify(tree->root, true, 0, &leaf_depth) == ref.size());
+
+    // the whole order, through the leaf links
+    BPos pos = bt_at(tree, 0);
+    uint64_t rank = 0;
+    for(const Item &item : ref){
+        assert(pos.leaf && pos.rank == rank++);
+        assert(item_eq(bt_item(&pos), item));
+        bt_offset(tree, &pos, +1);
+    }
+    assert(!pos.leaf);
+};
+
+static void test_random(uint32_t rounds, uint32_t range){
+    BTree tree;
+    std::set<Item> ref;
+    std::vector<Item> items;
+    for(uint32_t r = 0; r < rounds; ++r){
+        uint64_t id = rand() % range;
+        double score = rand() % 64;
+        Item item{score, id};
+        if(ref.count(item)){
+            void *ptr = bt_delete(&tree, score, &id, &id_cmp);
+            assert((uint64_t)(uintptr_t)ptr == id);
+            ref.erase(item);
+        } else if(rand() % 4 == 0){
+            assert(!bt_delete(&tree, score, &id, &id_cmp));
+        } else {
+            bt_insert(&tree, score, (void *)(uintptr_t)id, &id, &id_cmp);
+            ref.insert(item);
+        }
+        if(r % 1000 == 0){
+            verify(&tree, ref);
+            items.assign(ref.begin(), ref.end());
+        }
+        if(r % 1000 != 0 || items.empty()){
+            continue;
+        }
+        // seeks and offsets
+        for(uint32_t i = 0; i < 100; ++i){
+            double score = rand() % 64;
+            uint64_t id = rand() % range;
+            auto ge = std::lower_bound(items.begin(), items.end(), Item{score, id});
+            BPos pos = bt_seekge(&tree, score, &id, &id_cmp);
+            if(ge == items.end()){
+                assert(!pos.leaf);
+                continue;
+            }
+            int64_t rank = ge - items.begin();
+            assert(pos.leaf && (int64_t)pos.rank == rank && item_eq(bt_item(&pos), *ge));
+
+            // the scores are small integers, the sums are exact
+            int64_t hi = rank + rand() % 3000;
+            double sum = 0;
+            for(int64_t j = rank; j < hi && j < (int64_t)items.size(); ++j){
+                sum += items[j].first;
+            }
+            assert(bt_range_sum(&tree, rank, hi) == sum);
+
+            int64_t offset = rand() % 2 ? rand() % 80 - 40 : rand() % 4000 - 2000;
+            bt_offset(&tree, &pos, offset);
+            rank += offset;
+            if(rank < 0 || rank >= (int64_t)items.size()){
+                assert(!pos.leaf);
+            } else {
+                assert(pos.leaf && (int64_t)pos.rank == rank);
+                assert(item_eq(bt_item(&pos), items[rank]));
+            }
+        }
+    }
+    verify(&tree, ref);
+    bt_clear(&tree, &no_del);
+    assert(tree.bytes == 0 && tree.size == 0);
+};
+
+// sequential inserts and deletes from either end
+static void test_sequential(uint32_t n){
+    BTree tree;
+    std::set<Item> ref;
+    for(uint64_t i = 1; i <= n; ++i){
+        bt_insert(&tree, (double)i, (void *)(uintptr_t)i, &i, &id_cmp);
+        ref.insert({(double)i, i});
+    }
+    verify(&tree, ref);
+    for(uint64_t i = 0; i < n / 2; ++i){
+        uint64_t lo = i + 1, hi = n - i;
+        assert(bt_delete(&tree, (double)lo, &lo, &id_cmp));
+        assert(bt_delete(&tree, (double)hi, &hi, &id_cmp));
+        ref.erase({(double)lo, lo});
+        ref.erase({(double)hi, hi});
+        if(i % 500 == 0){
+            verify(&tree, ref);
+        }
+    }
+    verify(&tree, ref);
+    bt_clear(&tree, &no_del);
+    assert(tree.bytes == 0);
+};
+
+// a built tree passes the same checks and takes updates
+static void test_build(uint32_t n){
+    BTree tree;
+    std::set<Item> ref;
+    std::vector<BKey> items;
+    for(uint64_t i = 1; i <= n; ++i){
+        items.push_back(BKey{(double)(i / 3), (void *)(uintptr_t)i});
+        ref.insert({(double)(i / 3), i});
+    }
+    bt_build(&tree, items.data(), n);
+    verify(&tree, ref);
+    for(uint32_t r = 0; r < 2000 && n > 0; ++r){
+        uint64_t id = rand() % n + 1;   // not 0, a NULL pointer
+        Item item{(double)(id / 3), id};
+        if(ref.count(item)){
+            assert(bt_delete(&tree, item.first, &id, &id_cmp));
+            ref.erase(item);
+        } else {
+            bt_insert(&tree, item.first, (void *)(uintptr_t)id, &id, &id_cmp);
+            ref.insert(item);
+        }
+    }
+    verify(&tree, ref);
+    bt_clear(&tree, &no_del);
+    assert(tree.bytes == 0);
+};
+
+int main(){
+    srand(1);
+    test_random(20000, 100);
+    test_random(100000, 20000);
+    test_sequential(50000);
+    uint32_t sizes[] = {0, 1, 31, 32, 33, 64, 65, 1000, 1057, 40000};
+    for(uint32_t n : sizes){
+        test_build(n);
+    }
+    printf("btree tests passed\n");
+    return 0;
+}
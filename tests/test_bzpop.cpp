@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "test_keyspace.h"
+#include "connection_handlers.h"
+#include "reactor.h"
+#include "slab.h"
+
+static uint32_t g_resumed = 0;
+
+static void resumed(Conn *){
+    g_resumed++;
+};
+
+// a client without a socket, its responses stay in `outgoing`
+static Conn *conn_new(){
+    Conn *conn = new (slab_alloc(sizeof(Conn))) Conn();
+    conn->fd = 1 << 20;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    return conn;
+};
+
+// like try_one_request(): the pop found nothing and waits on the shard
+static void park(Conn *conn, std::vector<std::string> args){
+    Buffer &out = run(args);
+    assert(out.size() == 0 && g_data.async);
+    reactor_offload(conn, NULL);
+    assert(conn->blocked && conn->parked && conn->refs == 1);
+};
+
+// the conn is gone, as in conn_destroy()
+static void close_conn(Conn *conn){
+    dlist_detach(&conn->idle_node);
+    conn->fd = -1;
+    conn->closed = true;
+    reactor_cancel(conn);
+};
+
+static bool has_member(const char *key, const char *name){
+    return run({"zscore", key, name})[0] == TAG_DBL;
+};
+
+static void test_served(){
+    Conn *conn = conn_new();
+    park(conn, {"bzpopmin", "a", "b", "0"});
+    assert(g_data.zwaits.size() == 2);
+    run({"zadd", "b", "1", "m"});
+    reactor_drain(&resumed);
+    assert(g_resumed == 1 && !conn->blocked && !conn->parked && conn->refs == 0);
+    assert(conn->outgoing.total() > 0 && !has_member("b", "m"));
+    assert(g_data.zwaits.empty());
+    dlist_detach(&conn->idle_node);
+    conn->fd = -1;
+    conn_free(conn);
+};
+
+// a client closed while waiting without a timeout: its waiter and the
+// parked request go, and nothing is popped for it
+static void test_closed(){
+    Conn *conn = conn_new();
+    park(conn, {"bzpopmax", "z", "0"});
+    Conn *other = conn_new();
+    park(other, {"bzpopmax", "z", "0"});
+    close_conn(conn);
+    assert(conn->refs == 2);
+    reactor_drain(&resumed);
+    assert(g_resumed == 1 && g_data.zwaits.size() == 1);
+
+    // the next waiter still gets a member
+    run({"zadd", "z", "1", "m"});
+    reactor_drain(&resumed);
+    assert(g_resumed == 2 && !has_member("z", "m"));
+    assert(g_data.zwaits.empty() && g_data.zwait_timers.size == 0);
+    dlist_detach(&other->idle_node);
+    other->fd = -1;
+    conn_free(other);
+
+    // with a timeout, the timer goes too
+    conn = conn_new();
+    park(conn, {"bzpopmin", "z", "100"});
+    assert(g_data.zwait_timers.size == 1);
+    close_conn(conn);
+    reactor_drain(&resumed);
+    assert(g_data.zwaits.empty() && g_data.zwait_timers.size == 0);
+    run({"zadd", "z", "1", "m"});
+    assert(has_member("z", "m"));
+    run({"del", "z"});
+};
+
+// served before the cancel arrives: nothing is left to cancel
+static void test_closed_after_pop(){
+    Conn *conn = conn_new();
+    park(conn, {"bzpopmin", "z", "0"});
+    run({"zadd", "z", "1", "m"});
+    assert(!conn->parked && !has_member("z", "m"));
+    close_conn(conn);
+    uint32_t before = g_resumed;
+    reactor_drain(&resumed);
+    assert(g_resumed == before && g_data.zwaits.empty());
+};
+
+// infinite or negative timeouts are refused, huge ones are cut
+static void test_timeouts(){
+    for(const char *bad : {"inf", "-inf", "nan", "-1"}){
+        assert(run({"bzpopmin", "z", bad})[0] == TAG_ERR);
+    }
+    Conn *conn = conn_new();
+    uint64_t now_ms = get_monotonic_msec();
+    park(conn, {"bzpopmin", "z", "1e300"});
+    uint64_t next_ms = tw_next_expire(&g_data.zwait_timers);
+    assert(next_ms >= now_ms + k_max_block_ms && next_ms <= get_monotonic_msec() + k_max_block_ms);
+    close_conn(conn);
+    reactor_drain(&resumed);
+    assert(g_data.zwaits.empty() && g_data.zwait_timers.size == 0);
+};
+
+// a pop waiting longer than the idle timeout isn't closed by it, and is
+// timed from its response once served
+static void test_idle(){
+    Conn *conn = conn_new();
+    uint64_t idle_ms = get_monotonic_msec() + k_idle_timeout_ms + 1;
+    assert(conn_idle_expired(idle_ms) == conn);
+    park(conn, {"bzpopmin", "z", "3600"});
+    assert(conn_idle_expired(idle_ms) == NULL);
+    run({"zadd", "z", "1", "m"});
+    reactor_drain(&resumed);
+    assert(!conn->blocked && conn->outgoing.total() > 0);
+    assert(conn_idle_expired(conn->last_active_ms + k_idle_timeout_ms) == NULL);
+    assert(conn_idle_expired(conn->last_active_ms + k_idle_timeout_ms + 1) == conn);
+    dlist_detach(&conn->idle_node);
+    conn->fd = -1;
+    conn_free(conn);
+    assert(dlist_empty(&g_data.idle_list));
+};
+
+int main(){
+    keyspace_init();
+    reactors_init(1);
+    test_served();
+    test_closed();
+    test_closed_after_pop();
+    test_timeouts();
+    test_idle();
+    delete g_reactors[0];
+    printf("blocking pop tests passed\n");
+    return 0;
+}
@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "test_keyspace.h"
+#include "eviction.h"
+
+static bool is_err(Buffer &out, uint32_t code){
+    uint32_t got = 0;
+    if(out.size() < 5 || out[0] != TAG_ERR){
+        return false;
+    }
+    memcpy(&got, &out[1], 4);
+    return got == code;
+};
+
+// PTTL doesn't touch the key
+static bool exists(const std::string &key){
+    Buffer &out = run({"pttl", key});
+    int64_t ttl = 0;
+    memcpy(&ttl, &out[1], 8);
+    return ttl != -2;
+};
+
+static void set(const std::string &key){
+    Buffer &out = run({"set", key, std::string(100, 'v')});
+    assert(out[0] == TAG_NIL);
+};
+
+static void del_all(const char *prefix, size_t n){
+    for(size_t i = 0; i < n; ++i){
+        run({"del", prefix + std::to_string(i)});
+    }
+};
+
+// every write over the limit evicts first, the loop finishes the job
+static void fill_over(const char *prefix, size_t n){
+    for(size_t i = 0; i < n; ++i){
+        set(prefix + std::to_string(i));
+    }
+    while(evict_pending()){
+        evict_cycle();
+    }
+    assert(g_data.used_memory <= g_data.maxmemory);
+};
+
+// what an empty keyspace still holds
+static void start(uint32_t policy){
+    assert(hm_size(&g_data.db) == 0 && g_data.used_memory == hm_bytes(&g_data.db));
+    g_data.evict_policy = policy;
+    g_data.maxmemory = 0;
+    g_data.evicted_keys = 0;
+};
+
+static void test_noeviction(){
+    start(EVICT_NOEVICTION);
+    for(int i = 0; i < 100; ++i){
+        set("k" + std::to_string(i));
+    }
+    g_data.maxmemory = g_data.used_memory - 1;
+    assert(is_err(run({"set", "new", "v"}), ERR_OOM));
+    assert(is_err(run({"zadd", "z", "1", "m"}), ERR_OOM));
+    // reads and deletes still work, and free room
+    assert(exists("k0") && !evict_pending());
+    run({"del", "k0"});
+    set("new");
+    assert(g_data.evicted_keys == 0);
+    del_all("k", 100);
+    run({"del", "new"});
+};
+
+// the hot keys are touched last, a sample of 5 always holds an older one
+static void test_lru(){
+    start(EVICT_ALLKEYS_LRU);
+    for(int i = 0; i < 2000; ++i){
+        set("c" + std::to_string(i));
+    }
+    for(int i = 0; i < 20; ++i){
+        set("h" + std::to_string(i));
+    }
+    usleep(5000);
+    for(int i = 0; i < 20; ++i){
+        run({"get", "h" + std::to_string(i)});
+    }
+    g_data.maxmemory = g_data.used_memory;
+    fill_over("n", 100);
+    assert(g_data.evicted_keys >= 100);
+    for(int i = 0; i < 20; ++i){
+        assert(exists("h" + std::to_string(i)));
+    }
+    g_data.maxmemory = 0;
+    del_all("c", 2000);
+    del_all("h", 20);
+    del_all("n", 100);
+};
+
+// the hot keys are read often, the counters of the others stay at the start
+static void test_lfu(){
+    start(EVICT_ALLKEYS_LFU);
+    for(int i = 0; i < 2000; ++i){
+        set("c" + std::to_string(i));
+    }
+    for(int i = 0; i < 20; ++i){
+        std::string key = "h" + std::to_string(i);
+        set(key);
+        for(int r = 0; r < 200; ++r){
+            run({"get", key});
+        }
+    }
+    g_data.maxmemory = g_data.used_memory;
+    fill_over("n", 100);
+    assert(g_data.evicted_keys >= 100);
+    for(int i = 0; i < 20; ++i){
+        assert(exists("h" + std::to_string(i)));
+    }
+    g_data.maxmemory = 0;
+    del_all("c", 2000);
+    del_all("h", 20);
+    del_all("n", 100);
+};
+
+// only keys with a TTL go, the closest expiry first
+static void test_volatile_ttl(){
+    start(EVICT_VOLATILE_TTL);
+    const int k_keys = 1000;
+    for(int i = 0; i < k_keys; ++i){
+        set("p" + std::to_string(i));
+        std::string key = "t" + std::to_string(i);
+        set(key);
+        run({"pexpire", key, std::to_string(100000 + i * 100)});
+    }
+    g_data.maxmemory = g_data.used_memory;
+    // an evicted key frees its TTL too, more than a new one takes
+    fill_over("n", 200);
+    assert(g_data.evicted_keys >= 150);
+    size_t evicted = 0, rank_sum = 0;
+    for(int i = 0; i < k_keys; ++i){
+        assert(exists("p" + std::to_string(i)));
+        if(!exists("t" + std::to_string(i))){
+            evicted++;
+            rank_sum += i;
+        }
+    }
+    assert(evicted == g_data.evicted_keys);
+    // the best of 5 samples is mostly among the first sixth
+    assert(rank_sum / evicted < k_keys / 3);
+    for(int i = k_keys * 9 / 10; i < k_keys; ++i){
+        assert(exists("t" + std::to_string(i)));
+    }
+
+    // nothing left to evict: the writes fail
+    del_all("t", k_keys);
+    g_data.maxmemory = g_data.used_memory - 1;
+    assert(is_err(run({"set", "x", "v"}), ERR_OOM));
+    assert(!evict_pending());
+    g_data.maxmemory = 0;
+    del_all("p", k_keys);
+    del_all("n", 200);
+};
+
+// the members and the hash slots of a large set are counted, and given
+// back with the key
+static void test_zset_memory(){
+    start(EVICT_NOEVICTION);
+    std::vector<std::string> args = {"zadd", "z"};
+    for(int i = 0; i < 50000; ++i){
+        args.push_back(std::to_string(i));
+        args.push_back("m" + std::to_string(i));
+    }
+    run(args);
+    size_t used = g_data.used_memory;
+    // a node and a slot per member at least
+    assert(used > 50000 * (sizeof(ZNode) + sizeof(HNode *)));
+    run({"del", "z"});
+    assert(g_data.used_memory == hm_bytes(&g_data.db));
+};
+
+// the keyspace's own slots are counted, the old table too while a resize
+// moves the keys
+static void test_db_memory(){
+    start(EVICT_NOEVICTION);
+    size_t keys = 0;
+    bool resized = false;
+    for(; keys < 100000; ++keys){
+        set("k" + std::to_string(keys));
+        assert(g_data.db_bytes == hm_bytes(&g_data.db));
+        resized |= g_data.db.older.size > 0;
+    }
+    assert(resized);
+    assert(g_data.db_bytes >= keys / k_max_load_factor * sizeof(HNode *));
+    del_all("k", keys);
+    assert(g_data.used_memory == g_data.db_bytes);
+};
+
+int main(){
+    keyspace_init();
+    test_noeviction();
+    test_lru();
+    test_lfu();
+    test_volatile_ttl();
+    test_zset_memory();
+    test_db_memory();
+    printf("eviction tests passed\n");
+    return 0;
+}
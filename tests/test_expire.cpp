@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "test_keyspace.h"
+
+static void set_ttl(const std::string &key, uint64_t ttl_ms){
+    run({"set", key, "v"});
+    run({"pexpire", key, std::to_string(ttl_ms)});
+};
+
+static void start(uint32_t timers){
+    assert(hm_size(&g_data.db) == 0);
+    g_data.timers = timers;
+    g_data.expire = ExpireStats();
+};
+
+// an expired key is deleted by the read that finds it, without the cycle
+static void test_lazy(uint32_t timers){
+    start(timers);
+    set_ttl("a", 20);
+    set_ttl("b", 100000);
+    run({"set", "c", "v"});
+    usleep(30 * 1000);
+    assert(hm_size(&g_data.db) == 3);
+    assert(run({"get", "a"})[0] == TAG_NIL);
+    assert(hm_size(&g_data.db) == 2);
+    assert(g_data.expire.keys == 1 && g_data.expire.lazy == 1);
+    assert(run({"get", "b"})[0] == TAG_STR);
+    assert(run({"get", "c"})[0] == TAG_STR);
+    assert(g_data.expire.lazy == 1);
+
+    // due now: gone for a read and for the cycle alike, on both engines
+    set_ttl("d", 0);
+    assert(run({"get", "d"})[0] == TAG_NIL);
+    set_ttl("d", 0);
+    expire_cycle();
+    assert(hm_size(&g_data.db) == 2);
+    assert(g_data.expire.keys == 3 && g_data.expire.lazy == 2);
+    run({"del", "b"});
+    run({"del", "c"});
+};
+
+// a backlog larger than one cycle: the cycle stops near its budget, which
+// doubles until the backlog is cleared and then halves back
+static void test_budget(uint32_t timers){
+    start(timers);
+    const size_t k_keys = 50000;
+    const uint64_t k_ttl_ms = 300;
+    uint64_t set_ms = get_monotonic_msec();
+    for(size_t i = 0; i < k_keys; ++i){
+        set_ttl("k" + std::to_string(i), k_ttl_ms);
+    }
+    usleep((k_ttl_ms + 100) * 1000);
+
+    ExpireStats &st = g_data.expire;
+    uint32_t budget = st.budget_us;
+    assert(budget == k_expire_budget_us);
+    uint64_t start_us = get_monotonic_usec();
+    expire_cycle();
+    uint64_t took_us = get_monotonic_usec() - start_us;
+    assert(took_us < budget + 2000);
+    assert(st.keys > 0 && st.keys < k_keys);
+    assert(st.budget_us == budget * 2);
+    // measured from the oldest key left, none of which was due before
+    // set_ms + k_ttl_ms
+    assert(st.lag_ms >= 100);
+    assert(st.lag_ms <= get_monotonic_msec() - (set_ms + k_ttl_ms));
+
+    size_t cycles = 1;
+    while(hm_size(&g_data.db) > 0){
+        budget = st.budget_us;
+        expire_cycle();
+        cycles++;
+        assert(st.budget_us <= k_expire_budget_max_us);
+        if(hm_size(&g_data.db) > 0){
+            assert(st.budget_us == std::min(k_expire_budget_max_us, budget * 2));
+        }
+    }
+    assert(cycles > 2 && st.keys == k_keys && st.lazy == 0);
+    assert(st.budget_us == std::max(k_expire_budget_us, budget / 2));
+    assert(st.lag_ms == 0);
+    while(st.budget_us > k_expire_budget_us){
+        budget = st.budget_us;
+        expire_cycle();
+        assert(st.budget_us == budget / 2);
+    }
+};
+
+int main(){
+    keyspace_init();
+    for(uint32_t timers : {TIMERS_HEAP, TIMERS_WHEEL}){
+        test_lazy(timers);
+        test_budget(timers);
+    }
+    printf("expiry tests passed\n");
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include "hashmap.h"
+
+struct Item {
+    HNode node;
+    uint32_t key = 0;
+    uint32_t val = 0;
+};
+
+// pairs of keys share a hash code, so the `eq` callback is exercised
+static uint64_t hash_key(uint32_t key){
+    return ((uint64_t)(key / 2) * 0x9E3779B97F4A7C15ull) >> 32;
+};
+
+static bool item_eq(HNode *lhs, HNode *rhs){
+    return container_of(lhs, Item, node)->key == container_of(rhs, Item, node)->key;
+};
+
+static Item *find(HMap *hmap, uint32_t key){
+    Item probe;
+    probe.key = key;
+    probe.node.hcode = hash_key(key);
+    HNode *node = hm_lookup(hmap, &probe.node, &item_eq);
+    return node ? container_of(node, Item, node) : NULL;
+};
+
+static bool count_cb(HNode *, void *arg){
+    ++*(size_t *)arg;
+    return true;
+};
+
+static void verify(HMap *hmap, std::unordered_map<uint32_t, uint32_t> &ref){
+    assert(hm_size(hmap) == ref.size());
+    size_t n = 0;
+    hm_foreach(hmap, &count_cb, &n);
+    assert(n == ref.size());
+    for(auto &kv : ref){
+        Item *it = find(hmap, kv.first);
+        assert(it && it->val == kv.second);
+    }
+};
+
+static void test_case(uint32_t nops, uint32_t keyspace){
+    HMap hmap;
+    std::unordered_map<uint32_t, uint32_t> ref;
+    for(uint32_t i = 0; i < nops; ++i){
+        uint32_t key = rand() % keyspace;
+        bool present = ref.count(key);
+        if(i % 7919 == 0){
+            hm_reserve(&hmap, rand() % (keyspace + 1));
+        }
+        if(rand() % 3 == 0){
+            Item probe;
+            probe.key = key;
+            probe.node.hcode = hash_key(key);
+            HNode *node = hm_delete(&hmap, &probe.node, &item_eq);
+            assert((node != NULL) == present);
+            if(node){
+                delete container_of(node, Item, node);
+                ref.erase(key);
+            }
+        } else if(present){
+            Item *it = find(&hmap, key);
+            assert(it && it->val == ref[key]);
+            it->val = ref[key] = i;
+        } else {
+            Item *it = new Item();
+            it->key = key;
+            it->val = i;
+            it->node.hcode = hash_key(key);
+            hm_insert(&hmap, &it->node);
+            ref[key] = i;
+        }
+        if(i % 10000 == 0){
+            verify(&hmap, ref);
+        }
+    }
+    verify(&hmap, ref);
+    for(auto &kv : ref){
+        Item probe;
+        probe.key = kv.first;
+        probe.node.hcode = hash_key(kv.first);
+        delete container_of(hm_delete(&hmap, &probe.node, &item_eq), Item, node);
+    }
+    assert(hm_size(&hmap) == 0);
+    hm_clear(&hmap);
+};
+
+// a reserved map takes the nodes without starting another resize
+static void test_reserve(uint32_t n){
+    HMap hmap;
+    std::unordered_map<uint32_t, uint32_t> ref;
+    hm_reserve(&hmap, n);
+    HMap before = hmap;
+    for(uint32_t key = 0; key < n; ++key){
+        Item *it = new Item();
+        it->key = key;
+        it->node.hcode = hash_key(key);
+        hm_insert(&hmap, &it->node);
+        ref[key] = 0;
+    }
+    assert(hmap.newer.mask == before.newer.mask);
+    verify(&hmap, ref);
+    for(uint32_t key = 0; key < n; ++key){
+        Item probe;
+        probe.key = key;
+        probe.node.hcode = hash_key(key);
+        delete container_of(hm_delete(&hmap, &probe.node, &item_eq), Item, node);
+    }
+    hm_clear(&hmap);
+};
+
+int main(){
+    srand(1);
+    test_reserve(1);
+    test_reserve(100000);
+    test_case(1000, 50);
+    test_case(200000, 1000);
+    test_case(300000, 200000);
+    printf("OK\n");
+    return 0;
+};
@@ -0,0 +1,37 @@
+#ifndef TEST_KEYSPACE_H
+#define TEST_KEYSPACE_H
+
+// For the tests that run commands on the keyspace of one shard, the way
+// a reactor does, without a server around it.
+
+#include <string>
+#include <vector>
+#include "data_store.h"
+#include "buffer_operations.h"
+#include "utils/timer.h"
+
+// never destroyed, the workers outlive main()
+static ThreadPool *g_pool = new ThreadPool();
+
+// the response, until the next command
+static Buffer &run(std::vector<std::string> args){
+    static Buffer out;
+    CmdArgs cmd;
+    for(const std::string &arg : args){
+        args_push(cmd, arg);
+    }
+    buf_consume(out, out.size());
+    do_request(cmd, out);
+    return out;
+};
+
+// the shard's pool and timers, before the first command
+static void keyspace_init(){
+    thread_pool_init(g_pool, 2);
+    g_data.thread_pool = g_pool;
+    dlist_init(&g_data.idle_list);
+    tw_init(&g_data.wheel, get_monotonic_msec());
+    tw_init(&g_data.zwait_timers, get_monotonic_msec());
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "rdb.h"
+#include "data_store.h"
+#include "reactor.h"
+#include "buffer_operations.h"
+
+static void test_crc64(){
+    const char *s = "123456789";
+    assert(crc64(0, (const uint8_t *)s, 9) == 0xe9c6d914c4b8d9caULL);
+    // the 8-byte loop against the byte loop, at every split
+    std::string data;
+    for(int i = 0; i < 1000; ++i){
+        data.push_back((char)(i * 131 + 7));
+    }
+    const uint8_t *p = (const uint8_t *)data.data();
+    uint64_t whole = crc64(0, p, data.size());
+    for(size_t cut = 0; cut <= 17; ++cut){
+        assert(crc64(crc64(0, p, cut), p + cut, data.size() - cut) == whole);
+    }
+};
+
+struct Key {
+    uint8_t type;
+    std::string key;
+    std::string val;
+    std::vector<std::pair<double, std::string>> members;
+    int64_t ttl_ms;
+};
+
+static std::vector<Key> sample(){
+    std::vector<Key> keys;
+    keys.push_back({RDB_STR, "empty", "", {}, -1});
+    keys.push_back({RDB_STR, "ttl", "value", {}, 12345});
+    // past the write buffer
+    keys.push_back({RDB_STR, "big", std::string(200 * 1000, 'x'), {}, -1});
+    Key z = {RDB_ZSET, "zset", "", {}, 0};
+    for(int i = 0; i < 5000; ++i){
+        z.members.push_back({i * 0.5, "m" + std::to_string(i)});
+    }
+    keys.push_back(z);
+    keys.push_back({RDB_STR, std::string("bin\0key", 7), std::string("\xff\0\x80", 3), {}, -1});
+    return keys;
+};
+
+static void write_file(const char *path, const std::vector<Key> &keys){
+    RdbWriter w;
+    bool ok = rdb_create(&w, path, 1, 3, 1700000000000ULL);
+    assert(ok);
+    for(const Key &k : keys){
+        if(k.type == RDB_STR){
+            rdb_write_str(&w, k.key, k.val, k.ttl_ms);
+            continue;
+        }
+        rdb_write_zset(&w, k.key, k.members.size(), k.ttl_ms);
+        for(const auto &m : k.members){
+            rdb_write_member(&w, m.first, m.second);
+        }
+    }
+    ok = rdb_finish(&w, path);
+    assert(ok);
+    assert(access(w.tmp.c_str(), F_OK) != 0);
+};
+
+static void test_roundtrip(const char *path){
+    std::vector<Key> keys = sample();
+    write_file(path, keys);
+
+    RdbReader r;
+    std::string err;
+    bool ok = rdb_open(&r, path, err);
+    assert(ok);
+    assert(r.part == 1 && r.parts == 3 && r.saved_ms == 1700000000000ULL);
+    RdbRecord rec;
+    for(const Key &k : keys){
+        ok = rdb_next(&r, &rec);
+        assert(ok);
+        assert(rec.type == k.type && rec.key == k.key && rec.ttl_ms == k.ttl_ms);
+        if(k.type == RDB_STR){
+            assert(rec.val == k.val);
+            continue;
+        }
+        assert(rec.n == k.members.size());
+        for(const auto &m : k.members){
+            double score = 0;
+            std::string_view name;
+            ok = rdb_next_member(&r, &score, &name);
+            assert(ok);
+            assert(score == m.first && name == m.second);
+        }
+    }
+    assert(!rdb_next(&r, &rec) && !r.err);
+};
+
+static void test_damaged(const char *path){
+    write_file(path, sample());
+    std::string data;
+    {
+        RdbReader r;
+        std::string err;
+        bool ok = rdb_open(&r, path, err);
+        assert(ok);
+        data = r.data;
+    }
+    // a flipped bit anywhere, and a truncated file
+    for(size_t pos : {(size_t)0, (size_t)30, data.size() / 2, data.size() - 1}){
+        std::string bad = data;
+        bad[pos] ^= 0x10;
+        FILE *f = fopen(path, "wb");
+        fwrite(bad.data(), 1, bad.size(), f);
+        fclose(f);
+        RdbReader r;
+        std::string err;
+        assert(!rdb_open(&r, path, err) && !err.empty());
+    }
+    FILE *f = fopen(path, "wb");
+    fwrite(data.data(), 1, data.size() - 100, f);
+    fclose(f);
+    RdbReader r;
+    std::string err;
+    assert(!rdb_open(&r, path, err));
+    unlink(path);
+    assert(!rdb_open(&r, path, err));
+};
+
+// a part of a save of two shards, with `saved_ms` in its header
+static void write_part(const std::string &path, uint32_t part, uint64_t saved_ms){
+    RdbWriter w;
+    bool ok = rdb_create(&w, path.c_str(), part, 2, saved_ms);
+    assert(ok);
+    rdb_write_str(&w, "k" + std::to_string(part), "v", -1);
+    ok = rdb_finish(&w, path.c_str());
+    assert(ok);
+};
+
+// the server's load, in a child since a bad snapshot exits; the status
+static int load_child(const std::string &path){
+    pid_t pid = fork();
+    if(pid == 0){
+        reactors_init(1);
+        db_load_read(path);
+        db_load();
+        CmdArgs cmd;
+        args_push(cmd, "get");
+        args_push(cmd, "k1");
+        Buffer out;
+        do_request(cmd, out);
+        _exit(out[0] == TAG_STR ? 0 : 2);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+};
+
+// both parts of one save are loaded, a part of another save under its
+// name is refused
+static void test_parts(const std::string &path){
+    std::string part0 = rdb_part_path(path, 1000, 0, 2);
+    std::string part1 = rdb_part_path(path, 1000, 1, 2);
+    write_part(part0, 0, 1000);
+    write_part(part1, 1, 1000);
+    assert(rdb_complete(path, 1000, 2));
+    assert(load_child(path) == 0);
+    write_part(part1, 1, 1001);
+    assert(load_child(path) == 1);
+    unlink(part0.c_str());
+    unlink(part1.c_str());
+};
+
+// one shard's part of a SAVE sent to the two shards of a server, in a
+// child; `busy` as if its BGSAVE was still running. The reply's status.
+static int save_child(const std::string &path, uint32_t shard, uint64_t unix_ms, bool busy){
+    pid_t pid = fork();
+    if(pid == 0){
+        reactors_init(2);
+        g_data.shard_id = shard;
+        g_data.dbfilename = path;
+        g_data.save.child = busy ? getppid() : -1;
+        CmdArgs cmd;
+        args_push(cmd, "set");
+        args_push(cmd, shard ? "k1" : "k0");
+        args_push(cmd, "v");
+        Buffer out;
+        do_request(cmd, out);
+        CmdArgs save;
+        args_push(save, "save");
+        buf_consume(out, out.size());
+        g_data.scatter_unix_ms = unix_ms;
+        do_request(save, out);
+        // [OK] or [error]
+        _exit(out[5] == TAG_STR ? 0 : 3);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+};
+
+// a save refused on one shard leaves the last complete one to load, until
+// a later save is complete and replaces both
+static void test_partial_save(const std::string &path){
+    assert(save_child(path, 0, 2000, false) == 0);
+    assert(save_child(path, 1, 2000, false) == 0);
+    assert(save_child(path, 0, 2001, false) == 0);
+    assert(save_child(path, 1, 2001, true) == 3);
+    uint64_t saved_ms = 0;
+    uint32_t parts = 0;
+    assert(rdb_latest(path, &saved_ms, &parts) && saved_ms == 2000 && parts == 2);
+    assert(load_child(path) == 0);
+
+    assert(save_child(path, 1, 2002, false) == 0);
+    assert(save_child(path, 0, 2002, false) == 0);
+    assert(rdb_latest(path, &saved_ms, &parts) && saved_ms == 2002);
+    assert(load_child(path) == 0);
+    for(uint64_t ms : {2000, 2001}){
+        for(uint32_t part = 0; part < 2; ++part){
+            assert(access(rdb_part_path(path, ms, part, 2).c_str(), F_OK) != 0);
+        }
+    }
+    // one shard: the file itself, which replaces the parts
+    RdbWriter w;
+    bool ok = rdb_create(&w, path.c_str(), 0, 1, 3000);
+    assert(ok);
+    rdb_write_str(&w, "k1", "v", -1);
+    ok = rdb_finish(&w, path.c_str());
+    assert(ok);
+    rdb_prune(path, 3000);
+    assert(rdb_latest(path, &saved_ms, &parts) && saved_ms == 3000 && parts == 1);
+    assert(access(rdb_part_path(path, 2002, 0, 2).c_str(), F_OK) != 0);
+    assert(load_child(path) == 0);
+};
+
+int main(){
+    std::string path = "/tmp/test_rdb." + std::to_string(getpid());
+    test_crc64();
+    test_roundtrip(path.c_str());
+    test_damaged(path.c_str());
+    test_parts(path);
+    test_partial_save(path);
+    unlink(path.c_str());
+    printf("snapshot file tests passed\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "slab.h"
+
+struct Obj {
+    char *ptr = NULL;
+    size_t size = 0;
+};
+
+static size_t rand_size(){
+    switch(rand() % 4){
+    case 0: return 1 + rand() % 64;
+    case 1: return 1 + rand() % 512;
+    case 2: return 1 + rand() % k_slab_max;
+    default: return k_slab_max + 1 + rand() % 10000;   // malloc
+    }
+};
+
+// every object is filled with a byte, overlapping objects would clobber it
+static void obj_check(const Obj &o){
+    for(size_t i = 0; i < o.size; ++i){
+        assert(o.ptr[i] == (char)o.size);
+    }
+};
+
+static void test_local(uint32_t n, uint32_t rounds){
+    std::vector<Obj> objs(n);
+    for(uint32_t r = 0; r < rounds; ++r){
+        Obj &o = objs[rand() % n];
+        if(o.ptr){
+            obj_check(o);
+            slab_free(o.ptr, o.size);
+            o = Obj();
+            continue;
+        }
+        o.size = rand_size();
+        o.ptr = (char *)slab_alloc(o.size);
+        assert(slab_good_size(o.size) >= o.size);
+        assert(((uintptr_t)o.ptr & 15) == 0);
+        memset(o.ptr, (char)o.size, o.size);
+    }
+
+    SlabStats st;
+    slab_stats(&st);
+    size_t objects = 0, req = 0;
+    for(const Obj &o : objs){
+        if(o.ptr && o.size <= k_slab_max){
+            objects++;
+            req += o.size;
+        }
+    }
+    assert(st.objects == objects && st.req_bytes == req);
+    assert(st.used_bytes >= st.req_bytes);
+    assert(st.pages * k_slab_page >= st.used_bytes);
+
+    for(Obj &o : objs){
+        if(o.ptr){
+            obj_check(o);
+            slab_free(o.ptr, o.size);
+        }
+    }
+    slab_stats(&st);
+    assert(st.objects == 0 && st.req_bytes == 0 && st.large_objects == 0);
+    // at most one empty page is kept per class
+    assert(st.pages <= 32);
+};
+
+static void *remote_free(void *arg){
+    std::vector<Obj> &objs = *(std::vector<Obj> *)arg;
+    for(Obj &o : objs){
+        obj_check(o);
+        slab_free(o.ptr, o.size);
+    }
+    return NULL;
+};
+
+// objects freed by another thread go back to the owner on slab_collect()
+static void test_remote(uint32_t n){
+    std::vector<Obj> objs(n);
+    for(Obj &o : objs){
+        o.size = 1 + rand() % k_slab_max;
+        o.ptr = (char *)slab_alloc(o.size);
+        memset(o.ptr, (char)o.size, o.size);
+    }
+    SlabStats before;
+    slab_stats(&before);
+
+    pthread_t th;
+    pthread_create(&th, NULL, &remote_free, &objs);
+    pthread_join(th, NULL);
+
+    SlabStats st;
+    slab_stats(&st);
+    assert(st.objects == before.objects);   // not reclaimed yet
+    slab_collect();
+    slab_stats(&st);
+    assert(st.objects == 0 && st.req_bytes == 0);
+    assert(st.remote_frees == before.remote_frees + n);
+};
+
+int main(){
+    srand(1);
+    test_local(10, 1000);
+    test_local(1000, 100000);
+    test_local(20000, 200000);
+    test_remote(1);
+    test_remote(50000);
+    printf("slab tests passed\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "thread_pool.h"
+
+// never destroyed, the workers outlive main
+static ThreadPool &g_pool = *new ThreadPool;
+static std::atomic<uint64_t> g_done{0};
+
+static void count_task(void *){
+    g_done.fetch_add(1);
+};
+
+static void wait_done(uint64_t n){
+    while(g_done.load() < n){
+        usleep(100);
+    }
+    assert(g_done.load() == n);
+};
+
+// many submitters at once, past the size of the injection queue
+static void *submitter(void *arg){
+    size_t n = (size_t)arg;
+    for(size_t i = 0; i < n; ++i){
+        thread_pool_queue(&g_pool, &count_task, NULL);
+    }
+    return NULL;
+};
+
+static void test_inject(){
+    g_done = 0;
+    const size_t k_threads = 4, k_each = 50000;
+    pthread_t threads[k_threads];
+    for(pthread_t &t : threads){
+        pthread_create(&t, NULL, &submitter, (void *)k_each);
+    }
+    for(pthread_t &t : threads){
+        pthread_join(t, NULL);
+    }
+    wait_done(k_threads * k_each);
+};
+
+// a task splits its range until it is one unit, so the workers fill their
+// own deques past the initial ring size and the idle ones steal
+static void split_task(void *arg){
+    uintptr_t n = (uintptr_t)arg;
+    if(n == 1){
+        g_done.fetch_add(1);
+        return;
+    }
+    thread_pool_queue(&g_pool, &split_task, (void *)(n / 2));
+    thread_pool_queue(&g_pool, &split_task, (void *)(n - n / 2));
+};
+
+static void test_split(){
+    g_done = 0;
+    thread_pool_queue(&g_pool, &split_task, (void *)(uintptr_t)100000);
+    wait_done(100000);
+    // a long flat burst from one worker
+    g_done = 0;
+    struct Burst {
+        static void run(void *){
+            for(int i = 0; i < 5000; ++i){
+                thread_pool_queue(&g_pool, &count_task, NULL);
+            }
+        }
+    };
+    thread_pool_queue(&g_pool, &Burst::run, NULL);
+    wait_done(5000);
+};
+
+// one task at a time, into a pool that has gone to sleep
+static void test_park(){
+    for(uint64_t i = 1; i <= 200; ++i){
+        g_done = 0;
+        if(i % 20 == 0){
+            usleep(2000);
+        }
+        thread_pool_queue(&g_pool, &count_task, NULL);
+        wait_done(1);
+    }
+};
+
+static void add_task(void *arg){
+    uint64_t *slot = (uint64_t *)arg;
+    *slot += 1;
+};
+
+static void test_run(){
+    std::vector<uint64_t> slots(64, 0);
+    std::vector<void *> args;
+    for(uint64_t &slot : slots){
+        args.push_back(&slot);
+    }
+    for(int r = 0; r < 100; ++r){
+        thread_pool_run(&g_pool, &add_task, args.data(), args.size());
+    }
+    for(uint64_t slot : slots){
+        assert(slot == 100);
+    }
+};
+
+int main(){
+    thread_pool_init(&g_pool, 4);
+    test_inject();
+    test_split();
+    test_park();
+    test_run();
+
+    // every task but the thread_pool_run shares of the caller; a worker
+    // counts a task after it returns
+    uint64_t expect = 200000 + 199999 + 5001 + 200 + 100 * 63;
+    PoolStats stats;
+    for(thread_pool_stats(&g_pool, &stats); stats.tasks < expect; thread_pool_stats(&g_pool, &stats)){
+        usleep(100);
+    }
+    assert(stats.tasks == expect);
+    assert(stats.threads == 4 && stats.queued == 0);
+    assert(stats.submitted == 200000 + 1 + 1 + 200 + 100 * 63);
+    printf("steals %llu, parks %llu\n", (unsigned long long)stats.steals,
+        (unsigned long long)stats.parks);
+    printf("thread pool tests passed\n");
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "event_loop.h"
+#include "protocol_serialization.h"
+
+#ifdef USE_IO_URING
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+static int listen_any(){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    assert(rv == 0 && listen(fd, 16) == 0);
+    return fd;
+};
+
+// A client resets the conn in the batch that armed its receive, as in
+// uring_handle_cqe(): the conn is closed with its SQEs still queued and
+// the fd goes to a new client right away. The dead conn must not read
+// what the new one sends.
+static void test_close_reused_fd(EventLoop *loop){
+    int a[2], b[2];
+    int rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, a);
+    assert(rv == 0);
+    Conn dead;
+    dead.fd = a[0];
+    dead.want_read = true;
+    ev_watch(loop, &dead);
+    assert(dead.uring_recv && dead.refs == 1);
+    // conn_destroy()
+    ev_unwatch(loop, &dead);
+    assert(loop->ring.sq_pending == 0);
+    close(dead.fd);
+
+    rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b);
+    assert(rv == 0 && b[0] == a[0]);
+    const char msg[] = "get k";
+    rv = (int)write(b[1], msg, sizeof(msg));
+    assert(rv == (int)sizeof(msg));
+
+    // until the receive of the dead conn is gone
+    while(dead.refs > 0){
+        rv = uring_submit_and_wait(&loop->ring, 1000);
+        assert(rv >= 0 || errno == EINTR);
+        while(struct io_uring_cqe *cqe = uring_peek_cqe(&loop->ring)){
+            if(cqe->user_data == ((uint64_t)(uintptr_t)&dead | UR_RECV)){
+                assert(cqe->res <= 0);
+                if(cqe->flags & IORING_CQE_F_BUFFER){
+                    uring_buf_recycle(&loop->ring, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+                }
+                if(!(cqe->flags & IORING_CQE_F_MORE)){
+                    dead.refs--;
+                }
+            }
+            uring_cqe_seen(&loop->ring);
+        }
+    }
+    // still there for the new client
+    char got[sizeof(msg)];
+    rv = (int)read(b[0], got, sizeof(got));
+    assert(rv == (int)sizeof(msg) && memcmp(got, msg, sizeof(msg)) == 0);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+};
+
+int main(){
+    int listen_fd = listen_any();
+    int wake_fd = eventfd(0, EFD_NONBLOCK);
+    EventLoop loop;
+    if(!ev_init(&loop, EV_IO_URING, listen_fd, wake_fd)){
+        printf("io_uring is not usable, io_uring tests skipped\n");
+        return 0;
+    }
+    for(int i = 0; i < 100; ++i){
+        test_close_reused_fd(&loop);
+    }
+    printf("io_uring tests passed\n");
+    return 0;
+}
+#else
+int main(){
+    printf("built without io_uring (IO_URING=1), io_uring tests skipped\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,89 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include <vector>
+#include "timer_wheel.h"
+
+struct Item {
+    TWTimer timer;
+    uint32_t id = 0;
+};
+
+// the expiry of every armed timer
+typedef std::multiset<std::pair<uint64_t, uint32_t>> Ref;
+
+static uint64_t rand_delay(){
+    switch(rand() % 5){
+    case 0: return rand() % 10;
+    case 1: return rand() % 1000;
+    case 2: return rand() % 100000;
+    case 3: return (uint64_t)rand() * 1000;
+    default: return ((uint64_t)1 << 32) + rand();    // overflow list
+    }
+};
+
+static void test_case(uint64_t start, uint32_t n, uint32_t rounds){
+    TimerWheel *tw = new TimerWheel();
+    tw_init(tw, start);
+    std::vector<Item> items(n);
+    Ref ref;
+    uint64_t now = start;
+    for(uint32_t i = 0; i < n; ++i){
+        items[i].id = i;
+    }
+
+    for(uint32_t r = 0; r < rounds; ++r){
+        // arm, re-arm or cancel some timers
+        for(uint32_t k = 0; k < 20; ++k){
+            Item &it = items[rand() % n];
+            if(tw_active(&it.timer)){
+                ref.erase(ref.find({it.timer.expire, it.id}));
+            }
+            if(rand() % 4 == 0){
+                if(tw_active(&it.timer)){
+                    tw_del(tw, &it.timer);
+                }
+                continue;
+            }
+            uint64_t expire = now + rand_delay();
+            tw_add(tw, &it.timer, expire);
+            ref.insert({expire, it.id});
+        }
+        assert(tw->size == ref.size());
+
+        // the wakeup is never late
+        uint64_t next = tw_next(tw);
+        if(!ref.empty()){
+            assert(next <= ref.begin()->first);
+        } else {
+            assert(next == (uint64_t)-1);
+        }
+        assert(tw_next_expire(tw) == (ref.empty() ? (uint64_t)-1 : ref.begin()->first));
+
+        // advance the clock, sometimes to the next wakeup
+        now += (r % 3 == 0 && next != (uint64_t)-1 && next > now) ? next - now : rand_delay();
+        // with a backlog left halfway, the earliest expiry is still exact
+        for(uint32_t popped = 0; TWTimer *timer = tw_pop_expired(tw, now); ++popped){
+            Item *it = (Item *)timer;
+            assert(timer->expire <= now);
+            assert(ref.count({timer->expire, it->id}) == 1);
+            ref.erase(ref.find({timer->expire, it->id}));
+            if(popped == 2){
+                assert(tw_next_expire(tw) == (ref.empty() ? (uint64_t)-1 : ref.begin()->first));
+            }
+        }
+        assert(ref.empty() || ref.begin()->first > now);
+        assert(tw->size == ref.size());
+    }
+    delete tw;
+};
+
+int main(){
+    srand(1);
+    test_case(0, 100, 2000);
+    test_case(123456789, 1000, 2000);
+    test_case(((uint64_t)1 << 32) - 1000, 500, 2000);
+    printf("OK\n");
+    return 0;
+};
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <string>
+#include <vector>
+#include "zset.h"
+#include "thread_pool.h"
+
+// the reference: members by name and by (score, name)
+struct Ref {
+    std::map<std::string, double> scores;
+    std::set<std::pair<double, std::string>> order;
+};
+
+static void ref_insert(Ref &ref, const std::string &name, double score){
+    auto it = ref.scores.find(name);
+    if(it != ref.scores.end()){
+        ref.order.erase({it->second, name});
+    }
+    ref.scores[name] = score;
+    ref.order.insert({score, name});
+};
+
+static bool ref_remove(Ref &ref, const std::string &name){
+    auto it = ref.scores.find(name);
+    if(it == ref.scores.end()){
+        return false;
+    }
+    ref.order.erase({it->second, name});
+    ref.scores.erase(it);
+    return true;
+};
+
+static std::string rand_name(uint32_t max_len){
+    std::string name = "m" + std::to_string(rand() % 300);
+    if(rand() % 50 == 0){
+        name += std::string(rand() % max_len, 'x');
+    }
+    return name;
+};
+
+// walks the whole set forward, and a few random seeks with offsets
+static void verify(ZSet *zset, Ref &ref){
+    assert(zset_size(zset) == ref.scores.size());
+    for(auto &kv : ref.scores){
+        double score = 0;
+        assert(zset_score(zset, kv.first.data(), kv.first.size(), &score));
+        assert(score == kv.second);
+    }
+
+    std::vector<std::pair<double, std::string>> all(ref.order.begin(), ref.order.end());
+    ZIter it = zset_seekge(zset, -1e300, "", 0);
+    int64_t rank = 0;
+    for(auto &m : all){
+        assert(zset_iter_ok(&it));
+        ZMember got = zset_iter_get(&it);
+        assert(got.score == m.first && std::string(got.name, got.len) == m.second);
+        assert(zset_iter_rank(&it) == rank);
+        assert(zset_rank(zset, m.second.data(), m.second.size()) == rank);
+        ZIter at = zset_at(zset, rank);
+        assert(zset_iter_ok(&at) && zset_iter_get(&at).name == got.name);
+        zset_iter_offset(&it, +1);
+        rank++;
+    }
+    assert(!zset_iter_ok(&it));
+    assert(zset_iter_rank(&it) == (int64_t)all.size());
+    assert(zset_rank(zset, "none", 4) == -1);
+    ZIter past = zset_at(zset, all.size());
+    assert(!zset_iter_ok(&past));
+
+    // the scores are small integers, the sums are exact
+    for(int i = 0; i < 20 && !all.empty(); ++i){
+        int64_t lo = rand() % all.size(), hi = lo + rand() % 200;
+        double sum = 0;
+        for(int64_t j = lo; j < hi && j < (int64_t)all.size(); ++j){
+            sum += all[j].first;
+        }
+        assert(zset_range_sum(zset, lo, hi) == sum);
+    }
+
+    for(int i = 0; i < 20; ++i){
+        double score = rand() % 100;
+        std::string name = rand_name(10);
+        int64_t offset = rand() % 11 - 5;
+        auto ge = ref.order.lower_bound({score, name});
+        int64_t idx = std::distance(ref.order.begin(), ge) + offset;
+
+        ZIter it = zset_seekge(zset, score, name.data(), name.size());
+        zset_iter_offset(&it, offset);
+        // like a NULL node, an iterator past the end stays there
+        if(ge == ref.order.end() || idx < 0 || idx >= (int64_t)all.size()){
+            assert(!zset_iter_ok(&it));
+            continue;
+        }
+        assert(zset_iter_ok(&it));
+        ZMember got = zset_iter_get(&it);
+        assert(got.score == all[idx].first && std::string(got.name, got.len) == all[idx].second);
+    }
+};
+
+static void test_random(uint32_t rounds){
+    ZSet zset;
+    Ref ref;
+    bool promoted = false;
+    for(uint32_t r = 0; r < rounds; ++r){
+        std::string name = rand_name(g_zset_pack_max_name + 10);
+        if(rand() % 3 == 0){
+            bool removed = zset_remove(&zset, name.data(), name.size());
+            assert(removed == ref_remove(ref, name));
+        } else {
+            double score = rand() % 100;
+            bool added = zset_insert(&zset, name.data(), name.size(), score);
+            assert(added == (ref.scores.count(name) == 0));
+            ref_insert(ref, name, score);
+        }
+        promoted |= zset.encoding == ZSET_TREE;
+        if(r % 97 == 0){
+            verify(&zset, ref);
+        }
+    }
+    verify(&zset, ref);
+    assert(promoted);
+    zset_clear(&zset);
+    assert(zset.bytes == 0);
+};
+
+// a set stays packed within both limits, either limit converts it
+static void test_promotion(){
+    ZSet zset;
+    for(uint32_t i = 0; i < g_zset_pack_max_entries; ++i){
+        std::string name = "k" + std::to_string(i);
+        zset_insert(&zset, name.data(), name.size(), i);
+        assert(zset.encoding == ZSET_PACKED);
+    }
+    zset_insert(&zset, "k0", 2, 100);
+    assert(zset.encoding == ZSET_PACKED);
+    zset_insert(&zset, "new", 3, 1);
+    assert(zset.encoding == ZSET_TREE);
+    assert(zset_size(&zset) == g_zset_pack_max_entries + 1);
+    zset_clear(&zset);
+
+    ZSet small;
+    zset_insert(&small, "a", 1, 1);
+    std::string big(g_zset_pack_max_name + 1, 'b');
+    zset_insert(&small, big.data(), big.size(), 2);
+    assert(small.encoding == ZSET_TREE && zset_size(&small) == 2);
+    zset_clear(&small);
+
+    // limits a packed set's 32 bit offsets can't hold are refused
+    assert(zset_pack_limits_ok(g_zset_pack_max_entries, g_zset_pack_max_name));
+    assert(zset_pack_limits_ok(10000, 65535));
+    assert(!zset_pack_limits_ok(100000, 65535));
+    assert(!zset_pack_limits_ok(UINT32_MAX, 0));
+};
+
+// offsets past either end, up to the int64 limits, in both encodings
+static void test_far_offset(){
+    ZSet zset;
+    for(uint32_t n : {10u, g_zset_pack_max_entries + 1}){
+        for(uint32_t i = zset_size(&zset); i < n; ++i){
+            std::string name = "k" + std::to_string(i);
+            zset_insert(&zset, name.data(), name.size(), i);
+        }
+        int64_t size = (int64_t)zset_size(&zset);
+        for(int64_t offset : {size, -size, INT64_MAX, INT64_MIN, INT64_MAX - 1}){
+            for(int64_t rank : {(int64_t)0, size / 2, size - 1}){
+                ZIter it = zset_at(&zset, rank);
+                zset_iter_offset(&it, offset);
+                assert(!zset_iter_ok(&it));
+            }
+        }
+        ZIter it = zset_at(&zset, 0);
+        zset_iter_offset(&it, size - 1);
+        assert(zset_iter_ok(&it) && zset_iter_rank(&it) == size - 1);
+        zset_iter_offset(&it, 1 - size);
+        assert(zset_iter_ok(&it) && zset_iter_rank(&it) == 0);
+    }
+    assert(zset.encoding == ZSET_TREE);
+    zset_clear(&zset);
+};
+
+// batches with repeated names into empty, packed and tree sets; the large
+// one is sorted on the pool
+static void test_bulk(ThreadPool *pool){
+    uint32_t sizes[] = {10, 300, 1000, 5000, 200000};
+    ZSet zset;
+    Ref ref;
+    for(uint32_t n : sizes){
+        std::vector<std::string> names(n);
+        std::vector<ZMember> members(n);
+        size_t expect = 0;
+        for(uint32_t i = 0; i < n; ++i){
+            names[i] = "b" + std::to_string(rand() % (n * 2));
+            members[i] = ZMember{(double)(rand() % 1000), names[i].data(), names[i].size()};
+        }
+        if(n == 10){
+            // pre-sorted input
+            std::sort(members.begin(), members.end(), [](const ZMember &l, const ZMember &r){
+                return l.score < r.score;
+            });
+        }
+        for(const ZMember &m : members){
+            std::string name(m.name, m.len);
+            expect += ref.scores.count(name) == 0;
+            ref_insert(ref, name, m.score);
+        }
+        assert(zset_insert_bulk(&zset, members.data(), n, pool) == expect);
+        verify(&zset, ref);
+        // the hash slots are counted, as resized by the batch
+        assert(zset.encoding == ZSET_PACKED || zset.hmap_bytes == hm_bytes(&zset.hmap));
+    }
+    // the accounting matches the nodes, the slots are kept
+    assert(zset.hmap_bytes > 0);
+    for(auto &kv : ref.scores){
+        assert(zset_remove(&zset, kv.first.data(), kv.first.size()));
+    }
+    assert(zset_size(&zset) == 0 && zset.bytes == zset.hmap_bytes);
+    assert(zset.hmap_bytes == hm_bytes(&zset.hmap));
+    zset_clear(&zset);
+    assert(zset.bytes == 0);
+};
+
+int main(){
+    srand(1);
+    ThreadPool pool;
+    thread_pool_init(&pool, 3);
+    test_bulk(&pool);
+    test_bulk(NULL);
+    test_promotion();
+    test_far_offset();
+    test_random(20000);
+    g_zset_pack_max_entries = 500;
+    test_random(20000);
+    g_zset_pack_max_entries = 8;
+    g_zset_pack_max_name = 8;
+    test_random(20000);
+    printf("zset tests passed\n");
+    return 0;
+}
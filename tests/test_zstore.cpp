@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "zstore.h"
+
+typedef std::map<std::string, double> Ref;
+
+static double combine(uint32_t agg, double acc, double score){
+    if(agg == ZSTORE_MIN){
+        return std::min(acc, score);
+    }
+    if(agg == ZSTORE_MAX){
+        return std::max(acc, score);
+    }
+    double sum = acc + score;
+    return isnan(sum) ? 0 : sum;
+};
+
+static Ref ref_merge(uint32_t op, uint32_t agg, const std::vector<Ref> &sets,
+    const std::vector<double> &weights)
+{
+    std::map<std::string, std::pair<double, size_t>> acc;
+    for(size_t i = 0; i < sets.size(); ++i){
+        for(auto &kv : sets[i]){
+            double score = kv.second * weights[i];
+            score = isnan(score) ? 0 : score;
+            auto it = acc.find(kv.first);
+            if(it == acc.end()){
+                acc[kv.first] = {score, 1};
+            } else {
+                it->second.first = combine(agg, it->second.first, score);
+                it->second.second++;
+            }
+        }
+    }
+    Ref out;
+    for(auto &kv : acc){
+        if(op == ZSTORE_UNION || kv.second.second == sets.size()){
+            out[kv.first] = kv.second.first;
+        }
+    }
+    return out;
+};
+
+static void check(const ZStore &job, const Ref &ref){
+    assert(job.out.size() == ref.size());
+    for(size_t i = 0; i < job.out.size(); ++i){
+        const ZMember &m = job.out[i];
+        auto it = ref.find(std::string(m.name, m.len));
+        assert(it != ref.end() && it->second == m.score);
+        if(i > 0){
+            const ZMember &p = job.out[i - 1];
+            assert(p.score < m.score || (p.score == m.score &&
+                std::string(p.name, p.len) < std::string(m.name, m.len)));
+        }
+    }
+};
+
+static std::atomic<bool> g_finished{false};
+
+static void on_finished(ZStore *){
+    g_finished = true;
+};
+
+static void test_merge(ThreadPool *pool, size_t nsets, uint32_t range){
+    std::vector<ZSet> zsets(nsets);
+    std::vector<Ref> sets(nsets);
+    std::vector<double> weights(nsets);
+    for(size_t i = 0; i < nsets; ++i){
+        weights[i] = i == 0 ? 1 : rand() % 5 - 2;
+        uint32_t n = rand() % range;
+        for(uint32_t k = 0; k < n; ++k){
+            std::string name = "m" + std::to_string(rand() % range);
+            double score = rand() % 100 - 50;
+            if(rand() % 50 == 0){
+                score = rand() % 2 ? INFINITY : -INFINITY;
+            }
+            zset_insert(&zsets[i], name.data(), name.size(), score);
+            sets[i][name] = score;
+        }
+    }
+    for(uint32_t op : {ZSTORE_UNION, ZSTORE_INTER}){
+        for(uint32_t agg : {ZSTORE_SUM, ZSTORE_MIN, ZSTORE_MAX}){
+            Ref ref = ref_merge(op, agg, sets, weights);
+            for(bool async : {false, true}){
+                ZStore job;
+                job.op = op;
+                job.aggregate = agg;
+                job.inputs.resize(nsets);
+                for(size_t i = 0; i < nsets; ++i){
+                    job.inputs[i].weight = weights[i];
+                    zstore_snapshot(&job.inputs[i], &zsets[i]);
+                }
+                assert(zstore_size(&job) >= ref.size() || op == ZSTORE_INTER);
+                if(async){
+                    g_finished = false;
+                    zstore_start(&job, pool, &on_finished);
+                    while(!g_finished){
+                        usleep(100);
+                    }
+                } else {
+                    zstore_run(&job);
+                }
+                check(job, ref);
+            }
+        }
+    }
+    for(ZSet &zset : zsets){
+        zset_clear(&zset);
+    }
+};
+
+int main(){
+    srand(1);
+    ThreadPool pool;
+    thread_pool_init(&pool, 4);
+    for(int i = 0; i < 30; ++i){
+        test_merge(&pool, 1 + rand() % 4, 1 + rand() % 300);
+    }
+    test_merge(&pool, 3, 50000);
+    printf("zstore tests passed\n");
+    return 0;
+}